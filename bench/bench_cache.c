@@ -0,0 +1,94 @@
+/*
+ * Reads through the cache budget of -o cache with a working set larger than it: 4 KiB random reads of a hot file,
+ * between 128 KiB reads of a sequential scan of a much larger file. Run without a budget, with one larger than the hot
+ * file and with one smaller than it. Next to each result are the hits, misses, evictions and readahead chunks counted
+ * while reading. One JSON line for the hot reads and one for the scan per run.
+ *
+ * usage: bench_cache [scan passes]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define HOT_SIZE (8 * 1024 * 1024)
+#define SCAN_SIZE (64 * 1024 * 1024)
+#define REQUEST (128 * 1024)
+#define HOT_READS 8
+
+/*
+ * Sums the cache counters over the stripes
+*/
+static CacheCounters counted(void) {
+	size_t stride = sizeof(CacheCounters);
+	return (CacheCounters) {
+		.hits = sum_stripes(&cache_counters[0].hits, stride),
+		.misses = sum_stripes(&cache_counters[0].misses, stride),
+		.evictions = sum_stripes(&cache_counters[0].evictions, stride),
+		.readahead = sum_stripes(&cache_counters[0].readahead, stride),
+	};
+}
+
+static void write_file(const char *path, size_t size, char *buf) {
+	CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+	for (size_t at = 0; at < size; at += REQUEST) {
+		memset(buf, 'a' + at / REQUEST % 26, REQUEST);
+		CHECK(dm510fs_oper.write(path, buf, REQUEST, (off_t) at, NULL) == REQUEST);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t passes = argc > 1 ? strtoull(argv[1], NULL, 0) : 2;
+	static const size_t budgets[] = { 0, 16, 4 };
+	size_t scans = passes * (SCAN_SIZE / REQUEST);
+	uint64_t *hot = malloc(scans * HOT_READS * sizeof(uint64_t));
+	uint64_t *scan = malloc(scans * sizeof(uint64_t));
+	char *buf = malloc(REQUEST);
+	CHECK(hot != NULL && scan != NULL && buf != NULL && scans > 0);
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t c = 0; c < sizeof(budgets) / sizeof(budgets[0]); c++) {
+		options.cache_size = budgets[c] * 1024 * 1024;
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		mount_fs();
+		write_file("/hot", HOT_SIZE, buf);
+		write_file("/scan", SCAN_SIZE, buf);
+		struct fuse_file_info hot_fi = { .flags = O_RDONLY };
+		struct fuse_file_info scan_fi = { .flags = O_RDONLY };
+		CHECK(dm510fs_oper.open("/hot", &hot_fi) == 0);
+		CHECK(dm510fs_oper.open("/scan", &scan_fi) == 0);
+
+		CacheCounters before = counted();
+		unsigned int seed = 1;
+		uint64_t hot_total = 0, scan_total = 0;
+		for (size_t k = 0; k < scans; k++) {
+			off_t at = (off_t) (k % (SCAN_SIZE / REQUEST)) * REQUEST;
+			uint64_t started = now_ns();
+			CHECK(dm510fs_oper.read(NULL, buf, REQUEST, at, &scan_fi) == REQUEST);
+			scan[k] = now_ns() - started;
+			scan_total += scan[k];
+			for (int r = 0; r < HOT_READS; r++) {
+				at = (off_t) (rand_r(&seed) % (HOT_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+				started = now_ns();
+				CHECK(dm510fs_oper.read(NULL, buf, BLOCK_SIZE, at, &hot_fi) == BLOCK_SIZE);
+				hot[k * HOT_READS + r] = now_ns() - started;
+				hot_total += hot[k * HOT_READS + r];
+			}
+		}
+		CacheCounters after = counted();
+		dm510fs_oper.release(NULL, &hot_fi);
+		dm510fs_oper.release(NULL, &scan_fi);
+		unmount_fs();
+
+		char params[256];
+		snprintf(params, sizeof(params), "\"budget_mib\": %zu, \"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, "
+				 "\"readahead\": %llu", budgets[c], (unsigned long long) (after.hits - before.hits),
+				 (unsigned long long) (after.misses - before.misses), (unsigned long long) (after.evictions - before.evictions),
+				 (unsigned long long) (after.readahead - before.readahead));
+		print_result(stdout, "hot", params, scans * HOT_READS, hot_total, hot, scans * HOT_READS);
+		print_result(stdout, "scan", params, scans, scan_total, scan, scans);
+	}
+	free(hot);
+	free(scan);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * GB/s of each Caesar kernel the CPU runs, forced one at a time rather than picked by select_caesar_kernel,
+ * over buffers that fit in L1, L2 and the last level cache and one that does not. One JSON line per kernel and size.
+ *
+ * usage: bench_caesar [bytes per run]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+typedef struct Kernel {
+	const char *name;
+	void (*run)(char *dst, const char *src, size_t length, int key);
+	bool supported;
+} Kernel;
+
+int main(int argc, char *argv[]) {
+	Kernel kernels[] = {
+		{ "scalar", caesar_scalar, true },
+#if defined(__x86_64__) || defined(__i386__)
+		{ "sse2", caesar_sse2, __builtin_cpu_supports("sse2") },
+		{ "avx2", caesar_avx2, __builtin_cpu_supports("avx2") },
+#endif
+	};
+	static const size_t sizes[] = { 4096, 128 * 1024, 4 * 1024 * 1024, 256 * 1024 * 1024 };
+	uint64_t total = argc > 1 ? strtoull(argv[1], NULL, 0) : (uint64_t) 512 << 20;
+	size_t largest = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	char *src = malloc(largest);
+	char *dst = malloc(largest);
+	CHECK(src != NULL && dst != NULL);
+	unsigned int seed = 1;
+	for (size_t b = 0; b < largest; b++) {
+		src[b] = (char) rand_r(&seed);
+	}
+	// Touch the output, so page faults are not measured
+	memset(dst, 0, largest);
+
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (!kernels[k].supported) {
+			continue;
+		}
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			size_t runs = total / sizes[s] > 0 ? total / sizes[s] : 1;
+			uint64_t *samples = malloc(runs * sizeof(uint64_t));
+			CHECK(samples != NULL);
+			kernels[k].run(dst, src, sizes[s], 3);
+			uint64_t started = now_ns();
+			for (size_t r = 0; r < runs; r++) {
+				uint64_t run_started = now_ns();
+				kernels[k].run(dst, src, sizes[s], 3);
+				samples[r] = now_ns() - run_started;
+			}
+			uint64_t elapsed = now_ns() - started;
+			char params[128];
+			snprintf(params, sizeof(params), "\"kernel\": \"%s\", \"bytes\": %zu, \"gb_per_s\": %.2f", kernels[k].name,
+					 sizes[s], (double) runs * sizes[s] / elapsed);
+			print_result(stdout, "caesar", params, runs, elapsed, samples, runs);
+			free(samples);
+		}
+	}
+	free(src);
+	free(dst);
+	return 0;
+}
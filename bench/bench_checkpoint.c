@@ -0,0 +1,86 @@
+/*
+ * Foreground latency of 4 KiB random reads and writes while a background thread rewrites another file in 1 MiB
+ * writes, so the journal keeps growing and checkpoints keep running. Compared with checkpoints only when the journal
+ * passes its size limit (checkpoint_s 0), once a second, and every 50 ms. One JSON line per run for reads and for writes.
+ *
+ * usage: bench_checkpoint [foreground operations]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define FILE_SIZE (64 * 1024 * 1024)
+#define CHUNK (1024 * 1024)
+
+static volatile bool stop;
+
+/*
+ * Rewrites the background file over and over until stopped
+*/
+static void *background(void *arg) {
+	(void) arg;
+	char *buf = malloc(CHUNK);
+	CHECK(buf != NULL);
+	memset(buf, 'b', CHUNK);
+	for (off_t at = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); at = (at + CHUNK) % FILE_SIZE) {
+		CHECK(dm510fs_oper.write("/bg", buf, CHUNK, at, NULL) == CHUNK);
+	}
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	size_t ops = argc > 1 ? strtoull(argv[1], NULL, 0) : 50000;
+	static const double intervals[] = { 0, 1, 0.05 };
+	uint64_t *reads = malloc(ops * sizeof(uint64_t));
+	uint64_t *writes = malloc(ops * sizeof(uint64_t));
+	char *buf = malloc(CHUNK);
+	CHECK(reads != NULL && writes != NULL && buf != NULL);
+	memset(buf, 'f', CHUNK);
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t c = 0; c < sizeof(intervals) / sizeof(intervals[0]); c++) {
+		options.checkpoint_interval = intervals[c];
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		mount_fs();
+		CHECK(dm510fs_oper.mknod("/fg", S_IFREG | 0644, 0) == 0);
+		CHECK(dm510fs_oper.mknod("/bg", S_IFREG | 0644, 0) == 0);
+		for (off_t at = 0; at < FILE_SIZE; at += CHUNK) {
+			CHECK(dm510fs_oper.write("/fg", buf, CHUNK, at, NULL) == CHUNK);
+			CHECK(dm510fs_oper.write("/bg", buf, CHUNK, at, NULL) == CHUNK);
+		}
+
+		stop = false;
+		pthread_t id;
+		CHECK(pthread_create(&id, NULL, background, NULL) == 0);
+		struct fuse_file_info fi = { .flags = O_RDWR };
+		CHECK(dm510fs_oper.open("/fg", &fi) == 0);
+		unsigned int seed = 1;
+		uint64_t read_total = 0, write_total = 0;
+		for (size_t k = 0; k < ops; k++) {
+			off_t at = (off_t) (rand_r(&seed) % (FILE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+			uint64_t started = now_ns();
+			CHECK(dm510fs_oper.read(NULL, buf, BLOCK_SIZE, at, &fi) == BLOCK_SIZE);
+			reads[k] = now_ns() - started;
+			at = (off_t) (rand_r(&seed) % (FILE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE;
+			started = now_ns();
+			CHECK(dm510fs_oper.write(NULL, buf, BLOCK_SIZE, at, &fi) == BLOCK_SIZE);
+			writes[k] = now_ns() - started;
+			read_total += reads[k];
+			write_total += writes[k];
+		}
+		dm510fs_oper.release(NULL, &fi);
+		__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+		pthread_join(id, NULL);
+		unmount_fs();
+
+		char params[64];
+		snprintf(params, sizeof(params), "\"checkpoint_s\": %g", intervals[c]);
+		print_result(stdout, "read", params, ops, read_total, reads, ops);
+		print_result(stdout, "write", params, ops, write_total, writes, ops);
+	}
+	free(reads);
+	free(writes);
+	free(buf);
+	return 0;
+}
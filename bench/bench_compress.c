@@ -0,0 +1,94 @@
+/*
+ * Throughput of writing and reading files of 512 KiB in 128 KiB requests, text-like and random, with and without
+ * compression. The files are small enough to be compressed whole, as only so many clusters of a file are.
+ * Next to each result are the compression ratio, the file blocks in compressed clusters over the blocks the clusters
+ * take, and the blocks the files use on the image. One JSON line per direction and run.
+ *
+ * usage: bench_compress [file size in MiB]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define REQUEST (128 * 1024)
+#define FILE_SIZE (512 * 1024)
+
+/*
+ * Fills a buffer with words of lower case letters, which compress, or with random bytes, which do not
+*/
+static void fill(char *buf, size_t size, bool text, unsigned int *seed) {
+	static const char *words[] = { "the ", "block ", "journal ", "extent ", "of ", "inode ", "and ", "a ", "file\n" };
+	for (size_t b = 0; b < size;) {
+		if (!text) {
+			buf[b++] = (char) rand_r(seed);
+			continue;
+		}
+		for (const char *w = words[rand_r(seed) % 9]; *w != '\0' && b < size; w++) {
+			buf[b++] = *w;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	size_t size = (argc > 1 ? strtoull(argv[1], NULL, 0) : 64) * 1024 * 1024;
+	size_t requests = size / REQUEST;
+	char *data = malloc(size);
+	char *out = malloc(REQUEST);
+	uint64_t *samples = malloc(requests * sizeof(uint64_t));
+	CHECK(data != NULL && out != NULL && samples != NULL && size % FILE_SIZE == 0 && requests > 0);
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	unsigned int seed = 1;
+	for (int text = 1; text >= 0; text--) {
+		fill(data, size, text, &seed);
+		for (int compress = 0; compress < 2; compress++) {
+			options.compress = compress;
+			unlink(IMAGE_FILE);
+			unlink(JOURNAL_FILE);
+			mount_fs();
+			struct statvfs empty;
+			CHECK(dm510fs_oper.statfs("/", &empty) == 0);
+			char path[64];
+			for (size_t f = 0; f < size / FILE_SIZE; f++) {
+				snprintf(path, sizeof(path), "/f%zu", f);
+				CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+			}
+
+			uint64_t total = 0;
+			for (size_t k = 0; k < requests; k++) {
+				snprintf(path, sizeof(path), "/f%zu", k * REQUEST / FILE_SIZE);
+				uint64_t started = now_ns();
+				CHECK(dm510fs_oper.write(path, data + k * REQUEST, REQUEST, (off_t) (k * REQUEST % FILE_SIZE), NULL) == REQUEST);
+				samples[k] = now_ns() - started;
+				total += samples[k];
+			}
+			journal_wait(journal_last);
+			struct statvfs st;
+			CHECK(dm510fs_oper.statfs("/", &st) == 0);
+			uint64_t packed = super->packed_blocks;
+			uint64_t stored = super->packed_stored;
+			char params[256];
+			snprintf(params, sizeof(params), "\"data\": \"%s\", \"compress\": %d, \"ratio\": %.2f, \"used_blocks\": %llu, "
+					 "\"mib_per_s\": %.1f", text ? "text" : "random", compress, stored > 0 ? (double) packed / stored : 1.0,
+					 (unsigned long long) (empty.f_bfree - st.f_bfree), size / 1048576.0 / (total / 1e9));
+			print_result(stdout, "write", params, requests, total, samples, requests);
+
+			total = 0;
+			for (size_t k = 0; k < requests; k++) {
+				snprintf(path, sizeof(path), "/f%zu", k * REQUEST / FILE_SIZE);
+				uint64_t started = now_ns();
+				CHECK(dm510fs_oper.read(path, out, REQUEST, (off_t) (k * REQUEST % FILE_SIZE), NULL) == REQUEST);
+				samples[k] = now_ns() - started;
+				total += samples[k];
+				CHECK(memcmp(out, data + k * REQUEST, REQUEST) == 0);
+			}
+			snprintf(params, sizeof(params), "\"data\": \"%s\", \"compress\": %d, \"mib_per_s\": %.1f",
+					 text ? "text" : "random", compress, size / 1048576.0 / (total / 1e9));
+			print_result(stdout, "read", params, requests, total, samples, requests);
+			unmount_fs();
+		}
+	}
+	free(data);
+	free(out);
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Throughput of writing files of 1 MiB through handles, where every group of 1, 4 or 16 files holds the same bytes,
+ * with and without deduplication. Each file is released after it is written, which is when its extents are shared, so
+ * the time includes it. Next to each result are the deduplication ratio, the file blocks written over the blocks they
+ * use on the image, and the references the sharing saved. One JSON line per run.
+ *
+ * usage: bench_dedup [total MiB]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define FILE_SIZE (1024 * 1024)
+
+int main(int argc, char *argv[]) {
+	size_t files = argc > 1 ? strtoull(argv[1], NULL, 0) : 64;
+	static const size_t copies[] = { 1, 4, 16 };
+	char *data = malloc(FILE_SIZE);
+	uint64_t *samples = malloc(files * sizeof(uint64_t));
+	CHECK(data != NULL && samples != NULL && files > 0);
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t c = 0; c < sizeof(copies) / sizeof(copies[0]); c++) {
+		for (int dedup = 0; dedup < 2; dedup++) {
+			options.dedup = dedup;
+			unlink(IMAGE_FILE);
+			unlink(JOURNAL_FILE);
+			mount_fs();
+			struct statvfs empty;
+			CHECK(dm510fs_oper.statfs("/", &empty) == 0);
+			uint64_t total = 0;
+			for (size_t f = 0; f < files; f++) {
+				// The contents of a group, different from every other group
+				unsigned int seed = f / copies[c] + 1;
+				for (size_t b = 0; b < FILE_SIZE; b++) {
+					data[b] = (char) rand_r(&seed);
+				}
+				char path[64];
+				snprintf(path, sizeof(path), "/f%zu", f);
+				uint64_t started = now_ns();
+				CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+				struct fuse_file_info fi = { .flags = O_WRONLY };
+				CHECK(dm510fs_oper.open(path, &fi) == 0);
+				CHECK(dm510fs_oper.write(NULL, data, FILE_SIZE, 0, &fi) == FILE_SIZE);
+				CHECK(dm510fs_oper.release(NULL, &fi) == 0);
+				samples[f] = now_ns() - started;
+				total += samples[f];
+			}
+			journal_wait(journal_last);
+			struct statvfs st;
+			CHECK(dm510fs_oper.statfs("/", &st) == 0);
+			uint64_t used = empty.f_bfree - st.f_bfree;
+			uint64_t written = (uint64_t) files * FILE_SIZE / BLOCK_SIZE;
+			char params[256];
+			snprintf(params, sizeof(params), "\"copies\": %zu, \"dedup\": %d, \"ratio\": %.2f, \"used_blocks\": %llu, "
+					 "\"shared_blocks\": %llu, \"mib_per_s\": %.1f", copies[c], dedup, used > 0 ? (double) written / used : 0.0,
+					 (unsigned long long) used, (unsigned long long) super->shared_blocks,
+					 files * (FILE_SIZE / 1048576.0) / (total / 1e9));
+			print_result(stdout, "write", params, files, total, samples, files);
+			unmount_fs();
+		}
+	}
+	free(data);
+	free(samples);
+	return 0;
+}
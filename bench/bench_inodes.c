@@ -0,0 +1,73 @@
+/*
+ * What an inode costs, and getattr over every file in the order it was made, as an ls -l of the tree would.
+ * For 10k, 100k and 1M files the image is measured: its inode records, its names, its index buckets, and the disk
+ * space the sparse image file grew by, all per inode. One JSON line per file count.
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define FILES_PER_DIR 1000
+
+static void file_path(char *path, size_t size, size_t k) {
+	snprintf(path, size, "/dir%04zu/file-%07zu.txt", k / FILES_PER_DIR, k);
+}
+
+/*
+ * Disk space the image file takes, in bytes
+*/
+static uint64_t image_disk_bytes(void) {
+	struct stat st;
+	CHECK(stat(IMAGE_FILE, &st) == 0);
+	return (uint64_t) st.st_blocks * 512;
+}
+
+int main(void) {
+	static const size_t counts[] = { 10000, 100000, 1000000 };
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		size_t files = counts[c];
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		mount_fs();
+		unmount_fs();
+		uint64_t empty_disk = image_disk_bytes();
+		uint64_t empty_names = 0;
+
+		mount_fs();
+		empty_names = super->name_arena_used;
+		char path[64];
+		for (size_t k = 0; k < files; k++) {
+			if (k % FILES_PER_DIR == 0) {
+				snprintf(path, sizeof(path), "/dir%04zu", k / FILES_PER_DIR);
+				CHECK(dm510fs_oper.mkdir(path, 0755) == 0);
+			}
+			file_path(path, sizeof(path), k);
+			CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+		}
+		size_t inodes = super->used_inodes;
+		double name_bytes = (double) (super->name_arena_used - empty_names) / inodes;
+		double index_bytes = (double) super->index_buckets * sizeof(int) / inodes;
+
+		uint64_t *samples = malloc(files * sizeof(uint64_t));
+		CHECK(samples != NULL);
+		struct stat st;
+		uint64_t started = now_ns();
+		for (size_t k = 0; k < files; k++) {
+			file_path(path, sizeof(path), k);
+			uint64_t getattr_started = now_ns();
+			CHECK(dm510fs_oper.getattr(path, &st) == 0);
+			samples[k] = now_ns() - getattr_started;
+		}
+		uint64_t elapsed = now_ns() - started;
+		unmount_fs();
+
+		char params[256];
+		snprintf(params, sizeof(params), "\"files\": %zu, \"inode_bytes\": %zu, \"name_bytes\": %.1f, \"index_bytes\": %.1f, "
+				 "\"disk_bytes_per_inode\": %.1f", files, sizeof(Inode), name_bytes, index_bytes,
+				 (double) (image_disk_bytes() - empty_disk) / inodes);
+		print_result(stdout, "getattr_scan", params, files, elapsed, samples, files);
+		free(samples);
+	}
+	return 0;
+}
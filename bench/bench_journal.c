@@ -0,0 +1,82 @@
+/*
+ * Metadata-heavy work through the journal: each thread creates files in a directory of its own and unlinks every
+ * other one, waiting with fsyncdir for the commit after every batch of operations. Threads waiting together share a
+ * group commit. Runs each batch size, 0 for never waiting, with each commit interval and thread count.
+ * One JSON line per run, latencies include the waits.
+ *
+ * usage: bench_journal [operations per thread]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+typedef struct Job {
+	int thread;
+	size_t ops;
+	size_t batch;
+	uint64_t *samples;
+} Job;
+
+static void *run_job(void *arg) {
+	Job *job = arg;
+	char path[64];
+	snprintf(path, sizeof(path), "/t%d", job->thread);
+	CHECK(dm510fs_oper.mkdir(path, 0755) == 0);
+	struct fuse_file_info dir = { 0 };
+	CHECK(dm510fs_oper.opendir(path, &dir) == 0);
+	for (size_t k = 0; k < job->ops; k++) {
+		uint64_t started = now_ns();
+		if (k % 2 == 1) {
+			snprintf(path, sizeof(path), "/t%d/f%zu", job->thread, k - 1);
+			CHECK(dm510fs_oper.unlink(path) == 0);
+		} else {
+			snprintf(path, sizeof(path), "/t%d/f%zu", job->thread, k);
+			CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+		}
+		if (job->batch > 0 && (k + 1) % job->batch == 0) {
+			CHECK(dm510fs_oper.fsyncdir(NULL, 0, &dir) == 0);
+		}
+		job->samples[k] = now_ns() - started;
+	}
+	dm510fs_oper.releasedir(NULL, &dir);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	size_t ops = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000;
+	static const size_t batches[] = { 1, 16, 256, 0 };
+	static const double intervals[] = { 0, 0.005, 5 };
+	static const int thread_counts[] = { 1, 8 };
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t c = 0; c < sizeof(intervals) / sizeof(intervals[0]); c++) {
+		for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+			for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+				int threads = thread_counts[t];
+				options.commit_interval = intervals[c];
+				unlink(IMAGE_FILE);
+				unlink(JOURNAL_FILE);
+				mount_fs();
+				Job jobs[8];
+				pthread_t ids[8];
+				uint64_t *samples = malloc(threads * ops * sizeof(uint64_t));
+				CHECK(samples != NULL);
+				uint64_t started = now_ns();
+				for (int j = 0; j < threads; j++) {
+					jobs[j] = (Job) { j, ops, batches[b], samples + j * ops };
+					CHECK(pthread_create(&ids[j], NULL, run_job, &jobs[j]) == 0);
+				}
+				for (int j = 0; j < threads; j++) {
+					pthread_join(ids[j], NULL);
+				}
+				uint64_t elapsed = now_ns() - started;
+				unmount_fs();
+
+				char params[128];
+				snprintf(params, sizeof(params), "\"threads\": %d, \"batch\": %zu, \"commit_s\": %g", threads, batches[b], intervals[c]);
+				print_result(stdout, "metadata", params, threads * ops, elapsed, samples, threads * ops);
+				free(samples);
+			}
+		}
+	}
+	return 0;
+}
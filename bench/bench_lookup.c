@@ -0,0 +1,55 @@
+/*
+ * getattr latency by path as the number of files grows from 1k to 1M, which the path index keeps flat.
+ * Files are spread over directories of 1000. One JSON line per file count.
+ *
+ * usage: bench_lookup [lookups per file count]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define FILES_PER_DIR 1000
+
+static void file_path(char *path, size_t size, size_t k) {
+	snprintf(path, size, "/d%zu/f%zu", k / FILES_PER_DIR, k % FILES_PER_DIR);
+}
+
+int main(int argc, char *argv[]) {
+	size_t lookups = argc > 1 ? strtoull(argv[1], NULL, 0) : 200000;
+	static const size_t counts[] = { 1000, 10000, 100000, 1000000 };
+	uint64_t *samples = malloc(lookups * sizeof(uint64_t));
+	CHECK(samples != NULL);
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		size_t files = counts[c];
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		mount_fs();
+		char path[64];
+		for (size_t k = 0; k < files; k++) {
+			if (k % FILES_PER_DIR == 0) {
+				snprintf(path, sizeof(path), "/d%zu", k / FILES_PER_DIR);
+				CHECK(dm510fs_oper.mkdir(path, 0755) == 0);
+			}
+			file_path(path, sizeof(path), k);
+			CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+		}
+
+		unsigned int seed = 1;
+		struct stat st;
+		uint64_t started = now_ns();
+		for (size_t r = 0; r < lookups; r++) {
+			file_path(path, sizeof(path), rand_r(&seed) % files);
+			uint64_t lookup_started = now_ns();
+			CHECK(dm510fs_oper.getattr(path, &st) == 0);
+			samples[r] = now_ns() - lookup_started;
+		}
+		uint64_t elapsed = now_ns() - started;
+		char params[64];
+		snprintf(params, sizeof(params), "\"files\": %zu", files);
+		print_result(stdout, "getattr", params, lookups, elapsed, samples, lookups);
+		unmount_fs();
+	}
+	free(samples);
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Mount and unmount time of an image holding 10k files and 256 MiB of data, built at 1 GiB with BLOCKS_COUNT=262144
+ * and at 10 GiB as bench_mount_10g. Mounting maps the image and checks the superblock, so both should take the same.
+ * One JSON line each for mount, the first getattr after it, and unmount.
+ *
+ * usage: bench_mount [mounts]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define FILES 10000
+#define DATA_SIZE (256 * 1024 * 1024)
+
+int main(int argc, char *argv[]) {
+	size_t mounts = argc > 1 ? strtoull(argv[1], NULL, 0) : 20;
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	mount_fs();
+	char path[64];
+	for (int k = 0; k < FILES; k++) {
+		snprintf(path, sizeof(path), "/f%d", k);
+		CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+	}
+	char *buf = malloc(1024 * 1024);
+	CHECK(buf != NULL);
+	memset(buf, 'x', 1024 * 1024);
+	CHECK(dm510fs_oper.mknod("/data", S_IFREG | 0644, 0) == 0);
+	for (off_t at = 0; at < DATA_SIZE; at += 1024 * 1024) {
+		CHECK(dm510fs_oper.write("/data", buf, 1024 * 1024, at, NULL) == 1024 * 1024);
+	}
+	free(buf);
+	unmount_fs();
+
+	uint64_t *mount_ns = malloc(mounts * sizeof(uint64_t));
+	uint64_t *getattr_ns = malloc(mounts * sizeof(uint64_t));
+	uint64_t *unmount_ns = malloc(mounts * sizeof(uint64_t));
+	CHECK(mount_ns != NULL && getattr_ns != NULL && unmount_ns != NULL);
+	uint64_t mount_total = 0, getattr_total = 0, unmount_total = 0;
+	for (size_t m = 0; m < mounts; m++) {
+		uint64_t started = now_ns();
+		mount_fs();
+		mount_ns[m] = now_ns() - started;
+		struct stat st;
+		started = now_ns();
+		snprintf(path, sizeof(path), "/f%zu", m % FILES);
+		CHECK(dm510fs_oper.getattr(path, &st) == 0);
+		getattr_ns[m] = now_ns() - started;
+		started = now_ns();
+		unmount_fs();
+		unmount_ns[m] = now_ns() - started;
+		mount_total += mount_ns[m];
+		getattr_total += getattr_ns[m];
+		unmount_total += unmount_ns[m];
+	}
+
+	char params[64];
+	snprintf(params, sizeof(params), "\"image_gib\": %.1f", (double) BLOCKS_COUNT * BLOCK_SIZE / (1 << 30));
+	print_result(stdout, "mount", params, mounts, mount_total, mount_ns, mounts);
+	print_result(stdout, "first_getattr", params, mounts, getattr_total, getattr_ns, mounts);
+	print_result(stdout, "unmount", params, mounts, unmount_total, unmount_ns, mounts);
+	free(mount_ns);
+	free(getattr_ns);
+	free(unmount_ns);
+	return 0;
+}
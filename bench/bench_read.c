@@ -0,0 +1,84 @@
+/*
+ * Reads through dm510fs_read, which copies into the caller's buffer, against dm510fs_read_buf, which copies into a
+ * buffer it allocates, and dm510fs_ll_read, which without encryption lends the data out of the image. Each read
+ * includes handing the data to its reader the way libfuse does without splicing: ll_read replies from the mapping.
+ * Encrypted reads are copied either way and are measured for comparison. One JSON line per way, size and shift.
+ *
+ * usage: bench_read [reads per size]
+*/
+#include "../filesystem.c"
+#include "../tests/fuse_stubs.h"
+#include "../tests/util.h"
+
+#define FILE_SIZE (64 * 1024 * 1024)
+
+static void run(const char *way, size_t size, size_t reads, char *out) {
+	struct fuse_file_info fi = { .flags = O_RDONLY };
+	CHECK(dm510fs_oper.open("/f", &fi) == 0);
+	fuse_ino_t ino = INODE_NUMBER(lookup_inode("/f"));
+	uint64_t *samples = malloc(reads * sizeof(uint64_t));
+	CHECK(samples != NULL);
+	unsigned int seed = 1;
+	struct fuse_req req = { 0 };
+	uint64_t started = now_ns();
+	for (size_t r = 0; r < reads; r++) {
+		off_t offset = (off_t) (rand_r(&seed) % (FILE_SIZE / size)) * size;
+		uint64_t read_started = now_ns();
+		if (strcmp(way, "read") == 0) {
+			CHECK(dm510fs_oper.read(NULL, out, size, offset, &fi) == (int) size);
+		} else if (strcmp(way, "read_buf") == 0) {
+			struct fuse_bufvec *bufv;
+			CHECK(dm510fs_oper.read_buf(NULL, &bufv, size, offset, &fi) == 0);
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+			dst.buf[0].mem = out;
+			CHECK(fuse_buf_copy(&dst, bufv, 0) == (ssize_t) size);
+			for (size_t k = 0; k < bufv->count; k++) {
+				free(bufv->buf[k].mem);
+			}
+			free(bufv);
+		} else {
+			dm510fs_ll_oper.read(&req, ino, size, offset, &fi);
+			CHECK(req.err == 0 && req.size == size);
+		}
+		samples[r] = now_ns() - read_started;
+	}
+	uint64_t elapsed = now_ns() - started;
+	reset_req(&req);
+	dm510fs_oper.release(NULL, &fi);
+	char params[128];
+	snprintf(params, sizeof(params), "\"shift\": %d, \"io_size\": %zu, \"mib_per_s\": %.1f", shift, size,
+			 reads * size / 1048576.0 / (elapsed / 1e9));
+	print_result(stdout, way, params, reads, elapsed, samples, reads);
+	free(samples);
+}
+
+int main(int argc, char *argv[]) {
+	size_t reads = argc > 1 ? strtoull(argv[1], NULL, 0) : 20000;
+	static const size_t sizes[] = { 4096, 128 * 1024, 1024 * 1024 };
+	static const char *ways[] = { "read", "read_buf", "ll_read" };
+	char *out = malloc(FILE_SIZE);
+	CHECK(out != NULL);
+	for (size_t b = 0; b < FILE_SIZE; b++) {
+		out[b] = 'a' + b % 26;
+	}
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (shift = 0; shift < 6; shift += 5) {
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		mount_fs();
+		CHECK(dm510fs_oper.mknod("/f", S_IFREG | 0644, 0) == 0);
+		for (off_t at = 0; at < FILE_SIZE; at += 1024 * 1024) {
+			CHECK(dm510fs_oper.write("/f", out + at, 1024 * 1024, at, NULL) == 1024 * 1024);
+		}
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			for (size_t w = 0; w < sizeof(ways) / sizeof(ways[0]); w++) {
+				size_t count = reads * 4096 / sizes[s] > 100 ? reads * 4096 / sizes[s] : 100;
+				run(ways[w], sizes[s], count, out);
+			}
+		}
+		unmount_fs();
+	}
+	free(out);
+	return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Renames of a directory back and forth between two parents, as its subtree grows from 1 to 100k descendants.
+ * A rename rebinds one entry, so its latency should not depend on the subtree. One JSON line per subtree size.
+ *
+ * usage: bench_rename [renames per size]
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define FILES_PER_DIR 1000
+
+int main(int argc, char *argv[]) {
+	size_t renames = argc > 1 ? strtoull(argv[1], NULL, 0) : 20000;
+	static const size_t sizes[] = { 1, 1000, 10000, 100000 };
+	uint64_t *samples = malloc(renames * sizeof(uint64_t));
+	CHECK(samples != NULL);
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t descendants = sizes[s];
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		mount_fs();
+		CHECK(dm510fs_oper.mkdir("/a", 0755) == 0);
+		CHECK(dm510fs_oper.mkdir("/b", 0755) == 0);
+		CHECK(dm510fs_oper.mkdir("/a/tree", 0755) == 0);
+		// Directories of files, each directory counted as a descendant too
+		char path[64];
+		for (size_t k = 0; k < descendants; k++) {
+			if (k % FILES_PER_DIR == 0) {
+				snprintf(path, sizeof(path), "/a/tree/d%zu", k / FILES_PER_DIR);
+				CHECK(dm510fs_oper.mkdir(path, 0755) == 0);
+			} else {
+				snprintf(path, sizeof(path), "/a/tree/d%zu/f%zu", k / FILES_PER_DIR, k);
+				CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+			}
+		}
+
+		uint64_t started = now_ns();
+		for (size_t r = 0; r < renames; r++) {
+			uint64_t rename_started = now_ns();
+			CHECK(dm510fs_oper.rename(r % 2 == 0 ? "/a/tree" : "/b/tree", r % 2 == 0 ? "/b/tree" : "/a/tree") == 0);
+			samples[r] = now_ns() - rename_started;
+		}
+		uint64_t elapsed = now_ns() - started;
+
+		// The subtree went with its directory
+		struct stat st;
+		const char *parent = renames % 2 == 0 ? "/a" : "/b";
+		snprintf(path, sizeof(path), "%s/tree/d0", parent);
+		CHECK(dm510fs_oper.getattr(path, &st) == 0 && S_ISDIR(st.st_mode));
+		if (descendants > 1) {
+			snprintf(path, sizeof(path), "%s/tree/d0/f1", parent);
+			CHECK(dm510fs_oper.getattr(path, &st) == 0 && S_ISREG(st.st_mode));
+		}
+		unmount_fs();
+
+		char params[64];
+		snprintf(params, sizeof(params), "\"descendants\": %zu", descendants);
+		print_result(stdout, "rename", params, renames, elapsed, samples, renames);
+	}
+	free(samples);
+	return 0;
+}
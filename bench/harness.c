@@ -0,0 +1,600 @@
+/*
+ * Benchmark harness driving the dm510fs_oper table in its own process, so what it measures is the callbacks and
+ * not kernel round trips. Every workload prints one JSON line with ops/s and p50/p99/p999 latency.
+ *
+ * usage: harness [-j threads,...] [-n ops] [-s file size] [-i io sizes,...] [-o option] [-t trace] [-r trace] [workload ...]
+ *
+ * Workloads: seqwrite, seqread, randwrite, randread (each at every io size), create, stat, unlink and readdir,
+ * all of them when none is named. Each runs with every thread count of -j, each thread on files of its own,
+ * -n calls per thread. -o takes compress, dedup, cache=<bytes>, commit=<seconds>, checkpoint=<seconds> or writeback=<bytes>.
+ * -t writes the trace of the run at the debug level to a file, -r replays such a trace, from a mount or from -t,
+ * instead of running workloads. The trace names inodes by number, replay gives each one a path of its own.
+*/
+#include "../filesystem.c"
+#include "../tests/util.h"
+
+#define MAX_THREADS 64
+#define MAX_SIZES 8
+
+/* What one thread of a workload does*/
+typedef struct Job {
+	const char *workload;
+	int thread;
+	size_t ops;
+	size_t io_size;
+	off_t file_size;
+	unsigned int seed;
+	uint64_t *samples;
+	size_t count;
+} Job;
+
+size_t ops_per_thread = 1000;
+off_t file_size = 16 * 1024 * 1024;
+size_t io_sizes[MAX_SIZES] = { 4096, 128 * 1024, 1024 * 1024 };
+int io_size_count = 3;
+int thread_counts[MAX_THREADS] = { 1, 4 };
+int thread_count_count = 2;
+FILE *results;
+char *io_buffer[MAX_THREADS];
+
+// Files and directories each metadata workload works on
+#define FILES_PER_DIR 64
+#define DEEP_LEVELS 32
+
+/*
+ * Adds the time a call took to the samples of its thread
+*/
+static void sample(Job *job, uint64_t started) {
+	job->samples[job->count++] = now_ns() - started;
+}
+
+/*
+ * Writes the file of a thread whole, so it can be read
+*/
+static void fill_file(const char *path, off_t size, char *buf, size_t io_size) {
+	struct fuse_file_info fi = { .flags = O_RDWR };
+	if (dm510fs_oper.getattr(path, &(struct stat) { 0 }) == -ENOENT) {
+		CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+	}
+	CHECK(dm510fs_oper.open(path, &fi) == 0);
+	for (off_t at = 0; at < size; at += io_size) {
+		CHECK(dm510fs_oper.write(NULL, buf, io_size, at, &fi) == (int) io_size);
+	}
+	dm510fs_oper.release(NULL, &fi);
+}
+
+/*
+ * Sequential or random reads or writes of io_size bytes over the file of the thread
+*/
+static void run_io(Job *job, bool write, bool random) {
+	char path[64];
+	snprintf(path, sizeof(path), "/io%d", job->thread);
+	char *buf = io_buffer[job->thread];
+	struct fuse_file_info fi = { .flags = O_RDWR };
+	CHECK(dm510fs_oper.open(path, &fi) == 0);
+	off_t slots = job->file_size / job->io_size;
+	for (size_t k = 0; k < job->ops; k++) {
+		off_t at = (random ? (off_t) rand_r(&job->seed) % slots : (off_t) k % slots) * job->io_size;
+		uint64_t started = now_ns();
+		int res = write ? dm510fs_oper.write(NULL, buf, job->io_size, at, &fi) : dm510fs_oper.read(NULL, buf, job->io_size, at, &fi);
+		sample(job, started);
+		CHECK(res == (int) job->io_size);
+	}
+	dm510fs_oper.release(NULL, &fi);
+}
+
+/*
+ * Makes the path of file k of a thread, in directories of FILES_PER_DIR files
+*/
+static void file_path(char *path, size_t size, int thread, size_t k) {
+	snprintf(path, size, "/m%d/d%zu/f%zu", thread, k / FILES_PER_DIR, k % FILES_PER_DIR);
+}
+
+/*
+ * Makes the files of a thread for the metadata workloads, with their directories
+*/
+static void make_files(int thread, size_t count) {
+	char path[96];
+	snprintf(path, sizeof(path), "/m%d", thread);
+	dm510fs_oper.mkdir(path, 0755);
+	for (size_t k = 0; k < count; k++) {
+		if (k % FILES_PER_DIR == 0) {
+			snprintf(path, sizeof(path), "/m%d/d%zu", thread, k / FILES_PER_DIR);
+			dm510fs_oper.mkdir(path, 0755);
+		}
+		file_path(path, sizeof(path), thread, k);
+		dm510fs_oper.mknod(path, S_IFREG | 0644, 0);
+	}
+}
+
+/*
+ * Creates, stats or unlinks the files of the thread
+*/
+static void run_meta(Job *job, char what) {
+	char path[96];
+	if (what == 'c') {
+		snprintf(path, sizeof(path), "/m%d", job->thread);
+		dm510fs_oper.mkdir(path, 0755);
+	}
+	for (size_t k = 0; k < job->ops; k++) {
+		if (what == 'c' && k % FILES_PER_DIR == 0) {
+			snprintf(path, sizeof(path), "/m%d/d%zu", job->thread, k / FILES_PER_DIR);
+			dm510fs_oper.mkdir(path, 0755);
+		}
+		file_path(path, sizeof(path), job->thread, k);
+		struct stat st;
+		uint64_t started = now_ns();
+		int res = what == 'c' ? dm510fs_oper.mknod(path, S_IFREG | 0644, 0) :
+				  what == 's' ? dm510fs_oper.getattr(path, &st) : dm510fs_oper.unlink(path);
+		sample(job, started);
+		CHECK(res == 0);
+	}
+}
+
+/*
+ * Makes a chain of DEEP_LEVELS directories for a thread, each holding FILES_PER_DIR files and the next one
+*/
+static void make_deep_tree(int thread) {
+	char path[1024];
+	int length = snprintf(path, sizeof(path), "/deep%d", thread);
+	for (int level = 0; level < DEEP_LEVELS; level++) {
+		dm510fs_oper.mkdir(path, 0755);
+		for (int k = 0; k < FILES_PER_DIR; k++) {
+			snprintf(path + length, sizeof(path) - length, "/f%d", k);
+			dm510fs_oper.mknod(path, S_IFREG | 0644, 0);
+		}
+		length += snprintf(path + length, sizeof(path) - length, "/l%d", level);
+	}
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off) {
+	(void) name;
+	(void) st;
+	(void) off;
+	(*(int *) buf)++;
+	return 0;
+}
+
+/*
+ * Lists the directories of the deep tree of the thread, from the top down, each call an opendir, readdir and releasedir
+*/
+static void run_readdir(Job *job) {
+	char path[1024];
+	for (size_t k = 0; k < job->ops; k++) {
+		int level = k % DEEP_LEVELS;
+		int length = snprintf(path, sizeof(path), "/deep%d", job->thread);
+		for (int l = 0; l < level; l++) {
+			length += snprintf(path + length, sizeof(path) - length, "/l%d", l);
+		}
+		struct fuse_file_info fi = { 0 };
+		int entries = 0;
+		uint64_t started = now_ns();
+		CHECK(dm510fs_oper.opendir(path, &fi) == 0);
+		CHECK(dm510fs_oper.readdir(NULL, &entries, count_entry, 0, &fi) == 0);
+		dm510fs_oper.releasedir(NULL, &fi);
+		sample(job, started);
+		CHECK(entries >= FILES_PER_DIR + 2);
+	}
+}
+
+static void *run_job(void *arg) {
+	Job *job = arg;
+	const char *w = job->workload;
+	if (strcmp(w, "seqwrite") == 0 || strcmp(w, "seqread") == 0 || strcmp(w, "randwrite") == 0 || strcmp(w, "randread") == 0) {
+		run_io(job, strstr(w, "write") != NULL, strncmp(w, "rand", 4) == 0);
+	} else if (strcmp(w, "readdir") == 0) {
+		run_readdir(job);
+	} else {
+		run_meta(job, w[0] == 'c' ? 'c' : w[1] == 't' ? 's' : 'u');
+	}
+	return NULL;
+}
+
+/*
+ * Sets up what a workload needs for each of its threads, outside the measured time
+*/
+static void prepare(const char *workload, int threads, size_t io_size) {
+	for (int t = 0; t < threads; t++) {
+		char path[64];
+		// Like fio, random writes go to a file laid out first, a sparse one would split into more extents than a file holds
+		if ((strstr(workload, "read") != NULL && strcmp(workload, "readdir") != 0) || strcmp(workload, "randwrite") == 0) {
+			snprintf(path, sizeof(path), "/io%d", t);
+			fill_file(path, file_size, io_buffer[t], io_size);
+		} else if (strcmp(workload, "seqwrite") == 0) {
+			snprintf(path, sizeof(path), "/io%d", t);
+			dm510fs_oper.mknod(path, S_IFREG | 0644, 0);
+		} else if (strcmp(workload, "stat") == 0 || strcmp(workload, "unlink") == 0) {
+			make_files(t, ops_per_thread);
+		} else if (strcmp(workload, "readdir") == 0) {
+			make_deep_tree(t);
+		}
+	}
+}
+
+/*
+ * Runs a workload with a number of threads and prints its result
+*/
+static void run_workload(const char *workload, int threads, size_t io_size) {
+	// Every run starts from a fresh image
+	unlink(IMAGE_FILE);
+	unlink(JOURNAL_FILE);
+	mount_fs();
+	prepare(workload, threads, io_size);
+
+	Job jobs[MAX_THREADS];
+	pthread_t ids[MAX_THREADS];
+	for (int t = 0; t < threads; t++) {
+		jobs[t] = (Job) { workload, t, ops_per_thread, io_size, file_size, 1 + t, malloc(ops_per_thread * sizeof(uint64_t)), 0 };
+		CHECK(jobs[t].samples != NULL);
+	}
+	uint64_t started = now_ns();
+	for (int t = 0; t < threads; t++) {
+		CHECK(pthread_create(&ids[t], NULL, run_job, &jobs[t]) == 0);
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(ids[t], NULL);
+	}
+	uint64_t elapsed = now_ns() - started;
+
+	size_t total = 0;
+	uint64_t *samples = malloc(threads * ops_per_thread * sizeof(uint64_t));
+	CHECK(samples != NULL);
+	for (int t = 0; t < threads; t++) {
+		memcpy(samples + total, jobs[t].samples, jobs[t].count * sizeof(uint64_t));
+		total += jobs[t].count;
+		free(jobs[t].samples);
+	}
+	char params[128];
+	if (strcmp(workload, "readdir") == 0 || (strstr(workload, "read") == NULL && strstr(workload, "write") == NULL)) {
+		snprintf(params, sizeof(params), "\"threads\": %d", threads);
+	} else {
+		snprintf(params, sizeof(params), "\"threads\": %d, \"io_size\": %zu, \"mib_per_s\": %.1f", threads, io_size,
+				 total * io_size / 1048576.0 / (elapsed / 1e9));
+	}
+	print_result(results, workload, params, total, elapsed, samples, total);
+	free(samples);
+	unmount_fs();
+}
+
+/* An operation read back from a trace*/
+typedef struct TracedOp {
+	int mount; // times the trace was seen mounting before the operation, each mount starts its clock at 0
+	size_t line;
+	double time;
+	char name[16];
+	long long inode;
+	long long offset;
+	long long bytes;
+} TracedOp;
+
+/*
+ * Orders operations by mount, then by time, the threads of a mount drain their trace rings in no particular order
+*/
+static int compare_time(const void *a, const void *b) {
+	const TracedOp *x = a;
+	const TracedOp *y = b;
+	if (x->mount != y->mount) {
+		return x->mount - y->mount;
+	}
+	if (x->time != y->time) {
+		return x->time < y->time ? -1 : 1;
+	}
+	return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* What a traced inode is called in the replay*/
+typedef struct Replayed {
+	bool exists;
+	bool is_dir;
+} Replayed;
+
+Replayed *replayed;
+
+/*
+ * Names the stand-in of a traced inode, the root stays the root
+*/
+static void replay_path(char *path, size_t size, long long inode) {
+	if (inode == 0) {
+		snprintf(path, size, "/");
+	} else {
+		snprintf(path, size, "/replay/i%lld", inode);
+	}
+}
+
+/*
+ * Makes the stand-in of a traced inode, the first time the trace refers to it
+*/
+static void replay_make(long long inode, bool is_dir) {
+	if (inode == 0 || replayed[inode].exists) {
+		return;
+	}
+	char path[64];
+	replay_path(path, sizeof(path), inode);
+	if (is_dir) {
+		dm510fs_oper.mkdir(path, 0755);
+	} else {
+		dm510fs_oper.mknod(path, S_IFREG | 0644, 0);
+	}
+	replayed[inode] = (Replayed) { true, is_dir };
+}
+
+/*
+ * Calls the callbacks a traced operation stands for, returns false for operations that are not replayed:
+ * forget, rename, release and flush, which go with an open or a rename the trace does not name both sides of
+*/
+static bool replay_op(const TracedOp *op, char *buf) {
+	const char *n = op->name;
+	char path[64];
+	replay_path(path, sizeof(path), op->inode);
+	bool dir_op = strcmp(n, "mkdir") == 0 || strcmp(n, "rmdir") == 0 || strcmp(n, "opendir") == 0 ||
+				  strcmp(n, "readdir") == 0 || strcmp(n, "fsyncdir") == 0 || strcmp(n, "releasedir") == 0;
+	if (strcmp(n, "statfs") == 0) {
+		struct statvfs st;
+		dm510fs_oper.statfs("/", &st);
+		return true;
+	}
+	if (op->inode < 0 || op->inode >= MAX_INODES || strcmp(n, "forget") == 0 || strcmp(n, "rename") == 0 ||
+		strcmp(n, "release") == 0 || strcmp(n, "releasedir") == 0 || strcmp(n, "flush") == 0) {
+		return false;
+	}
+	if (strcmp(n, "unlink") == 0 || strcmp(n, "rmdir") == 0) {
+		if (replayed[op->inode].exists) {
+			(dir_op ? dm510fs_oper.rmdir : dm510fs_oper.unlink)(path);
+			replayed[op->inode].exists = false;
+		}
+		return true;
+	}
+	replay_make(op->inode, dir_op || replayed[op->inode].is_dir);
+	size_t bytes = op->bytes > 0 ? (size_t) op->bytes : 0;
+	struct stat st;
+	struct fuse_file_info fi = { .flags = O_RDWR };
+	if (strcmp(n, "lookup") == 0 || strcmp(n, "getattr") == 0) {
+		dm510fs_oper.getattr(path, &st);
+	} else if (strcmp(n, "setattr") == 0) {
+		if (!replayed[op->inode].is_dir) {
+			dm510fs_oper.truncate(path, op->offset);
+		}
+	} else if (strcmp(n, "read") == 0) {
+		dm510fs_oper.read(path, buf, bytes, op->offset, NULL);
+	} else if (strcmp(n, "write") == 0) {
+		dm510fs_oper.write(path, buf, bytes, op->offset, NULL);
+	} else if (strcmp(n, "fallocate") == 0) {
+		dm510fs_oper.fallocate(path, 0, op->offset, BLOCK_SIZE, NULL);
+	} else if (strcmp(n, "open") == 0 || strcmp(n, "fsync") == 0 || strcmp(n, "create") == 0) {
+		if (dm510fs_oper.open(path, &fi) == 0) {
+			if (strcmp(n, "fsync") == 0) {
+				dm510fs_oper.fsync(NULL, 0, &fi);
+			}
+			dm510fs_oper.release(NULL, &fi);
+		}
+	} else if (strcmp(n, "opendir") == 0 || strcmp(n, "readdir") == 0 || strcmp(n, "fsyncdir") == 0) {
+		int entries = 0;
+		if (dm510fs_oper.opendir(path, &fi) == 0) {
+			if (strcmp(n, "readdir") == 0) {
+				dm510fs_oper.readdir(NULL, &entries, count_entry, 0, &fi);
+			} else if (strcmp(n, "fsyncdir") == 0) {
+				dm510fs_oper.fsyncdir(NULL, 0, &fi);
+			}
+			dm510fs_oper.releasedir(NULL, &fi);
+		}
+	}
+	return true;
+}
+
+/*
+ * Replays the operations of a trace in the order of their times, printing a result for each kind of operation.
+ * Replay runs on one fresh image, and the stand-ins of inodes stay from one mount of the trace to the next, as inodes stay in a remounted image.
+*/
+static void replay(const char *file) {
+	FILE *in = fopen(file, "r");
+	if (in == NULL) {
+		perror(file);
+		exit(1);
+	}
+	size_t count = 0;
+	size_t capacity = 1024;
+	TracedOp *ops = malloc(capacity * sizeof(TracedOp));
+	char line[512];
+	size_t largest = BLOCK_SIZE;
+	int mount = 0;
+	size_t line_number = 0;
+	while (ops != NULL && fgets(line, sizeof(line), in) != NULL) {
+		TracedOp op = { .mount = mount, .line = line_number++ };
+		long long ns;
+		if (strstr(line, "] init filesystem") != NULL) {
+			mount++;
+		}
+		if (sscanf(line, "[%lf] %15[^:]: inode %lld offset %lld, %lld bytes in %lld ns", &op.time, op.name, &op.inode,
+				   &op.offset, &op.bytes, &ns) != 6) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity *= 2;
+			ops = realloc(ops, capacity * sizeof(TracedOp));
+			CHECK(ops != NULL);
+		}
+		if (op.bytes > 0 && (size_t) op.bytes > largest) {
+			largest = op.bytes;
+		}
+		ops[count++] = op;
+	}
+	fclose(in);
+	CHECK(ops != NULL);
+	qsort(ops, count, sizeof(TracedOp), compare_time);
+
+	unlink(IMAGE_FILE);
+	unlink(JOURNAL_FILE);
+	mount_fs();
+	dm510fs_oper.mkdir("/replay", 0755);
+	replayed = calloc(MAX_INODES, sizeof(Replayed));
+	char *buf = malloc(largest);
+	uint64_t *samples = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+	int *kinds = malloc((count > 0 ? count : 1) * sizeof(int));
+	CHECK(replayed != NULL && buf != NULL && samples != NULL && kinds != NULL);
+	memset(buf, 'r', largest);
+
+	size_t replayed_count = 0;
+	uint64_t started = now_ns();
+	for (size_t k = 0; k < count; k++) {
+		uint64_t op_started = now_ns();
+		if (replay_op(&ops[k], buf)) {
+			samples[replayed_count] = now_ns() - op_started;
+			kinds[replayed_count++] = k;
+		}
+	}
+	uint64_t elapsed = now_ns() - started;
+
+	// One line for every kind of operation, then one for the whole trace
+	uint64_t *kind_samples = malloc((replayed_count > 0 ? replayed_count : 1) * sizeof(uint64_t));
+	uint64_t kind_ns = 0;
+	CHECK(kind_samples != NULL);
+	for (int op = 0; op < OP_COUNT; op++) {
+		size_t n = 0;
+		kind_ns = 0;
+		for (size_t k = 0; k < replayed_count; k++) {
+			if (strcmp(ops[kinds[k]].name, op_names[op]) == 0) {
+				kind_samples[n++] = samples[k];
+				kind_ns += samples[k];
+			}
+		}
+		if (n > 0) {
+			char name[64];
+			snprintf(name, sizeof(name), "replay:%s", op_names[op]);
+			print_result(results, name, "", n, kind_ns, kind_samples, n);
+		}
+	}
+	char params[64];
+	snprintf(params, sizeof(params), "\"traced\": %zu", count);
+	print_result(results, "replay", params, replayed_count, elapsed, samples, replayed_count);
+	free(kind_samples);
+	free(kinds);
+	free(samples);
+	free(buf);
+	free(replayed);
+	free(ops);
+	unmount_fs();
+}
+
+/*
+ * Parses a comma-separated list of numbers, returns how many there were
+*/
+static int parse_list(const char *text, size_t *values, int max) {
+	int count = 0;
+	char *end;
+	while (count < max) {
+		values[count++] = strtoull(text, &end, 0);
+		if (*end != ',') {
+			break;
+		}
+		text = end + 1;
+	}
+	return count;
+}
+
+/*
+ * Sets a mount option, as -o would when mounting
+*/
+static void set_option(const char *option) {
+	if (strcmp(option, "compress") == 0) {
+		options.compress = 1;
+	} else if (strcmp(option, "dedup") == 0) {
+		options.dedup = 1;
+	} else if (strncmp(option, "cache=", 6) == 0) {
+		options.cache_size = strtoull(option + 6, NULL, 0);
+	} else if (strncmp(option, "commit=", 7) == 0) {
+		options.commit_interval = atof(option + 7);
+	} else if (strncmp(option, "checkpoint=", 11) == 0) {
+		options.checkpoint_interval = atof(option + 11);
+	} else if (strncmp(option, "writeback=", 10) == 0) {
+		options.writeback_size = strtoull(option + 10, NULL, 0);
+	} else {
+		fprintf(stderr, "unknown option %s\n", option);
+		exit(2);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *trace_file = NULL;
+	const char *replay_file = NULL;
+	size_t values[MAX_THREADS];
+	int opt;
+	options.trace_level = TRACE_ERROR;
+	while ((opt = getopt(argc, argv, "j:n:s:i:o:t:r:")) != -1) {
+		switch (opt) {
+		case 'j':
+			thread_count_count = parse_list(optarg, values, MAX_THREADS);
+			for (int k = 0; k < thread_count_count; k++) {
+				thread_counts[k] = values[k] < 1 ? 1 : values[k] > MAX_THREADS ? MAX_THREADS : values[k];
+			}
+			break;
+		case 'n':
+			ops_per_thread = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			file_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			io_size_count = parse_list(optarg, io_sizes, MAX_SIZES);
+			break;
+		case 'o':
+			set_option(optarg);
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'r':
+			replay_file = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-j threads,...] [-n ops] [-s file size] [-i io sizes,...] [-o option] "
+					"[-t trace] [-r trace] [workload ...]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	// Results go to stdout, the trace thread writes there as well, so a trace is sent to its file instead
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	if (trace_file != NULL) {
+		int fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+			perror(trace_file);
+			return 1;
+		}
+		close(fd);
+		options.trace_level = TRACE_DEBUG;
+	} else if (freopen("/dev/null", "w", stdout) == NULL) {
+		return 1;
+	}
+	enter_scratch_dir();
+	size_t largest = 0;
+	for (int k = 0; k < io_size_count; k++) {
+		largest = io_sizes[k] > largest ? io_sizes[k] : largest;
+	}
+	for (int t = 0; t < MAX_THREADS; t++) {
+		io_buffer[t] = malloc(largest > 0 ? largest : 1);
+		CHECK(io_buffer[t] != NULL);
+		for (size_t b = 0; b < largest; b++) {
+			io_buffer[t][b] = 'a' + (b + t) % 26;
+		}
+	}
+
+	if (replay_file != NULL) {
+		replay(replay_file);
+		return 0;
+	}
+	static const char *all[] = { "seqwrite", "seqread", "randwrite", "randread", "create", "stat", "unlink", "readdir" };
+	const char **workloads = optind < argc ? (const char **) argv + optind : all;
+	int workload_count = optind < argc ? argc - optind : (int) (sizeof(all) / sizeof(all[0]));
+	for (int w = 0; w < workload_count; w++) {
+		bool io = strcmp(workloads[w], "readdir") != 0 && (strstr(workloads[w], "read") != NULL || strstr(workloads[w], "write") != NULL);
+		for (int s = 0; s < (io ? io_size_count : 1); s++) {
+			if (io && (off_t) io_sizes[s] > file_size) {
+				continue;
+			}
+			for (int t = 0; t < thread_count_count; t++) {
+				run_workload(workloads[w], thread_counts[t], io ? io_sizes[s] : 0);
+			}
+		}
+	}
+	return 0;
+}
@@ -1,11 +1,25 @@
-        #include <fuse.h>
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include<stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <utime.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 int dm510fs_getattr( const char *, struct stat * );
 int dm510fs_readdir( const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info * );
@@ -13,26 +27,91 @@ int dm510fs_open( const char *, struct fuse_file_info * );
 int dm510fs_read( const char *, char *, size_t, off_t, struct fuse_file_info * );
 int dm510fs_release(const char *path, struct fuse_file_info *fi);
 int dm510fs_mkdir(const char *path, mode_t mode);
-void* dm510fs_init();
+void* dm510fs_init(struct fuse_conn_info *conn);
 void dm510fs_destroy(void *private_data);
 int dm510fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 int dm510fs_unlink(const char *path);
 int dm510fs_rmdir(const char *path);
+int dm510fs_rename(const char *path, const char *new_path);
+int rename_entry(int parent, const char *name, int new_parent, const char *new_name, unsigned int flags);
 int dm510fs_mknod(const char *path, mode_t mode, dev_t rdev);
+int make_inode(int parent, const char *name, mode_t mode, bool is_dir, uint64_t lookups);
+int make_path(const char *path, mode_t mode, bool is_dir);
 int dm510fs_utime(const char *path, struct utimbuf *time);
 int dm510fs_truncate(const char *path, off_t size);
+int truncate_inode(int i, off_t size);
+int dm510fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+int fallocate_inode(int i, int mode, off_t offset, off_t length);
 int loadFileSystem(const char *filename);
 int saveFileSystem(const char *filename);
-void encryptCaesarCypher(char *text, int length);
-void decryptCaesarCypher(char *text, int length);
+void encryptCaesarCypher(char *dst, const char *src, size_t length);
+void decryptCaesarCypher(char *dst, const char *src, size_t length);
+void caesar_scalar(char *dst, const char *src, size_t length, int key);
+void select_caesar_kernel();
+uint32_t crc32c_scalar(uint32_t crc, const void *data, size_t length);
+void select_crc32c_kernel();
+size_t codec_compress(const char *src, size_t length, char *dst, size_t capacity);
+ssize_t codec_decompress(const char *src, size_t length, char *dst, size_t capacity);
 int blocks_needed(size_t size);
 int find_free_block();
+int alloc_blocks(int hint, uint32_t count, uint32_t *allocated);
+void free_blocks(uint32_t start, uint32_t count);
+void release_blocks(uint32_t start, uint32_t count);
+void drop_blocks(uint32_t start, uint32_t count);
+bool share_blocks(uint32_t start, uint32_t count);
+bool blocks_shared(uint32_t start, uint32_t count);
+void mark_blocks(uint32_t start, uint32_t count, bool free);
+uint32_t free_run_length(uint32_t start, uint32_t max);
+int next_free_block(uint32_t from, uint32_t to);
+void reset_block_map();
+void unlist_orphan(int i);
+void free_orphans();
+void format_image();
+int dm510fs_statfs(const char *path, struct statvfs *stbuf);
+int dm510fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi);
+int dm510fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi);
+int dm510fs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
+int dm510fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+int dm510fs_opendir(const char *path, struct fuse_file_info *fi);
+int dm510fs_releasedir(const char *path, struct fuse_file_info *fi);
+int open_handle(const char *path, struct fuse_file_info *fi, bool is_dir);
+int open_inode(int i, struct fuse_file_info *fi, bool is_dir);
+void stat_inode(int i, struct stat *stbuf);
+int release_handle(struct fuse_file_info *fi);
+int dm510fs_flush(const char *path, struct fuse_file_info *fi);
+int dm510fs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int dm510fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
+void dm510fs_ll_init(void *userdata, struct fuse_conn_info *conn);
+void dm510fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void dm510fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+void dm510fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+void dm510fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void dm510fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+void dm510fs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+void dm510fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+void dm510fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+void dm510fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+void dm510fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+void dm510fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+void dm510fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void dm510fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void dm510fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+void dm510fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+void dm510fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
+void dm510fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+void dm510fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void dm510fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+void dm510fs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+void dm510fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void dm510fs_ll_statfs(fuse_req_t req, fuse_ino_t ino);
+void dm510fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+int run_lowlevel(struct fuse_args *args);
 
 /*
  * See descriptions in fuse source code usually located in /usr/include/fuse/fuse.h
  * Notice: The version on Github is a newer version than installed at IMADA
  */
-static struct fuse_operations dm510fs_oper = {
+struct fuse_operations dm510fs_oper = {
 	.getattr	= dm510fs_getattr,
 	.readdir	= dm510fs_readdir,
 	.mknod = dm510fs_mknod,
@@ -44,651 +123,6521 @@ static struct fuse_operations dm510fs_oper = {
 	.read	= dm510fs_read,
 	.release = dm510fs_release,
 	.write = dm510fs_write,
-	.rename = NULL,
+	.rename = dm510fs_rename,
 	.utime = dm510fs_utime,
+	.statfs = dm510fs_statfs,
+	.read_buf = dm510fs_read_buf,
+	.write_buf = dm510fs_write_buf,
+	.fgetattr = dm510fs_fgetattr,
+	.ftruncate = dm510fs_ftruncate,
+	.opendir = dm510fs_opendir,
+	.releasedir = dm510fs_releasedir,
+	.flush = dm510fs_flush,
+	.fsync = dm510fs_fsync,
+	.fsyncdir = dm510fs_fsyncdir,
+	.fallocate = dm510fs_fallocate,
+	.flag_nopath = 1, // operations on open files use fi->fh, so libfuse need not build their paths
 	.init = dm510fs_init,
 	.destroy = dm510fs_destroy
 };
 
+/*
+ * The low-level front end, used unless the filesystem is mounted with -o highlevel.
+ * It works on inode numbers instead of paths and lets the kernel cache entries and attributes,
+ * see /usr/include/fuse/fuse_lowlevel.h
+ */
+struct fuse_lowlevel_ops dm510fs_ll_oper = {
+	.init = dm510fs_ll_init,
+	.destroy = dm510fs_destroy,
+	.lookup = dm510fs_ll_lookup,
+	.forget = dm510fs_ll_forget,
+	.forget_multi = dm510fs_ll_forget_multi,
+	.getattr = dm510fs_ll_getattr,
+	.setattr = dm510fs_ll_setattr,
+	.mknod = dm510fs_ll_mknod,
+	.mkdir = dm510fs_ll_mkdir,
+	.create = dm510fs_ll_create,
+	.unlink = dm510fs_ll_unlink,
+	.rmdir = dm510fs_ll_rmdir,
+	.rename = dm510fs_ll_rename,
+	.open = dm510fs_ll_open,
+	.opendir = dm510fs_ll_opendir,
+	.read = dm510fs_ll_read,
+	.write = dm510fs_ll_write,
+	.write_buf = dm510fs_ll_write_buf,
+	.readdir = dm510fs_ll_readdir,
+	.flush = dm510fs_ll_flush,
+	.fsync = dm510fs_ll_fsync,
+	.fsyncdir = dm510fs_ll_fsyncdir,
+	.release = dm510fs_ll_release,
+	.releasedir = dm510fs_ll_release,
+	.statfs = dm510fs_ll_statfs,
+	.fallocate = dm510fs_ll_fallocate
+};
+
 #define MAX_DATA_IN_FILE 256
 #define MAX_PATH_LENGTH  256
 #define MAX_NAME_LENGTH  256
-#define MAX_INODES  4
+// Flags of rename_entry, defined by newer C libraries
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+// Modes of fallocate, defined by newer C libraries
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+// Most inodes the table can grow to, can be set with -DMAX_INODES=...
+#ifndef MAX_INODES
+#define MAX_INODES (1 << 22)
+#endif
+
+// Largest requests asked of the kernel at init, it may lower them
+#define MAX_WRITE (128 * 1024)
+#define MAX_READAHEAD (1024 * 1024)
+
+// Trace levels, messages up to the level given with -o trace=<level> are written to stdout.
+// Building with -DTRACE_LEVEL=<level> leaves out the messages above it, 0 leaves out tracing altogether.
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_DEBUG
+#endif
+
+// Mount options, given with -o
+#define DEFAULT_WRITEBACK_SIZE (256 * 1024)
+#define DEFAULT_CACHE_TIMEOUT 60.0
+#define DEFAULT_COMMIT_INTERVAL 5.0
+#define DEFAULT_CHECKPOINT_INTERVAL 30.0
+struct dm510fs_options {
+	size_t writeback_size; // -o writeback=<bytes>, size of the write-back buffer of each open file, 0 turns it off
+	int high_level; // -o highlevel, serve the path based API instead of the low-level one
+	double entry_timeout; // -o entry_timeout=<seconds>, how long the kernel may cache a name lookup
+	double attr_timeout; // -o attr_timeout=<seconds>, how long the kernel may cache attributes
+	double negative_timeout; // -o negative_timeout=<seconds>, how long the kernel may cache a failed lookup
+	double commit_interval; // -o commit=<seconds>, how long the journal collects operations before committing them, 0 commits at once
+	double checkpoint_interval; // -o checkpoint=<seconds>, how often committed changes are written back to the image, 0 only when the journal grows large
+	int compress; // -o compress, compress file data written from now on, existing data is read either way
+	int dedup; // -o dedup, share the blocks of identical extents written from now on with the ones already stored
+	size_t cache_size; // -o cache=<bytes>, memory file blocks may take, colder blocks are evicted to the image, 0 leaves it to the kernel
+	int trace_level; // -o trace=<level>, most detailed messages written, 0 for none, 3 for every operation
+} options = { DEFAULT_WRITEBACK_SIZE, 0, DEFAULT_CACHE_TIMEOUT, DEFAULT_CACHE_TIMEOUT, 0.0, DEFAULT_COMMIT_INTERVAL, DEFAULT_CHECKPOINT_INTERVAL, 0, 0, 0, TRACE_INFO };
 
+#define DM510FS_OPT(templ, field, value) { templ, offsetof(struct dm510fs_options, field), value }
+const struct fuse_opt dm510fs_opts[] = {
+	DM510FS_OPT("writeback=%zu", writeback_size, 0),
+	DM510FS_OPT("highlevel", high_level, 1),
+	DM510FS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	DM510FS_OPT("attr_timeout=%lf", attr_timeout, 0),
+	DM510FS_OPT("negative_timeout=%lf", negative_timeout, 0),
+	DM510FS_OPT("commit=%lf", commit_interval, 0),
+	DM510FS_OPT("checkpoint=%lf", checkpoint_interval, 0),
+	DM510FS_OPT("compress", compress, 1),
+	DM510FS_OPT("dedup", dedup, 1),
+	DM510FS_OPT("cache=%zu", cache_size, 0),
+	DM510FS_OPT("trace=%d", trace_level, 0),
+	FUSE_OPT_END
+};
+
+// Channel of the low-level front end, used to tell the kernel about changes it did not make itself
+struct fuse_chan *channel;
+
+// Writes a message to the trace, the arguments are formatted with format by the trace thread
+#define TRACE(level, format, a, b, c) do { \
+		if ((level) <= TRACE_LEVEL && (level) <= options.trace_level) { \
+			trace_event(format, NULL, (int64_t) (a), (int64_t) (b), (int64_t) (c), 0); \
+		} \
+	} while (0)
+void trace_event(const char *format, const char *name, int64_t a, int64_t b, int64_t c, int64_t d);
+void start_tracing();
+void stop_tracing();
+
+// Operations counted in the statistics
+#define OP_LOOKUP 0
+#define OP_FORGET 1
+#define OP_GETATTR 2
+#define OP_SETATTR 3
+#define OP_MKNOD 4
+#define OP_MKDIR 5
+#define OP_CREATE 6
+#define OP_UNLINK 7
+#define OP_RMDIR 8
+#define OP_RENAME 9
+#define OP_OPEN 10
+#define OP_OPENDIR 11
+#define OP_READ 12
+#define OP_WRITE 13
+#define OP_READDIR 14
+#define OP_FLUSH 15
+#define OP_FSYNC 16
+#define OP_FSYNCDIR 17
+#define OP_RELEASE 18
+#define OP_RELEASEDIR 19
+#define OP_STATFS 20
+#define OP_FALLOCATE 21
+#define OP_COUNT 22
+// Counts a call of the operation and the time it takes, whichever way the function returns.
+// Operations called from other operations are part of the outer one.
+#define OP_SCOPE(op) __attribute__((cleanup(op_end))) int op_scope = op_begin(op)
+int op_begin(int op);
+void op_end(int *scope);
+void op_bytes(int res);
+void op_inode(int i);
+void op_offset(off_t offset);
+// /.dm510fs/stats and its directory take the inode indexes past the end of the table
+#define STATS_DIR MAX_INODES
+#define STATS_FILE (MAX_INODES + 1)
+#define STATS_DIR_NAME ".dm510fs"
+#define STATS_FILE_NAME "stats"
+struct FileHandle;
+bool is_virtual(int i);
+int lookup_virtual(int parent, const char *name);
+int lookup_virtual_path(const char *path);
+int virtual_entry(const char *path, struct fuse_file_info *fi);
+void stat_virtual(int i, struct stat *stbuf);
+ssize_t format_stats(char **text);
+int open_virtual(int i, struct fuse_file_info *fi, bool is_dir);
+int read_virtual(struct FileHandle *fh, char *buf, size_t size, off_t offset);
+int readdir_virtual(void *buf, fuse_fill_dir_t filler, off_t offset);
 
 
-// amount of shifts to encrypt and decrypt
+
+// amount of shifts to encrypt and decrypt, always 0 - 25
 int shift; 
 
-// struct for a block
-#define BLOCK_SIZE 8
+// Caesar kernel picked for this CPU at startup
+void (*caesar_kernel)(char *dst, const char *src, size_t length, int key) = caesar_scalar;
+
+// CRC-32C kernel picked for this CPU at startup, checksums the journal
+uint32_t (*crc32c_kernel)(uint32_t crc, const void *data, size_t length) = crc32c_scalar;
+
+// struct for a block, the block size can be set at compile time with -DBLOCK_SIZE=...
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 4096
+#endif
+#ifndef BLOCKS_COUNT
 #define BLOCKS_COUNT 10000
-typedef struct Block{
+#endif
+
+/* A run of blocks holding consecutive file data, or one compressed cluster*/
+typedef struct Extent {
+	uint32_t logical; // first file block covered by the run
+	uint32_t start; // first physical block of the run
+	uint32_t length; // number of file blocks covered, the blocks held are the same unless the run is compressed
+	uint32_t packed; // bytes of compressed data of a cluster, held in the fewest blocks from start, 0 when not compressed
+} Extent;
+
+// The packed value of a plain run that was preallocated and not written yet, its blocks read as zeros whatever they hold
+#define EXTENT_UNWRITTEN UINT32_MAX
+
+#define EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(Extent))
+
+// Blocks are stored back to back, so the blocks of an extent can be copied in one go
+typedef union Block{
 	char data[BLOCK_SIZE];
-	bool is_free;
-	size_t size; // how much of the block is full 
-	bool is_full;
+	Extent extents[EXTENTS_PER_BLOCK]; // used when the block is an indirect extent block
 } Block;
 
-Block blocks[BLOCKS_COUNT]; // 0 :
+Block *blocks; // BLOCKS_COUNT blocks in the image
+
+// Free space bitmap, a set bit means the block is free
+#define BITMAP_WORDS ((BLOCKS_COUNT + 63) / 64)
+uint64_t *free_bitmap; // in the image
+
+// Extra references to each block from extents that share it, 0 when one extent holds it. Changed under alloc_lock,
+// a block is only freed once its last reference is dropped.
+#define MAX_SHARES UINT16_MAX
+uint16_t *block_shares; // in the image
+
+/* A run of blocks in the fingerprint index, which finds stored runs with the same contents as a new one.
+ * Entries are only hints, a run is checked against the extents of its inode and compared byte for byte before it is shared.*/
+typedef struct Fingerprint {
+	uint32_t crc; // CRC-32C of the blocks as stored, encrypted
+	uint32_t length; // blocks in the run, 0 for an empty entry
+	uint32_t start; // first physical block
+	uint32_t logical; // file block the run starts at
+	int32_t inode; // file holding the run when it was indexed
+} Fingerprint;
+
+// The fingerprint index is a hash table of buckets of DEDUP_WAYS entries, a full bucket overwrites one of them
+#define DEDUP_WAYS 4
+#define DEDUP_BUCKETS ((BLOCKS_COUNT + DEDUP_WAYS - 1) / DEDUP_WAYS)
+Fingerprint *fingerprints; // in the image
+
 
+// The first extents of a file live in the inode, the rest in one indirect block
+#define INODE_EXTENTS 4
+#define MAX_EXTENTS (INODE_EXTENTS + EXTENTS_PER_BLOCK)
+// File blocks are numbered with 32 bits
+#define MAX_FILE_SIZE ((off_t) UINT32_MAX * BLOCK_SIZE)
+
+// With -o compress file data is compressed in clusters of this many aligned blocks, can be set with -DCLUSTER_BLOCKS=...
+// A read of part of a cluster decompresses only that cluster.
+#ifndef CLUSTER_BLOCKS
+#define CLUSTER_BLOCKS 4
+#endif
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#if CLUSTER_SIZE > 65536
+#error "CLUSTER_SIZE must fit the 16-bit match offsets of the codec"
+#endif
+// Each compressed cluster takes an extent, new clusters are compressed only while the extent map is below this
+// and the rest of the file is written to plain runs, which merge
+#define CLUSTER_EXTENTS (MAX_EXTENTS * 3 / 4)
+
+// Files up to this size keep their contents in the inode instead of in blocks, can be set with -DINLINE_DATA_SIZE=...
+#ifndef INLINE_DATA_SIZE
+#define INLINE_DATA_SIZE 128
+#endif
+#if INLINE_DATA_SIZE > BLOCK_SIZE
+#error "INLINE_DATA_SIZE must fit in one block"
+#endif
 
-#define MAX_INODE_BLOCKS 4
 /* The Inode for the filesystem*/
 typedef struct Inode {
 	bool is_active;
 	bool is_dir;
-	Block* blocks[MAX_INODE_BLOCKS]; // 
-	char path[MAX_PATH_LENGTH];
-	char name[MAX_NAME_LENGTH];
+	bool is_inline; // the contents are in inline_data, the inode has no extents and no blocks
+	union {
+		Extent extents[INODE_EXTENTS]; // sorted by logical block
+		char inline_data[INLINE_DATA_SIZE]; // encrypted contents of an inline file, zero past its size
+	};
+	int indirect; // block holding the extents after the first INODE_EXTENTS, -1 when unused
+	uint32_t extent_count;
+	uint32_t block_count; // data and indirect blocks held, kept up to date for st_blocks
+	off_t size;
 	mode_t mode;
-	nlink_t nlink;
+	uint32_t nlink;
 	time_t a_time;
 	time_t m_time;
+	time_t c_time;
+	// The directory entry, from here on the fields only change under the namespace write lock
+	uint16_t name_length;
+	uint32_t name_offset; // name of the entry in its parent, in the name arena
+	int hash_next; // next inode in the same name index bucket, or in the free list when unused, -1 ends the chain
+	int parent; // directory entry links, -1 when there is none
+	int first_child;
+	int next_sibling;
+	int prev_sibling;
+	int child_count;
+	off_t dir_cookie; // readdir offset of the entry in its parent, entries added later get higher cookies
 } Inode;
 
-Inode filesystem[MAX_INODES];
+/* State of an inode that only lasts while the filesystem is mounted, kept out of the image*/
+typedef struct InodeState {
+	int open_count; // open handles, an unlinked inode is kept until the last one is released
+	uint64_t lookup_count; // references the kernel holds to the inode number, an unlinked inode is kept until they are forgotten
+	struct FileHandle *buffered; // the one handle holding write-back data for this inode, if any
+	off_t buffered_end; // end of that data, the size reported while it lies past the end of the file, 0 without it
+	uint64_t journal_sequence; // last journaled operation that changed the inode, fsync waits until it is committed
+} InodeState;
 
+// Room for the names of all entries, can be set with -DNAME_ARENA_SIZE=...
+#ifndef NAME_ARENA_SIZE
+#define NAME_ARENA_SIZE (MAX_INODES * 64ULL)
+#endif
+#if NAME_ARENA_SIZE > 0xFFFFFFFF
+#error "NAME_ARENA_SIZE must fit the 32-bit name offsets"
+#endif
 
+// Names take whole granules of the arena, and freed names are kept in one list per size for reuse
+#define NAME_GRANULE 8
+#define NAME_GRANULES(length) (((length) + NAME_GRANULE) / NAME_GRANULE) // granules for a name and its NUL
+#define NAME_CLASSES NAME_GRANULES(MAX_NAME_LENGTH - 1)
+#define NO_NAME 0xFFFFFFFF
 
-void debug_inode(int i) {
-	Inode inode = filesystem[i];
-
-	printf("=============================================\n");
-	printf("      Path: %s\n", inode.path);
-	printf("=============================================\n");
-}
+// The name index starts with this many buckets and doubles up to twice MAX_INODES, always a power of two
+#define NAME_INDEX_MIN_BUCKETS 1024
+#define NAME_INDEX_MAX_BUCKETS (2 * MAX_INODES > NAME_INDEX_MIN_BUCKETS ? 2 * MAX_INODES : NAME_INDEX_MIN_BUCKETS)
 
 /*
- * Return file attributes.
- * The "stat" structure is described in detail in the stat(2) manual page.
- * For the given pathname, this should fill in the elements of the "stat" structure.
- * If a field is meaningless or semi-meaningless (e.g., st_ino) then it should be set to 0 or given a "reasonable" value.
- * This call is pretty much required for a usable filesystem.
+ * The filesystem lives in one image file, mapped shared so each page is read in when it is first touched
+ * and changes are written back by the kernel. Its regions, each starting on a page boundary:
+ *   superblock | inode table | name arena | name index | free bitmap | block shares | fingerprint index | blocks
+ * The layout follows from the geometry the filesystem is compiled with, which the superblock records.
+ * Structures refer to each other by inode, arena offset and block indices, never by pointers.
+ * The file is sparse, parts of the table and arena that were never used take no disk space.
 */
-int dm510fs_getattr(const char *path, struct stat *stbuf) {
-	printf("getattr: (path=%s)\n", path);
+#define IMAGE_FILE "saveFile.txt"
+#define JOURNAL_FILE "saveFile.journal" // see the journal section further down
+#define JOURNAL_NEW_FILE "saveFile.journal.new" // a shortened journal, renamed over JOURNAL_FILE once it is complete
+#define IMAGE_MAGIC "DM510FS"
+#define IMAGE_VERSION 5
+#define IMAGE_ALIGN(size) (((size) + 4095) & ~(size_t) 4095)
 
-	memset(stbuf, 0, sizeof(struct stat));
-	for(int i = 0; i < MAX_INODES; i++) {
-		printf("===> %s  %s \n", path, filesystem[i].path);
-		if(filesystem[i].is_active && strcmp(filesystem[i].path, path) == 0) {
-			printf("Found inode for path %s at location %i\n", path, i);
-			stbuf->st_mode = filesystem[i].mode;
-			stbuf->st_nlink = filesystem[i].nlink;
-
-			// calculates the size for blocks
-			off_t total_size = 0; 
-			for (int j = 0; j< MAX_INODE_BLOCKS; j++){
-				if(filesystem[i].blocks[j] != NULL){
-					total_size = total_size + filesystem[i].blocks[j]->size;
-				}
+typedef struct Superblock {
+	char magic[8];
+	uint32_t version;
+	uint32_t clean; // set at unmount, an image mounted without it has its indexes and free space rebuilt
+	uint64_t image_id; // picked when the image is made, journal groups carry it so a journal of another image is never replayed
+	// Geometry, must match the build
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t max_inodes;
+	uint32_t inode_size;
+	uint32_t inline_data_size;
+	uint32_t cluster_blocks;
+	uint64_t name_arena_size;
+	// Counts and lists, kept up to date in place
+	int32_t inode_count; // slots handed out so far, slots past this have never been used
+	int32_t used_inodes;
+	int32_t free_inodes; // freed slots, chained through hash_next, reused before the table grows
+	int32_t orphans; // unlinked inodes still open or known to the kernel, chained through hash_next, freed at the next mount
+	uint64_t name_arena_used; // bytes handed out from the end of the arena
+	uint32_t free_names[NAME_CLASSES]; // freed names, one list per size in granules, chained through their first bytes
+	uint32_t index_buckets;
+	uint32_t free_block_count;
+	uint32_t alloc_cursor; // where the next search for free blocks starts
+	int64_t next_dir_cookie; // cookie the next directory entry gets, 1 and 2 are taken by "." and ".."
+	uint64_t packed_blocks; // file blocks held in compressed clusters
+	uint64_t packed_stored; // blocks those clusters take
+	uint64_t shared_blocks; // references to blocks beyond the first, the blocks deduplication saves
+} Superblock;
 
-			}
-			stbuf->st_size = total_size;
-			return 0;
-		}
-	}
-	printf("getattr: Max number of inodes used\n");
-	return -ENOENT;
-}
+char *image;
+size_t image_size;
+int image_fd = -1; // kept open so the checkpointer can write back parts of the image
+Superblock *super;
 
-/*
- * Return one or more directory entries (struct dirent) to the caller. This is one of the most complex FUSE functions.
- * Required for essentially any filesystem, since it's what makes ls and a whole bunch of other things work.
- * The readdir function is somewhat like read, in that it starts at a given offset and returns results in a caller-supplied buffer.
- * However, the offset not a byte offset, and the results are a series of struct dirents rather than being uninterpreted bytes.
- * To make life easier, FUSE provides a "filler" function that will help you put things into the buffer.
- *
- * The general plan for a complete and correct readdir is:
- *
- * 1. Find the first directory entry following the given offset (see below).
- * 2. Optionally, create a struct stat that describes the file as for getattr (but FUSE only looks at st_ino and the file-type bits of st_mode).
- * 3. Call the filler function with arguments of buf, the null-terminated filename, the address of your struct stat
- *    (or NULL if you have none), and the offset of the next directory entry.
- * 4. If filler returns nonzero, or if there are no more files, return 0.
- * 5. Find the next file in the directory.
- * 6. Go back to step 2.
- * From FUSE's point of view, the offset is an uninterpreted off_t (i.e., an unsigned integer).
- * You provide an offset when you call filler, and it's possible that such an offset might come back to you as an argument later.
- * Typically, it's simply the byte offset (within your directory layout) of the directory entry, but it's really up to you.
- *
- * It's also important to note that readdir can return errors in a number of instances;
- * in particular it can return -EBADF if the file handle is invalid, or -ENOENT if you use the path argument and the path doesn't exist.
-*/
-int dm510fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-	(void) offset;
-	(void) fi;
-	printf("readdir: (path=%s)\n", path);
-
-	for(int i = 0; i < MAX_INODES; i++) {
-        // Check if the current inode is a subdirectory of the given path
-        if(strncmp(path, filesystem[i].path, strlen(path)) == 0 && strlen(filesystem[i].path) > strlen(path)) {
-            char *dir_name = filesystem[i].path + strlen(path);
-
-			if (dir_name[0] == '/') {
-                dir_name++; // Skip the leading '/'
-             }
-			int slashcount= 0;
-			for (int j = 0; j < strlen(dir_name); j++){
-				if(dir_name[j]== '/'){
-					slashcount += 1;
-				}
-			}
-			if(slashcount == 0){
-            	// Add the subdirectory to the directory listing
-            	filler(buf, dir_name, NULL, 0);
-			}
-        }
-    }
-	return 0;
-}
+// The inode table, inodes never move, so operations on inode numbers can use them without the namespace lock
+Inode *filesystem;
 
-/*
- * Open a file.
- * If you aren't using file handles, this function should just check for existence and permissions and return either success or an error code.
- * If you use file handles, you should also allocate any necessary structures and set fi->fh.
- * In addition, fi has some other fields that an advanced filesystem might find useful; see the structure definition in fuse_common.h for very brief commentary.
- * Link: https://github.com/libfuse/libfuse/blob/0c12204145d43ad4683136379a130385ef16d166/include/fuse_common.h#L50
-*/
-int dm510fs_open(const char *path, struct fuse_file_info *fi) {
-    printf("open: (path=%s)\n", path);
-	return 0;
-}
+// Names of all entries, each stored once and NUL terminated. Full paths are not stored, they follow from the parent chain.
+// A freed name is reused for a new one, so names are read under the namespace lock.
+char *name_arena;
 
-/*
- * Read size bytes from the given file into the buffer buf, beginning offset bytes into the file. See read(2) for full details.
- * Returns the number of bytes transferred, or 0 if offset was at or beyond the end of the file. Required for any sensible filesystem.
-*/
-int dm510fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("read: (path=%s)\n", path);
+// Per-mount state of every inode, in memory only. The pages are handed out zeroed as they are first used.
+InodeState *inode_state;
 
-	// Pointer to store the inode corresponding to the path
-    Inode *inode = NULL;
+// Inode numbers given to the kernel are the table index plus one, so the root gets FUSE_ROOT_ID
+#define INODE_NUMBER(i) ((fuse_ino_t) (i) + 1)
+#define INODE_INDEX(ino) ((int) (ino) - 1)
 
-	// Search for the inode in the filesystem by comparing the path
-	for(int i = 0; i < MAX_INODES; i++) {
-		if(strcmp(filesystem[i].path, path) == 0 ) {
-            inode = &filesystem[i];
-        }
-    }
-	// If inode is not found, return error code -ENOENT
-    if(inode == NULL){
-        return -ENOENT;
-    }
-	// Calculate the block index and the offset within the block
-    off_t blockIndex = offset/BLOCK_SIZE; 
-	if(blockIndex >= MAX_INODE_BLOCKS){
-		return -ENOSPC; // Return error if the block index exceeds the maximum number of blocks
-	}
-	// Number of bytes left to read
-    size_t bytesLeft = size;
-	// Calculate the offset within the block
-    off_t blockOffset = offset% BLOCK_SIZE;
-	
-	// Read loop to handle reading across multiple blocks if necessary
-    while (bytesLeft > 0 && blockIndex < MAX_INODE_BLOCKS){
-		// Get the current block
-        Block *block = inode->blocks[blockIndex];
-
-        if(block==NULL){
-            return size - bytesLeft;
-        }
+int read_data(Inode *inode, char *buf, size_t size, off_t offset, int use);
+/* A piece of a read replied without copying: bytes of the mapped image, or zeros when data is NULL*/
+typedef struct ReadRun {
+	const char *data;
+	size_t length;
+} ReadRun;
+// Pieces a read may be replied in without copying, reads split into more are copied
+#define MAX_READ_RUNS 32
+// Holes of reads replied without copying point at zeros of this size, longer holes take several pieces
+#define ZERO_RUN_SIZE (128 * 1024)
+int map_read(Inode *inode, size_t size, off_t offset, int use, ReadRun *runs, int max_runs);
+int write_data(Inode *inode, const char *buf, size_t size, off_t offset);
+int truncate_data(Inode *inode, off_t size);
+int punch_hole(Inode *inode, off_t offset, off_t end);
+int preallocate(Inode *inode, off_t offset, off_t end);
+void trim_extents(Inode *inode, uint32_t first_unused);
+int punch_extents(Inode *inode, uint32_t first, uint32_t end);
+int map_run(Inode *inode, uint32_t pos, uint32_t blockIndex, uint32_t wanted, uint32_t *allocated, bool unwritten);
+int write_unwritten(Inode *inode, uint32_t k, uint32_t first, uint32_t count, off_t blockOffset, size_t length);
+void clear_around(uint32_t start, uint32_t count, off_t blockOffset, size_t length);
+ssize_t copy_zeros(char *data, size_t length, void *source);
+int write_extents(Inode *inode, size_t size, off_t offset, ssize_t (*copy)(char *, size_t, void *), void *source);
+int write_runs(Inode *inode, size_t size, off_t offset, ssize_t (*copy)(char *, size_t, void *), void *source, bool compress);
+bool cluster_is_unmapped(Inode *inode, uint32_t pos, uint32_t blockIndex);
+ssize_t write_cluster(Inode *inode, int k, off_t offset, size_t size, ssize_t (*copy)(char *, size_t, void *), void *source);
+int store_cluster(Inode *inode, int k, uint32_t first, const char *plain, size_t used);
+int load_cluster(const Extent *e, char *plain);
+// How blocks are touched
+#define TOUCH_ACCESS 0
+#define TOUCH_STREAM 1 // read deep into a sequential run, the blocks are not expected to be read again soon
+#define TOUCH_AHEAD 2 // asked for ahead of a sequential read
+void cache_touch(uint32_t start, uint32_t count, int use);
+int cache_use(struct FileHandle *fh, off_t offset);
+void cache_readahead(Inode *inode, struct FileHandle *fh, off_t end);
+ssize_t copy_from_memory(char *data, size_t length, void *source);
+ssize_t copy_encrypted(char *data, size_t length, void *source);
+ssize_t copy_from_bufvec(char *data, size_t length, void *source);
+void dedup_extents(int i, off_t from, off_t to);
 
-		// Determine the number of bytes to read from the current block
-        size_t blockRead;
+// Journal, see the journal section further down
+void journal_range(const void *addr, size_t length);
+void journal_inode(int i);
+void journal_entry(int i);
+void journal_entries(const int *entries, int count);
+void journal_links(int i);
+void journal_data(Inode *inode, off_t offset, size_t length);
+void journal_end();
+int journal_wait(uint64_t sequence);
+void release_name(uint32_t offset, size_t length);
+void defer_free(bool is_name, uint32_t start, uint32_t count);
+int open_journal(const char *filename);
+int replay_journal();
+void start_journal();
+void stop_journal();
+void start_cache();
+void stop_cache();
+int checkpoint_now();
+void close_journal();
+void reuse_freed_names();
 
-        if(bytesLeft > BLOCK_SIZE - offset){
-            blockRead = BLOCK_SIZE - offset; 
-        }
-        else{
-            blockRead = bytesLeft;
-        }
-		
-		// Copy data from the block to the buffer and decrypt it
-        memcpy(buf, block->data + blockOffset, blockRead );
-		decryptCaesarCypher(buf, blockRead);
+/*
+ * Locking, always taken in this order:
+ * namespace_lock - held for reading by every operation, for writing by operations that create or remove inodes
+ * inode_lock(i)  - held for reading while the data or attributes of an inode are read, for writing while they change
+ * commit_lock    - held by the commit thread and the checkpointer while they write the journal or the image, never by operations
+ * alloc_lock     - held inside the block allocator
+ * dedup_lock     - held while the fingerprint index is searched or changed, nothing is locked under it
+ * journal_lock   - held while records are appended to the journal, nothing is locked under it
+ */
+#define INODE_LOCK_STRIPES 1024
+pthread_rwlock_t namespace_lock;
+pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		// Move the buffer pointer and update counters
-        buf += blockRead;
-        offset = 0;  // Reset offset for more blocks
-        bytesLeft -= blockRead;
-        blockIndex += 1;
+/*
+ * Returns the lock of an inode, inodes share a lock only when there are more than INODE_LOCK_STRIPES of them
+*/
+pthread_rwlock_t *inode_lock(int i) {
+	return &inode_locks[i % INODE_LOCK_STRIPES];
+}
 
-    }
-	// Return the number of bytes read
-    return size-bytesLeft;
-    
+/* State of an open file or directory, kept in fi->fh*/
+typedef struct FileHandle {
+	int inode;
+	off_t last_offset; // where the previous read or write ended
+	bool sequential; // whether the previous read or write started where the one before it ended
+	char *wb_data; // write-back buffer holding plain text not yet written to the extents
+	off_t wb_offset; // file offset of the first buffered byte
+	size_t wb_length; // bytes buffered, 0 when the buffer is empty
+	int wb_error; // error from committing buffered data outside flush, reported by the next flush
+	off_t written_from; // range written through the handle, deduplicated when it is released, empty when written_to is 0
+	off_t written_to;
+	off_t run_start; // where the run of sequential reads and writes the previous one belongs to started
+	off_t readahead_end; // file offset up to which blocks were asked for ahead of sequential reads
+	char *text; // contents of the statistics file when the handle was opened, NULL for other files
+	size_t text_length;
+	off_t dir_offset; // cookie of the last entry the previous readdir returned
+	int dir_next; // child the previous readdir stopped at, -1 at the end of the directory
+} FileHandle;
 
+/*
+ * Returns the handle of an open file, or NULL if the operation was not given one.
+ * The inode of the handle is the one the operation is traced with.
+*/
+FileHandle *get_handle(struct fuse_file_info *fi) {
+	FileHandle *fh = fi != NULL ? (FileHandle *) (uintptr_t) fi->fh : NULL;
+	if (fh != NULL) {
+		op_inode(fh->inode);
+	}
+	return fh;
 }
 
 /*
- * Makes a directory
+ * Remembers where an access through a handle ended, so sequential access can be detected
 */
-int dm510fs_mkdir(const char *path, mode_t mode) {
-	printf("mkdir: (path=%s)\n", path);
-
-	// Locate the first unused Inode in the filesystem
-	for(int i = 0; i < MAX_INODES; i++) {
-		if(filesystem[i].is_active == false) {
-			printf("mkdir: Found unused inode for at location %i\n", i);
-			// Use that for the directory
-			filesystem[i].is_active = true;
-			filesystem[i].is_dir = true;
-			filesystem[i].mode = S_IFDIR | 0755;
-			filesystem[i].nlink = 2;
-			memcpy(filesystem[i].path, path, strlen(path) + 1);
-			
-			// Uses last part of path as the inode name
-			char *dir = strrchr(path, '/');
-			strcpy(filesystem[i].name, dir + 1);
-
-			debug_inode(i);
-			return 0;
+void note_access(FileHandle *fh, off_t offset, int res) {
+	if (fh != NULL && res > 0) {
+		fh->sequential = offset == fh->last_offset;
+		if (!fh->sequential) {
+			fh->run_start = offset;
 		}
+		fh->last_offset = offset + res;
 	}
-	printf("mkdir: No more space in filesystem\n");
-	return -ENOSPC;
 }
 
 /*
- * This is the only FUSE function that doesn't have a directly corresponding system call, although close(2) is related.
- * Release is called when FUSE is completely done with a file; at that point, you can free up any temporarily allocated data structures.
- */
-int dm510fs_release(const char *path, struct fuse_file_info *fi) {
-	printf("release: (path=%s)\n", path);
-	return 0;
+ * Remembers the range written through a handle, so -o dedup can look for copies of it when the handle is released
+*/
+void note_write(FileHandle *fh, off_t offset, int res) {
+	if (fh != NULL && res > 0) {
+		if (fh->written_to == 0 || offset < fh->written_from) {
+			fh->written_from = offset;
+		}
+		if (offset + res > fh->written_to) {
+			fh->written_to = offset + res;
+		}
+	}
 }
 
-/**
- * Initialize filesystem
- *
- * The return value will passed in the `private_data` field of
- * `struct fuse_context` to all file operations, and as a
- * parameter to the destroy() method. It overrides the initial
- * value provided to fuse_main() / fuse_new().
- */
-void* dm510fs_init() {
-    printf("init filesystem\n");
-
-	// Loop through all inodes - set them inactive
-	for(int i = 0; i < MAX_INODES; i++) {
-		filesystem[i].is_active = false;
-        for ( int k = 0 ; k< MAX_INODE_BLOCKS; k++){
-			// Initialize all inode blocks as NULL
-            filesystem[i].blocks[k] = NULL;
-        }
+/*
+ * Drops the attributes the kernel cached for an inode after a change it did not make itself.
+ * Only the low-level front end has a channel to send this on.
+*/
+void notify_inode(int i) {
+	if (channel != NULL && options.attr_timeout > 0) {
+		fuse_lowlevel_notify_inval_inode(channel, INODE_NUMBER(i), -1, 0);
 	}
-
-	// Add root inode 
-	filesystem[0].is_active = true;
-	filesystem[0].is_dir = true;
-	filesystem[0].mode = S_IFDIR | 0755;
-	filesystem[0].nlink = 2;
-	memcpy(filesystem[0].path, "/", 2); 
-
-	// Initialize all blocks as free
-	for(int j= 0 ; j< BLOCKS_COUNT; j++){
-		blocks[j].is_free = true;
-        
-        }
-
-
-	loadFileSystem("saveFile.txt");
-
-    return NULL;
 }
 
-/**
- * Clean up filesystem
- * Called on filesystem exit.
- */
-void dm510fs_destroy(void *private_data) {
-
-	saveFileSystem("saveFile.txt");
+/*
+ * Journals a write to a file and ends the operation, the caller holds the inode lock for writing.
+ * A write that moved an inline file out to blocks also wrote the start of the file.
+*/
+void journal_write(int i, off_t offset, int written, bool was_inline) {
+	Inode *inode = &filesystem[i];
+	size_t length = written > 0 ? written : 0;
 
-	printf("file saved.\n");
-    printf("destroy filesystem\n");
+	journal_inode(i);
+	if (was_inline && !inode->is_inline) {
+		journal_data(inode, 0, offset + length);
+	} else {
+		journal_data(inode, offset, length);
+	}
+	journal_end();
 }
 
 /*
- * Makes a file 
+ * Writes the buffered data of a handle to the extents, encrypting it in one pass.
+ * The caller holds the inode lock for writing.
 */
-int dm510fs_mknod(const char *path, mode_t mode, dev_t rdev){
-	printf("mknod: (path=%s)\n", path);
-
-	// Locate the first unused Inode in the filesystem
-	for(int i = 0; i < MAX_INODES; i++) {
-		if(filesystem[i].is_active == false) {
+int commit_buffer(FileHandle *fh) {
+	Inode *inode = &filesystem[fh->inode];
+	int res = 0;
 
-			printf("mknod: Found unused inode for at location %i\n", i);
-			// Use that for the directory
-			filesystem[i].is_active = true;
-			filesystem[i].is_dir = false;
-			filesystem[i].mode = mode | S_IFREG;
-			filesystem[i].nlink = 1;
-			memcpy(filesystem[i].path, path, strlen(path)+1);
-
-			// Uses last part of path as the inode name
-			char *dir = strrchr(path, '/');
-			strcpy(filesystem[i].name, dir + 1);
-
-			debug_inode(i);
-			return 0;
+	if (fh->wb_length > 0) {
+		bool was_inline = inode->is_inline;
+		int written = write_data(inode, fh->wb_data, fh->wb_length, fh->wb_offset);
+		if (written < 0) {
+			res = written;
+		} else if ((size_t) written < fh->wb_length) {
+			res = -ENOSPC;
 		}
-
+		journal_write(fh->inode, fh->wb_offset, written, was_inline);
+		fh->wb_length = 0;
+		// The kernel saw the write when it was buffered, not when it reached the extents
+		notify_inode(fh->inode);
 	}
-	printf("mknod: No more space in filesystem\n");
-	return -ENOSPC;
+	if (inode_state[fh->inode].buffered == fh) {
+		inode_state[fh->inode].buffered = NULL;
+		inode_state[fh->inode].buffered_end = 0;
+	}
+	return res;
 }
 
 /*
- * Function that tells the time of an action
+ * Commits whatever write-back data is held for an inode, the caller holds the inode lock for writing.
+ * An error is kept in the handle that buffered the data and reported by its next flush.
 */
-int dm510fs_utime(const char *path, struct utimbuf *time){
-	printf("utime: %s %ld %ld \n", path, time->actime, time->modtime);
-
-	// Adds the times to every inode
-	for(int i = 0; i < MAX_INODES; i++){
-		if(strcmp(path, filesystem[i].path)){
-			filesystem[i].a_time = time->actime;
-			filesystem[i].m_time = time->modtime;
-			return 0;
+void commit_inode(int i) {
+	FileHandle *fh = inode_state[i].buffered;
+	if (fh != NULL) {
+		int res = commit_buffer(fh);
+		if (res < 0 && fh->wb_error == 0) {
+			fh->wb_error = res;
 		}
 	}
-	printf("utime: Path not found\n");
-	return -ENOENT; 
 }
 
 /*
- * Writes to a file
+ * Locks an inode for reading, first committing any write-back data so readers see it.
+ * Holds the lock for writing instead when there was data to commit.
 */
-int dm510fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-	printf("write: (path=%s)\n", path);
-    // Pointer to store the inode corresponding to the path
-	Inode *inode = NULL;
-
-	// Search for the inode in the filesystem by comparing the path
-	for(int i = 0; i < MAX_INODES; i++)
-		if(strcmp(filesystem[i].path, path) == 0 && filesystem[i].is_dir == false)
-            inode = &filesystem[i];
-	// If inode is not found, return error code -ENOENT
-    if(inode == NULL){
-        return -ENOENT;
-    }
-
-	// Calculate the block index and the offset within the block
-    int blockIndex = offset/BLOCK_SIZE;
-    if (blockIndex >= MAX_INODE_BLOCKS){
-		return -ENOSPC;  // Return error if the block index exceeds the maximum number of blocks
+void lock_inode_for_read(int i) {
+	pthread_rwlock_rdlock(inode_lock(i));
+	if (inode_state[i].buffered != NULL) {
+		pthread_rwlock_unlock(inode_lock(i));
+		pthread_rwlock_wrlock(inode_lock(i));
+		commit_inode(i);
 	}
+}
 
-	off_t blockOffset = offset % BLOCK_SIZE;
-
-	// Number of bytes left to write
-    size_t bytesLeft = size; 
+/*
+ * Adds a write to the write-back buffer of a handle, the caller holds the inode lock for writing.
+ * Writes that continue or overlap the buffered range are merged into it, any other write commits it first.
+ * The buffer is committed as soon as it is full.
+*/
+int buffer_write(FileHandle *fh, const char *buf, size_t size, off_t offset) {
+	int res;
 
-	// Write loop to handle writing across multiple blocks if necessary
-    while (bytesLeft > 0 && blockIndex < MAX_INODE_BLOCKS){
-		
-        Block *block = inode->blocks[blockIndex];
-
-		// If the block is not allocated, find a free block
-        if(block==NULL){
-            int blockfree = find_free_block();
-			// Check if there are no free blocks available
-            if(blockfree < 0 ){
-				// Return error if nothing has been written, otherwise return the amount written
-                if(bytesLeft == size ){
-                    return -ENOSPC;
-                }
-                else{
-                    return size - bytesLeft; 
-                }
-            }
-
-			// Allocate the new block and update the inode
-            block = &blocks[blockfree];
-            block->is_free = false; 
-            inode->blocks[blockIndex] = block; 
-        }
-		// Determine the number of bytes to write to the current block
-        size_t blockWrite;
+	// Only one handle buffers an inode at a time, so commits cannot reorder writes
+	if (inode_state[fh->inode].buffered != fh) {
+		commit_inode(fh->inode);
+	}
+	bool mergeable = offset >= fh->wb_offset && offset <= fh->wb_offset + (off_t) fh->wb_length &&
+					 offset + size <= fh->wb_offset + options.writeback_size;
+	if (fh->wb_length > 0 && !mergeable && (res = commit_buffer(fh)) < 0) {
+		return res;
+	}
+	if (fh->wb_data == NULL && (fh->wb_data = malloc(options.writeback_size)) == NULL) {
+		return -ENOMEM;
+	}
 
-        if(bytesLeft > BLOCK_SIZE - offset){
-            blockWrite = BLOCK_SIZE - offset; 
-        }
-        else{
-            blockWrite = bytesLeft;
-        }
-		// Copy data to the block and encrypt it
-        memcpy(block->data + blockOffset, buf, blockWrite );
-		encryptCaesarCypher(block->data + blockOffset, blockWrite );
+	if (fh->wb_length == 0) {
+		fh->wb_offset = offset;
+		inode_state[fh->inode].buffered = fh;
+	}
+	memcpy(fh->wb_data + (offset - fh->wb_offset), buf, size);
+	if (offset + size > fh->wb_offset + fh->wb_length) {
+		fh->wb_length = offset + size - fh->wb_offset;
+	}
+	// Only committing the data grows the inode, until then stat_inode reports the size with it
+	inode_state[fh->inode].buffered_end = fh->wb_offset + fh->wb_length;
 
-		// Update the block size
-		block->size = blockOffset + blockWrite;
+	if (fh->wb_length == options.writeback_size && (res = commit_buffer(fh)) < 0) {
+		fh->wb_error = res;
+	}
+	return size;
+}
 
-		// Move the buffer pointer and update counters
-        buf += blockWrite;
-        offset = 0; // Reset offset for new blocks
-        bytesLeft -= blockWrite;
-        blockIndex += 1;
+/*
+ * Returns the name of an inode, valid while the caller holds the namespace lock
+*/
+const char *inode_name(int i) {
+	return name_arena + filesystem[i].name_offset;
+}
 
-    }
-	printf("write size : %d", size);
-	// Return the number of bytes written
-    return size-bytesLeft;
+/*
+ * Whether the name of an inode is still in use: the root and inodes linked into a directory have one
+*/
+bool has_name(int i) {
+	return filesystem[i].is_active && (i == 0 || filesystem[i].parent != -1);
+}
 
+/*
+ * Orders inodes by where their names are in the arena
+*/
+int compare_name_offset(const void *a, const void *b) {
+	uint32_t x = filesystem[*(const int *) a].name_offset;
+	uint32_t y = filesystem[*(const int *) b].name_offset;
+	return x < y ? -1 : x > y;
 }
 
 /*
- * Deletes a file
+ * Pushes a piece of the arena onto the free list for its size, the caller holds the namespace write lock
 */
-int dm510fs_unlink(const char *path){
-	printf("path unlink: %s", path);
+void push_free_name(uint32_t offset, uint32_t granules) {
+	memcpy(name_arena + offset, &super->free_names[granules - 1], sizeof(uint32_t));
+	super->free_names[granules - 1] = offset;
+}
 
-	for(int i = 0; i < MAX_INODES; i++){
-		if(strcmp(filesystem[i].path, path) == 0 && filesystem[i].is_dir == false){
-			filesystem[i].is_active = false;
-			filesystem[i].nlink = 0;
-			filesystem[i].path[0] = '\0';
-			return 0; 
-		}
+/*
+ * Takes a piece of the arena off the free list for its size, returns its offset or NO_NAME when the list is empty
+*/
+uint32_t pop_free_name(uint32_t granules) {
+	uint32_t offset = super->free_names[granules - 1];
+	if (offset != NO_NAME) {
+		memcpy(&super->free_names[granules - 1], name_arena + offset, sizeof(uint32_t));
 	}
-	printf("unlink: Path not found\n");
-	return -ENOENT;
+	return offset;
 }
 
 /*
- * Deletes a directory
+ * Copies a name into the arena, the caller holds the namespace write lock.
+ * A freed name of the same size is reused first, then the end of the arena,
+ * and once that is used up a larger freed name is split.
 */
-int dm510fs_rmdir(const char *path){
-	printf("rmdir: (path=%s)\n", path);
-
-	for (int i = 0; i < MAX_INODES; i++){
-        if (strcmp(filesystem[i].path, path) == 0 && filesystem[i].is_dir == true) {
-
-			// Checks if there is anything in the directory
-			for(int j = 0; j < MAX_INODES; j++ ){
-				if (strncmp(filesystem[j].path, path, strlen(path)) == 0 && 
-					strlen(filesystem[j].path) > strlen(path)){
-						printf("Error deleting directory, existing subdirectory or file: %s \n",filesystem[j].path);
-						return -ENOTEMPTY;
+int store_name(const char *name, size_t length, uint32_t *offset) {
+	uint32_t granules = NAME_GRANULES(length);
+	reuse_freed_names();
+	*offset = pop_free_name(granules);
+	if (*offset == NO_NAME) {
+		if (super->name_arena_used + granules * NAME_GRANULE <= NAME_ARENA_SIZE) {
+			*offset = super->name_arena_used;
+			super->name_arena_used += granules * NAME_GRANULE;
+		} else {
+			for (uint32_t larger = granules + 1; larger <= NAME_CLASSES && *offset == NO_NAME; larger++) {
+				if ((*offset = pop_free_name(larger)) != NO_NAME) {
+					push_free_name(*offset + granules * NAME_GRANULE, larger - granules);
 				}
 			}
-			filesystem[i].is_active = false;
-			filesystem[i].nlink = 0;
-			filesystem[i].path[0] = '\0';
-			return 0;
-        }
+			if (*offset == NO_NAME) {
+				return -ENOSPC;
+			}
+		}
 	}
-	printf("rmdir: Directory not found\n");	
-	return -ENOENT;
+	memcpy(name_arena + *offset, name, length);
+	name_arena[*offset + length] = '\0';
+	journal_range(name_arena + *offset, length + 1);
+	return 0;
 }
 
+// Hash index from (parent, name) to inode, chained through Inode.hash_next.
+// It doubles in place whenever it holds more inodes than buckets, so chains stay short.
+int *name_index; // NAME_INDEX_MAX_BUCKETS buckets in the image, the first super->index_buckets in use
+
 /*
- * Resizes file
+ * FNV-1a hash of a directory entry, callers reduce it to a bucket
 */
-int dm510fs_truncate(const char *path, off_t size){
-	printf("truncate: (path=%s)\n", path);
-	// Pointer to store the inode corresponding to the path
-    Inode *inode= NULL; 
-
-	// Search for the inode in the filesystem by comparing the path
-	for (int i = 0; i<MAX_INODES; i++){
-		if (strcmp(filesystem[i].path, path) == 0 && filesystem[i].is_dir == false){
-            inode = &filesystem[i];
-		}
-
+unsigned int hash_entry(int parent, const char *name, size_t length) {
+	unsigned int hash = (2166136261u ^ (unsigned int) parent) * 16777619u;
+	for (size_t k = 0; k < length; k++) {
+		hash ^= (unsigned char) name[k];
+		hash *= 16777619u;
 	}
-	// If inode is not found, return error code -ENOENT
-    if( inode == NULL){
-        return -ENOENT;
-    }
-	// Calculate the number of blocks needed to store the specified size
-    int remainingBlocks = (size - 1) / BLOCK_SIZE + 1;
-
-	// Free blocks that are beyond the required size
-    for(int j = remainingBlocks; j < MAX_INODE_BLOCKS; j++){
-        if(inode->blocks[j] != NULL){
-            inode->blocks[j]->is_free = true;
-        }
-        inode->blocks[j] = NULL;
+	return hash;
+}
 
-    }
+/*
+ * Returns the index bucket of an inode linked into a directory
+*/
+int *index_bucket(int i) {
+	return &name_index[hash_entry(filesystem[i].parent, inode_name(i), filesystem[i].name_length) & (super->index_buckets - 1)];
+}
 
-	// Adjust the size of the last required block
-	if(remainingBlocks == 0 ){
-		inode->blocks[remainingBlocks-1]->size = size % BLOCK_SIZE;
+/*
+ * Doubles the name index in place, each chain splits between its bucket and the one as far above it.
+ * An index at its largest keeps working with longer chains.
+*/
+void grow_index() {
+	unsigned int buckets = super->index_buckets;
+	if (2 * buckets > NAME_INDEX_MAX_BUCKETS) {
+		return;
+	}
+	for (unsigned int b = buckets; b < 2 * buckets; b++) {
+		name_index[b] = -1;
+	}
+	super->index_buckets = 2 * buckets;
+	for (unsigned int b = 0; b < buckets; b++) {
+		int i = name_index[b];
+		name_index[b] = -1;
+		while (i != -1) {
+			int next = filesystem[i].hash_next;
+			int *bucket = index_bucket(i);
+			filesystem[i].hash_next = *bucket;
+			*bucket = i;
+			i = next;
+		}
 	}
-
-    return 0; 
 }
 
 /*
- * Function to save the file system state to a file
+ * Adds an inode linked into a directory to the name index
 */
-int saveFileSystem(const char *filename) {
-	// Open file for writing in binary mode
-    FILE *file = fopen(filename, "wb"); 
-    if (file == NULL) {
-        perror("Error opening file for writing\n");
-        return -ENOENT;
-    }
-
-    // Write the entire file system state to the file
-    if (fwrite(filesystem, sizeof(filesystem), 1, file) != 1) {
-        perror("Error writing file system state\n");
-        fclose(file);
-		return -EIO;
+void index_insert(int i) {
+	if ((unsigned int) super->used_inodes > super->index_buckets) {
+		grow_index();
 	}
-
-    fclose(file);
-    return 0;
+	int *bucket = index_bucket(i);
+	filesystem[i].hash_next = *bucket;
+	*bucket = i;
 }
 
-
 /*
- * Function to load the file system state from a file
+ * Removes an inode from the name index, must be called before it is unlinked from its parent
 */
-int loadFileSystem(const char *filename) {
-	// Open file for reading in binary mode
-    FILE *file = fopen(filename, "rb"); 
-    if (file == NULL) {
-        perror("Error opening file for reading\n");
-        return -ENOENT;
-    }
-
-    // Read the file system state from the file
-    if (fread(filesystem, sizeof(filesystem), 1, file) != 1) {
-        perror("Error reading file system state\n");
-        fclose(file);
-        return -EIO;
-    }
-
-    fclose(file);
-    return 0;
+void index_remove(int i) {
+	int *link = index_bucket(i);
+	while (*link != -1) {
+		if (*link == i) {
+			*link = filesystem[i].hash_next;
+			filesystem[i].hash_next = -1;
+			return;
+		}
+		link = &filesystem[*link].hash_next;
+	}
 }
 
 /*
- * Caesar encryption of file contents
-*/ 
-void encryptCaesarCypher(char *text, int length){
+ * Finds the entry of a name in a directory, returns its index or -1 if there is none
+*/
+int lookup_child(int dir, const char *name, size_t length) {
+	unsigned int bucket = hash_entry(dir, name, length) & (super->index_buckets - 1);
+	for (int i = name_index[bucket]; i != -1; i = filesystem[i].hash_next) {
+		if (filesystem[i].parent == dir && filesystem[i].name_length == length &&
+			memcmp(inode_name(i), name, length) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Finds the inode for the first length bytes of a path, walking it one name at a time from the root.
+ * Returns its index or -1 if the path does not exist.
+*/
+int lookup_path(const char *path, size_t length) {
+	const char *c = path;
+	const char *end = path + length;
+	int i = 0;
+	while (true) {
+		while (c < end && *c == '/') {
+			c++;
+		}
+		if (c == end) {
+			return i;
+		}
+		const char *next = memchr(c, '/', end - c);
+		if (next == NULL) {
+			next = end;
+		}
+		if (!filesystem[i].is_dir || (i = lookup_child(i, c, next - c)) == -1) {
+			return -1;
+		}
+		c = next;
+	}
+}
+
+/*
+ * Finds the inode for a path, returns its index or -1 if the path does not exist
+*/
+int lookup_inode(const char *path) {
+	if (path[0] != '/') {
+		return -1;
+	}
+	return lookup_path(path, strlen(path));
+}
+
+/*
+ * Finds the directory that would contain a path and the name it would have there.
+ * Returns the index of the directory or -1 if it does not exist.
+*/
+int lookup_parent(const char *path, const char **name) {
+	const char *last = strrchr(path, '/');
+	if (last == NULL) {
+		return -1;
+	}
+	*name = last + 1;
+	return lookup_path(path, last - path);
+}
+
+/*
+ * Builds the full path of an inode from the names along its parent chain, the caller holds the namespace lock.
+ * Returns -ENOENT for an unlinked inode and -ENAMETOOLONG when the path does not fit in size bytes.
+*/
+int inode_path(int i, char *path, size_t size) {
+	// Filled in from the end, the names are found leaf first
+	size_t start = size - 1;
+	path[start] = '\0';
+	for (; i != 0; i = filesystem[i].parent) {
+		if (filesystem[i].parent == -1) {
+			return -ENOENT;
+		}
+		size_t length = filesystem[i].name_length;
+		if (length + 1 > start) {
+			return -ENAMETOOLONG;
+		}
+		start -= length;
+		memcpy(path + start, inode_name(i), length);
+		path[--start] = '/';
+	}
+	if (start == size - 1) {
+		path[--start] = '/';
+	}
+	memmove(path, path + start, size - start);
+	return 0;
+}
+
+/*
+ * Finds the inode an operation works on: the inode of the open handle if there is one, otherwise the inode of the path.
+ * A path lookup holds the namespace read lock until put_inode, an open handle already keeps its inode alive.
+ * Returns the inode index or -ENOENT.
+*/
+int get_inode(const char *path, struct fuse_file_info *fi) {
+	FileHandle *fh = get_handle(fi);
+	if (fh != NULL) {
+		return fh->inode;
+	}
+	pthread_rwlock_rdlock(&namespace_lock);
+	int i = lookup_inode(path);
+	if (i == -1) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return -ENOENT;
+	}
+	op_inode(i);
+	return i;
+}
+
+/*
+ * Ends an operation started with get_inode
+*/
+void put_inode(struct fuse_file_info *fi) {
+	if (get_handle(fi) == NULL) {
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+}
+
+/*
+ * Frees an inode that has no name and no open handles left, the caller holds the namespace write lock
+*/
+void free_inode(int i) {
+	trim_extents(&filesystem[i], 0);
+	filesystem[i].size = 0;
+	filesystem[i].is_active = false;
+	filesystem[i].nlink = 0;
+	filesystem[i].hash_next = super->free_inodes;
+	super->free_inodes = i;
+	super->used_inodes--;
+}
+
+/*
+ * Whether an inode has lost its last name and nothing refers to it any more
+*/
+bool is_orphan(int i) {
+	// The counts also change under the namespace read lock
+	return filesystem[i].nlink == 0 && __atomic_load_n(&inode_state[i].open_count, __ATOMIC_SEQ_CST) == 0 &&
+		   __atomic_load_n(&inode_state[i].lookup_count, __ATOMIC_SEQ_CST) == 0;
+}
+
+/*
+ * Frees an inode once its last open handle or kernel reference is dropped.
+ * The reference is dropped under the namespace read lock, and unlink and rmdir check the counts
+ * under the write lock, so only one side sees the inode orphaned.
+*/
+void drop_reference(int i, int handles, uint64_t lookups) {
+	pthread_rwlock_rdlock(&namespace_lock);
+	__atomic_sub_fetch(&inode_state[i].open_count, handles, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&inode_state[i].lookup_count, lookups, __ATOMIC_SEQ_CST);
+	bool orphan = is_orphan(i);
+	pthread_rwlock_unlock(&namespace_lock);
+
+	if (orphan) {
+		pthread_rwlock_wrlock(&namespace_lock);
+		if (filesystem[i].is_active && is_orphan(i)) {
+			unlist_orphan(i);
+			free_inode(i);
+			journal_entry(i);
+			journal_end();
+		}
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+}
+
+/*
+ * Takes an inode off the orphan list, the caller holds the namespace write lock.
+ * The list only holds files unlinked while open, so it is short.
+*/
+void unlist_orphan(int i) {
+	int *link = &super->orphans;
+	while (*link != -1) {
+		if (*link == i) {
+			*link = filesystem[i].hash_next;
+			filesystem[i].hash_next = -1;
+			return;
+		}
+		link = &filesystem[*link].hash_next;
+	}
+}
+
+/*
+ * Frees the inodes that were unlinked but still in use when the filesystem was last unmounted.
+ * Nothing from that mount refers to them any more.
+*/
+void free_orphans() {
+	while (super->orphans != -1) {
+		int i = super->orphans;
+		super->orphans = filesystem[i].hash_next;
+		free_inode(i);
+		journal_inode(i);
+	}
+	journal_end();
+}
+
+/*
+ * Records a change to the contents of an inode, the caller holds its lock for writing
+*/
+void touch_inode(Inode *inode) {
+	inode->m_time = inode->c_time = time(NULL);
+}
+
+/*
+ * Records a change to the attributes of an inode, the caller holds its lock for writing
+*/
+void change_inode(Inode *inode) {
+	inode->c_time = time(NULL);
+}
+
+/*
+ * Records a change to the entries of a directory, adding links to its link count.
+ * Each subdirectory links back to its parent with "..", so the count changes with them.
+*/
+void touch_dir(int dir, int links) {
+	pthread_rwlock_wrlock(inode_lock(dir));
+	filesystem[dir].nlink += links;
+	touch_inode(&filesystem[dir]);
+	pthread_rwlock_unlock(inode_lock(dir));
+}
+
+/*
+ * Links an inode into the child list of its parent directory
+*/
+void dir_add_child(int parent, int i) {
+	Inode *dir = &filesystem[parent];
+	touch_dir(parent, filesystem[i].is_dir ? 1 : 0);
+
+	filesystem[i].parent = parent;
+	filesystem[i].dir_cookie = super->next_dir_cookie++;
+	filesystem[i].prev_sibling = -1;
+	filesystem[i].next_sibling = dir->first_child;
+	if (dir->first_child != -1) {
+		filesystem[dir->first_child].prev_sibling = i;
+	}
+	dir->first_child = i;
+	dir->child_count++;
+}
+
+/*
+ * Unlinks an inode from the child list of its parent directory
+*/
+void dir_remove_child(int i) {
+	Inode *inode = &filesystem[i];
+	Inode *dir = &filesystem[inode->parent];
+	touch_dir(inode->parent, inode->is_dir ? -1 : 0);
+
+	if (inode->prev_sibling != -1) {
+		filesystem[inode->prev_sibling].next_sibling = inode->next_sibling;
+	} else {
+		dir->first_child = inode->next_sibling;
+	}
+	if (inode->next_sibling != -1) {
+		filesystem[inode->next_sibling].prev_sibling = inode->prev_sibling;
+	}
+	dir->child_count--;
+	inode->parent = -1;
+	inode->next_sibling = -1;
+	inode->prev_sibling = -1;
+}
+
+/*
+ * Returns the k-th extent of an inode, spilling over into the indirect block
+*/
+Extent *extent_at(Inode *inode, uint32_t k) {
+	if (k < INODE_EXTENTS) {
+		return &inode->extents[k];
+	}
+	return &blocks[inode->indirect].extents[k - INODE_EXTENTS];
+}
+
+/*
+ * Whether an extent is a compressed cluster, rather than a plain run written or not
+*/
+bool is_cluster(const Extent *e) {
+	return e->packed != 0 && e->packed != EXTENT_UNWRITTEN;
+}
+
+/*
+ * Returns the number of blocks an extent holds, fewer than it covers when it is a compressed cluster
+*/
+uint32_t extent_blocks(const Extent *e) {
+	return is_cluster(e) ? (e->packed + BLOCK_SIZE - 1) / BLOCK_SIZE : e->length;
+}
+
+/*
+ * Adds a compressed cluster to the compression counts of the superblock, or takes it away with a sign of -1
+*/
+void count_cluster(const Extent *e, int sign) {
+	if (is_cluster(e)) {
+		__atomic_add_fetch(&super->packed_blocks, (uint64_t) (int64_t) sign * e->length, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&super->packed_stored, (uint64_t) (int64_t) sign * extent_blocks(e), __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Binary search for the extent holding a file block.
+ * Returns its position, or -(insert position) - 1 if the block is not mapped.
+*/
+int find_extent(Inode *inode, uint32_t logical) {
+	int low = 0;
+	int high = (int) inode->extent_count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		Extent *e = extent_at(inode, mid);
+		if (logical < e->logical) {
+			high = mid - 1;
+		} else if (logical >= e->logical + e->length) {
+			low = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+	return -low - 1;
+}
+
+/*
+ * Makes room for count more extents in the extent map, allocating the indirect block when needed
+*/
+int reserve_extents(Inode *inode, uint32_t count) {
+	if (inode->extent_count + count > MAX_EXTENTS) {
+		return -EFBIG;
+	}
+	if (inode->extent_count + count > INODE_EXTENTS && inode->indirect == -1) {
+		uint32_t allocated;
+		int block = alloc_blocks(-1, 1, &allocated);
+		if (block < 0) {
+			return -ENOSPC;
+		}
+		inode->indirect = block;
+		inode->block_count++;
+	}
+	return 0;
+}
+
+/*
+ * Inserts an extent at a position in the extent map, allocating the indirect block when needed
+*/
+int insert_extent(Inode *inode, uint32_t pos, Extent extent) {
+	int err = reserve_extents(inode, 1);
+	if (err < 0) {
+		return err;
+	}
+	for (uint32_t k = inode->extent_count; k > pos; k--) {
+		*extent_at(inode, k) = *extent_at(inode, k - 1);
+	}
+	*extent_at(inode, pos) = extent;
+	inode->extent_count++;
+	return 0;
+}
+
+/*
+ * Releases all blocks past a file block, trimming the extent that straddles it
+*/
+void trim_extents(Inode *inode, uint32_t first_unused) {
+	while (inode->extent_count > 0) {
+		Extent *e = extent_at(inode, inode->extent_count - 1);
+		if (e->logical + e->length <= first_unused) {
+			break;
+		}
+		if (e->logical < first_unused) {
+			// A compressed cluster is kept whole, the caller clears what lies past the end in it
+			if (is_cluster(e)) {
+				break;
+			}
+			uint32_t keep = first_unused - e->logical;
+			free_blocks(e->start + keep, e->length - keep);
+			inode->block_count -= e->length - keep;
+			e->length = keep;
+			break;
+		}
+		count_cluster(e, -1);
+		free_blocks(e->start, extent_blocks(e));
+		inode->block_count -= extent_blocks(e);
+		inode->extent_count--;
+	}
+	if (inode->extent_count <= INODE_EXTENTS && inode->indirect != -1) {
+		free_blocks(inode->indirect, 1);
+		inode->block_count--;
+		inode->indirect = -1;
+	}
+}
+
+/*
+ * Counts the extents remap_extent adds when it maps file blocks [first, first + count) of extent k elsewhere
+*/
+uint32_t remap_pieces(Inode *inode, uint32_t k, uint32_t first, uint32_t count) {
+	Extent *e = extent_at(inode, k);
+	return (first > e->logical) + (first + count < e->logical + e->length);
+}
+
+/*
+ * Maps file blocks [first, first + count) of plain extent k to the run at start, written, splitting the extent around
+ * them. The caller frees the blocks they had if they move, and made room for the extents this adds with reserve_extents.
+*/
+void remap_extent(Inode *inode, uint32_t k, uint32_t first, uint32_t count, uint32_t start) {
+	Extent e = *extent_at(inode, k);
+	uint32_t end = first + count;
+	uint32_t pos = k;
+	if (first > e.logical) {
+		extent_at(inode, k)->length = first - e.logical;
+		insert_extent(inode, ++pos, (Extent) { first, start, count, 0 });
+	} else {
+		*extent_at(inode, k) = (Extent) { first, start, count, 0 };
+	}
+	if (end < e.logical + e.length) {
+		insert_extent(inode, pos + 1, (Extent) { end, e.start + (end - e.logical), e.logical + e.length - end, e.packed });
+	}
+}
+
+/*
+ * Removes the extent at a position from the extent map and frees its blocks
+*/
+void remove_extent(Inode *inode, uint32_t k) {
+	Extent *e = extent_at(inode, k);
+	count_cluster(e, -1);
+	free_blocks(e->start, extent_blocks(e));
+	inode->block_count -= extent_blocks(e);
+	for (uint32_t j = k + 1; j < inode->extent_count; j++) {
+		*extent_at(inode, j - 1) = *extent_at(inode, j);
+	}
+	inode->extent_count--;
+	if (inode->extent_count <= INODE_EXTENTS && inode->indirect != -1) {
+		free_blocks(inode->indirect, 1);
+		inode->block_count--;
+		inode->indirect = -1;
+	}
+}
+
+/*
+ * Unmaps file blocks [first, end) and frees the blocks they held, splitting the extents that straddle the range.
+ * A compressed cluster is only unmapped when the range covers all of it, the caller clears its part of any other.
+*/
+int punch_extents(Inode *inode, uint32_t first, uint32_t end) {
+	int k = find_extent(inode, first);
+	k = k < 0 ? -k - 1 : k;
+	while (k < (int) inode->extent_count) {
+		Extent *e = extent_at(inode, k);
+		if (e->logical >= end) {
+			break;
+		}
+		uint32_t from = e->logical > first ? e->logical : first;
+		uint32_t to = e->logical + e->length < end ? e->logical + e->length : end;
+		if (from == e->logical && to == e->logical + e->length) {
+			remove_extent(inode, k);
+			continue;
+		}
+		if (is_cluster(e)) {
+			k++;
+			continue;
+		}
+		// A hole in the middle of an extent leaves a piece on either side of it, unwritten if the extent was
+		if (from > e->logical && to < e->logical + e->length) {
+			int err = insert_extent(inode, k + 1, (Extent) { to, e->start + (to - e->logical), e->logical + e->length - to, e->packed });
+			if (err < 0) {
+				return err;
+			}
+			e = extent_at(inode, k);
+		}
+		free_blocks(e->start + (from - e->logical), to - from);
+		inode->block_count -= to - from;
+		if (from == e->logical) {
+			e->start += to - from;
+			e->length -= to - from;
+			e->logical = to;
+		} else {
+			e->length = from - e->logical;
+		}
+		k++;
+	}
+	return 0;
+}
+
+/*
+ * Marks a run of blocks held by an inode as used, unless it is out of range or conflicts with what is claimed already.
+ * A plain run that is claimed again shares its blocks, counting the extra references. Indirect blocks and
+ * compressed clusters are changed in place and never shared, the blocks they claim are set in unshared.
+*/
+bool claim_blocks(uint32_t start, uint32_t count, bool shareable, uint64_t *unshared) {
+	if (count == 0 || start >= BLOCKS_COUNT || count > BLOCKS_COUNT - start) {
+		return false;
+	}
+	if (free_run_length(start, count) < count) {
+		if (!shareable) {
+			return false;
+		}
+		for (uint32_t b = start; b < start + count; b++) {
+			bool used = next_free_block(b, b + 1) < 0;
+			if (used && (unshared[b / 64] & (1ULL << b % 64) || block_shares[b] == MAX_SHARES)) {
+				return false;
+			}
+		}
+		for (uint32_t b = start; b < start + count; b++) {
+			if (next_free_block(b, b + 1) < 0) {
+				block_shares[b]++;
+				super->shared_blocks++;
+			} else {
+				mark_blocks(b, 1, false);
+			}
+		}
+		return true;
+	}
+	mark_blocks(start, count, false);
+	for (uint32_t b = start; !shareable && b < start + count; b++) {
+		unshared[b / 64] |= 1ULL << b % 64;
+	}
+	return true;
+}
+
+/*
+ * Marks the blocks of every active inode as used, used after a crash, and counts the references to shared blocks.
+ * A file is cut short at the first extent that cannot be claimed, so no block ends up both shared and changed in place.
+ * The fingerprint index is emptied, runs are indexed again as they are written.
+*/
+void rebuild_block_map() {
+	uint64_t *unshared = calloc(BITMAP_WORDS, sizeof(uint64_t));
+	if (unshared == NULL) {
+		perror("Error rebuilding the free space map\n");
+		exit(1);
+	}
+	reset_block_map();
+	memset(block_shares, 0, (size_t) BLOCKS_COUNT * sizeof(uint16_t));
+	memset(fingerprints, 0, (size_t) DEDUP_BUCKETS * DEDUP_WAYS * sizeof(Fingerprint));
+	super->packed_blocks = 0;
+	super->packed_stored = 0;
+	super->shared_blocks = 0;
+	for (int i = 0; i < super->inode_count; i++) {
+		Inode *inode = &filesystem[i];
+		if (!inode->is_active || inode->is_inline) {
+			continue;
+		}
+		inode->block_count = 0;
+		if (inode->extent_count > MAX_EXTENTS) {
+			inode->extent_count = MAX_EXTENTS;
+		}
+		if (inode->extent_count > INODE_EXTENTS && (inode->indirect < 0 || !claim_blocks(inode->indirect, 1, false, unshared))) {
+			inode->extent_count = INODE_EXTENTS;
+		}
+		if (inode->extent_count <= INODE_EXTENTS) {
+			inode->indirect = -1;
+		} else {
+			inode->block_count++;
+		}
+		for (uint32_t k = 0; k < inode->extent_count; k++) {
+			Extent *e = extent_at(inode, k);
+			bool valid = !is_cluster(e) || (e->length == CLUSTER_BLOCKS && e->logical % CLUSTER_BLOCKS == 0 &&
+											e->packed <= CLUSTER_SIZE);
+			if (!valid || !claim_blocks(e->start, extent_blocks(e), e->packed == 0, unshared)) {
+				if (inode->size > (off_t) e->logical * BLOCK_SIZE) {
+					inode->size = (off_t) e->logical * BLOCK_SIZE;
+				}
+				inode->extent_count = k;
+				break;
+			}
+			inode->block_count += extent_blocks(e);
+			count_cluster(e, 1);
+		}
+		if (inode->extent_count <= INODE_EXTENTS && inode->indirect != -1) {
+			mark_blocks(inode->indirect, 1, true);
+			unshared[inode->indirect / 64] &= ~(1ULL << inode->indirect % 64);
+			inode->block_count--;
+			inode->indirect = -1;
+		}
+	}
+	free(unshared);
+}
+
+/*
+ * Whether the name of an inode is a NUL terminated name inside the arena, checked after a crash
+*/
+bool valid_name(int i) {
+	Inode *inode = &filesystem[i];
+	uint64_t offset = inode->name_offset;
+	size_t length = inode->name_length;
+	return length < MAX_NAME_LENGTH && (length > 0 || i == 0) && offset % NAME_GRANULE == 0 &&
+		   offset + length < NAME_ARENA_SIZE && name_arena[offset + length] == '\0' &&
+		   memchr(name_arena + offset, '\0', length) == NULL;
+}
+
+/*
+ * Orders inodes by their directory cookies
+*/
+int compare_dir_cookie(const void *a, const void *b) {
+	off_t x = filesystem[*(const int *) a].dir_cookie;
+	off_t y = filesystem[*(const int *) b].dir_cookie;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Frees every inode that cannot be reached from the root through active directories, used after a crash.
+ * Each parent chain is walked up to an inode already checked, state holds 0 for unchecked, 1 for reachable,
+ * 2 for dropped and 3 for inodes on the chain being walked, so a cycle ends the walk as well.
+*/
+void drop_unreachable(char *state, int *chain) {
+	int count = super->inode_count;
+	memset(state, 0, count);
+	state[0] = 1;
+	for (int i = 1; i < count; i++) {
+		int length = 0;
+		int j = i;
+		while (j >= 0 && j < count && state[j] == 0 && filesystem[j].is_active) {
+			state[j] = 3;
+			chain[length++] = j;
+			j = filesystem[j].parent;
+		}
+		// Walked back down, every entry needs a reachable directory above it
+		bool reachable = j >= 0 && j < count && state[j] == 1 && filesystem[j].is_dir;
+		while (length > 0) {
+			int k = chain[--length];
+			state[k] = reachable ? 1 : 2;
+			if (!reachable) {
+				filesystem[k].is_active = false;
+			}
+			reachable = reachable && filesystem[k].is_dir;
+		}
+	}
+}
+
+/*
+ * Builds the name index from scratch, dropping an entry whose directory already has its name.
+ * Returns whether anything was dropped, whatever was below it is then unreachable.
+*/
+bool index_entries() {
+	bool dropped = false;
+	super->index_buckets = NAME_INDEX_MIN_BUCKETS;
+	for (unsigned int b = 0; b < super->index_buckets; b++) {
+		name_index[b] = -1;
+	}
+	super->used_inodes = 0;
+	for (int i = 1; i < super->inode_count; i++) {
+		if (!filesystem[i].is_active) {
+			continue;
+		}
+		if (lookup_child(filesystem[i].parent, inode_name(i), filesystem[i].name_length) != -1) {
+			filesystem[i].is_active = false;
+			dropped = true;
+			continue;
+		}
+		super->used_inodes++;
+		index_insert(i);
+	}
+	return dropped;
+}
+
+/*
+ * Puts the gaps between the names in use on the free name lists, order has room for every inode
+*/
+void rebuild_name_lists(int *order) {
+	int named = 0;
+	for (int i = 0; i < super->inode_count; i++) {
+		if (has_name(i)) {
+			order[named++] = i;
+		}
+	}
+	qsort(order, named, sizeof(int), compare_name_offset);
+	for (uint32_t c = 0; c < NAME_CLASSES; c++) {
+		super->free_names[c] = NO_NAME;
+	}
+	uint64_t end = 0;
+	for (int k = 0; k <= named; k++) {
+		uint64_t next = k < named ? filesystem[order[k]].name_offset : end;
+		while (end < next) {
+			uint32_t granules = (next - end) / NAME_GRANULE < NAME_CLASSES ? (next - end) / NAME_GRANULE : NAME_CLASSES;
+			push_free_name(end, granules);
+			end += granules * NAME_GRANULE;
+		}
+		if (k < named) {
+			end = next + NAME_GRANULES(filesystem[order[k]].name_length) * NAME_GRANULE;
+		}
+	}
+	super->name_arena_used = end;
+}
+
+/*
+ * Rebuilds everything that follows from the inodes after a crash: the child lists, link counts, name index,
+ * free lists and counts. The journal brings back whole committed operations, but the kernel may also have
+ * written back parts of operations that never committed, so inodes are checked as they are linked in.
+ * An inode with a broken or overlapping name, no way up to the root, or a name its directory already has
+ * is dropped along with everything below it.
+*/
+void rebuild_index() {
+	int count = super->inode_count;
+	int *order = malloc(count * sizeof(int));
+	int *chain = malloc(count * sizeof(int));
+	char *state = malloc(count);
+	if (order == NULL || chain == NULL || state == NULL) {
+		perror("Error rebuilding the image\n");
+		exit(1);
+	}
+
+	// Orphans are freed now, rebuild_block_map does not count their blocks
+	filesystem[0].is_active = true;
+	filesystem[0].is_dir = true;
+	filesystem[0].parent = -1;
+	for (int i = 1; i < count; i++) {
+		if (filesystem[i].is_active && (filesystem[i].nlink == 0 || !valid_name(i))) {
+			filesystem[i].is_active = false;
+		}
+	}
+	// Of two names sharing arena space, the one starting later goes
+	int named = 0;
+	for (int i = 0; i < count; i++) {
+		if (filesystem[i].is_active) {
+			order[named++] = i;
+		}
+	}
+	qsort(order, named, sizeof(int), compare_name_offset);
+	uint64_t end = 0;
+	for (int k = 0; k < named; k++) {
+		int i = order[k];
+		if (filesystem[i].name_offset < end && i != 0) {
+			filesystem[i].is_active = false;
+			continue;
+		}
+		end = filesystem[i].name_offset + NAME_GRANULES(filesystem[i].name_length) * NAME_GRANULE;
+	}
+	do {
+		drop_unreachable(state, chain);
+	} while (index_entries());
+	super->used_inodes++;
+
+	// Child lists are rebuilt from the parent links, newest entry first as dir_add_child leaves them
+	int linked = 0;
+	for (int i = 0; i < count; i++) {
+		if (!filesystem[i].is_active) {
+			continue;
+		}
+		filesystem[i].first_child = -1;
+		filesystem[i].child_count = 0;
+		filesystem[i].nlink = filesystem[i].is_dir ? 2 : 1;
+		if (i != 0) {
+			order[linked++] = i;
+		}
+	}
+	qsort(order, linked, sizeof(int), compare_dir_cookie);
+	for (int k = 0; k < linked; k++) {
+		int i = order[k];
+		Inode *dir = &filesystem[filesystem[i].parent];
+		filesystem[i].prev_sibling = -1;
+		filesystem[i].next_sibling = dir->first_child;
+		if (dir->first_child != -1) {
+			filesystem[dir->first_child].prev_sibling = i;
+		}
+		dir->first_child = i;
+		dir->child_count++;
+		if (filesystem[i].is_dir) {
+			dir->nlink++;
+		}
+	}
+
+	// Free lists, counts and the end of the arena
+	super->free_inodes = -1;
+	super->orphans = -1;
+	super->next_dir_cookie = 3;
+	for (int i = count - 1; i >= 0; i--) {
+		if (!filesystem[i].is_active) {
+			filesystem[i].hash_next = super->free_inodes;
+			super->free_inodes = i;
+		} else if (filesystem[i].dir_cookie >= super->next_dir_cookie) {
+			super->next_dir_cookie = filesystem[i].dir_cookie + 1;
+		}
+	}
+	rebuild_name_lists(order);
+
+	free(order);
+	free(chain);
+	free(state);
+}
+
+
+/*
+ * Return file attributes.
+ * The "stat" structure is described in detail in the stat(2) manual page.
+ * For the given pathname, this should fill in the elements of the "stat" structure.
+ * If a field is meaningless or semi-meaningless (e.g., st_ino) then it should be set to 0 or given a "reasonable" value.
+ * This call is pretty much required for a usable filesystem.
+*/
+int dm510fs_getattr(const char *path, struct stat *stbuf) {
+	return dm510fs_fgetattr(path, stbuf, NULL);
+}
+
+/*
+ * Return file attributes of an open file, or of the path when there is no file handle
+*/
+int dm510fs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_GETATTR);
+	int v = virtual_entry(path, fi);
+	if(v != -1) {
+		if(v >= 0) {
+			stat_virtual(v, stbuf);
+		}
+		return v < 0 ? v : 0;
+	}
+	int i = get_inode(path, fi);
+	if(i < 0) {
+		TRACE(TRACE_DEBUG, "getattr: path not found", 0, 0, 0);
+		return i;
+	}
+	stat_inode(i, stbuf);
+	put_inode(fi);
+	return 0;
+}
+
+/*
+ * Fills in the attributes of an inode the caller keeps alive
+*/
+void stat_inode(int i, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = INODE_NUMBER(i);
+	stbuf->st_blksize = BLOCK_SIZE;
+	// Every field is kept up to date as the inode changes, so nothing but the size is computed here
+	pthread_rwlock_rdlock(inode_lock(i));
+	Inode *inode = &filesystem[i];
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->nlink;
+	// Buffered data counts, so the kernel does not cut reads short, readers commit it before they look at the size
+	off_t buffered_end = inode_state[i].buffered_end;
+	stbuf->st_size = buffered_end > inode->size ? buffered_end : inode->size;
+	stbuf->st_blocks = (blkcnt_t) inode->block_count * (BLOCK_SIZE / 512);
+	stbuf->st_atime = inode->a_time;
+	stbuf->st_mtime = inode->m_time;
+	stbuf->st_ctime = inode->c_time;
+	pthread_rwlock_unlock(inode_lock(i));
+}
+
+/*
+ * Finds the child a listing continues from after the entry with cookie offset, the caller holds the namespace lock.
+ * Children are listed newest first, so that is the first child with a lower cookie.
+ * The child where the handle's previous listing stopped is used when it is still in place, otherwise the list is searched.
+*/
+int resume_listing(int dir, FileHandle *fh, off_t offset) {
+	if (fh != NULL && fh->dir_offset == offset) {
+		int next = fh->dir_next;
+		// A slot reused for a new entry has a higher cookie than any entry listed before it was added
+		if (next == -1 || (filesystem[next].is_active && filesystem[next].parent == dir &&
+						   filesystem[next].dir_cookie < offset)) {
+			return next;
+		}
+	}
+	int child = filesystem[dir].first_child;
+	while (child != -1 && filesystem[child].dir_cookie >= offset) {
+		child = filesystem[child].next_sibling;
+	}
+	return child;
+}
+
+/*
+ * Return one or more directory entries (struct dirent) to the caller. This is one of the most complex FUSE functions.
+ * Required for essentially any filesystem, since it's what makes ls and a whole bunch of other things work.
+ * The readdir function is somewhat like read, in that it starts at a given offset and returns results in a caller-supplied buffer.
+ * However, the offset not a byte offset, and the results are a series of struct dirents rather than being uninterpreted bytes.
+ * To make life easier, FUSE provides a "filler" function that will help you put things into the buffer.
+ *
+ * The general plan for a complete and correct readdir is:
+ *
+ * 1. Find the first directory entry following the given offset (see below).
+ * 2. Optionally, create a struct stat that describes the file as for getattr (but FUSE only looks at st_ino and the file-type bits of st_mode).
+ * 3. Call the filler function with arguments of buf, the null-terminated filename, the address of your struct stat
+ *    (or NULL if you have none), and the offset of the next directory entry.
+ * 4. If filler returns nonzero, or if there are no more files, return 0.
+ * 5. Find the next file in the directory.
+ * 6. Go back to step 2.
+ * From FUSE's point of view, the offset is an uninterpreted off_t (i.e., an unsigned integer).
+ * You provide an offset when you call filler, and it's possible that such an offset might come back to you as an argument later.
+ * Typically, it's simply the byte offset (within your directory layout) of the directory entry, but it's really up to you.
+ *
+ * It's also important to note that readdir can return errors in a number of instances;
+ * in particular it can return -EBADF if the file handle is invalid, or -ENOENT if you use the path argument and the path doesn't exist.
+*/
+int dm510fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_READDIR);
+	int v = virtual_entry(path, fi);
+	if (v != -1) {
+		return v == STATS_DIR ? readdir_virtual(buf, filler, offset) : v == STATS_FILE ? -ENOTDIR : v;
+	}
+
+	// The child lists only change under the namespace write lock
+	pthread_rwlock_rdlock(&namespace_lock);
+	FileHandle *fh = get_handle(fi);
+	int i = fh != NULL ? fh->inode : lookup_inode(path);
+	if (i == -1) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return -ENOENT;
+	}
+	if (filesystem[i].is_dir == false) {
+		pthread_rwlock_unlock(&namespace_lock);
+		return -ENOTDIR;
+	}
+
+	// Offsets are cookies: 1 is ".", 2 is ".." and every child has its own cookie, so a listing
+	// can continue after an entry without counting the entries before it.
+	// Each entry carries the full attributes of its inode.
+	int parent = filesystem[i].parent != -1 ? filesystem[i].parent : i;
+	struct stat st;
+	int child = filesystem[i].first_child;
+	if (offset < 1) {
+		stat_inode(i, &st);
+		if (filler(buf, ".", &st, 1) != 0) {
+			goto out;
+		}
+	}
+	if (offset < 2) {
+		stat_inode(parent, &st);
+		if (filler(buf, "..", &st, 2) != 0) {
+			goto out;
+		}
+	}
+	if (offset > 2) {
+		child = resume_listing(i, fh, offset);
+	}
+	for (; child != -1; child = filesystem[child].next_sibling) {
+		stat_inode(child, &st);
+		if (filler(buf, inode_name(child), &st, filesystem[child].dir_cookie) != 0) {
+			break;
+		}
+		offset = filesystem[child].dir_cookie;
+	}
+	// Remember where the listing stopped, the next call usually continues from there
+	if (fh != NULL) {
+		fh->dir_offset = offset;
+		fh->dir_next = child;
+	}
+out:
+	pthread_rwlock_unlock(&namespace_lock);
+	return 0;
+}
+
+/*
+ * Open a file.
+ * If you aren't using file handles, this function should just check for existence and permissions and return either success or an error code.
+ * If you use file handles, you should also allocate any necessary structures and set fi->fh.
+ * In addition, fi has some other fields that an advanced filesystem might find useful; see the structure definition in fuse_common.h for very brief commentary.
+ * Link: https://github.com/libfuse/libfuse/blob/0c12204145d43ad4683136379a130385ef16d166/include/fuse_common.h#L50
+*/
+int dm510fs_open(const char *path, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_OPEN);
+	return open_handle(path, fi, false);
+}
+
+/*
+ * Open a directory, the handle lets readdir skip the path lookup
+*/
+int dm510fs_opendir(const char *path, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_OPENDIR);
+	return open_handle(path, fi, true);
+}
+
+/*
+ * Allocates the handle of an open file or directory and stores it in fi->fh
+*/
+int open_handle(const char *path, struct fuse_file_info *fi, bool is_dir) {
+	int v = lookup_virtual_path(path);
+	if (v != -1) {
+		return v < 0 ? v : open_virtual(v, fi, is_dir);
+	}
+	pthread_rwlock_rdlock(&namespace_lock);
+	int i = lookup_inode(path);
+	int res = i != -1 ? open_inode(i, fi, is_dir) : -ENOENT;
+	pthread_rwlock_unlock(&namespace_lock);
+	return res;
+}
+
+/*
+ * Allocates the handle of an inode the caller keeps alive, by holding the namespace lock or a kernel reference
+*/
+int open_inode(int i, struct fuse_file_info *fi, bool is_dir) {
+	if (filesystem[i].is_dir != is_dir) {
+		return is_dir ? -ENOTDIR : -EISDIR;
+	}
+	FileHandle *fh = malloc(sizeof(FileHandle));
+	if (fh == NULL) {
+		return -ENOMEM;
+	}
+	// Other handles of the same inode may be opened at the same time
+	__atomic_add_fetch(&inode_state[i].open_count, 1, __ATOMIC_SEQ_CST);
+	op_inode(i);
+	fh->inode = i;
+	fh->last_offset = 0;
+	fh->sequential = false;
+	fh->wb_data = NULL;
+	fh->wb_length = 0;
+	fh->wb_error = 0;
+	fh->written_from = 0;
+	fh->written_to = 0;
+	fh->run_start = 0;
+	fh->readahead_end = 0;
+	fh->text = NULL;
+	fh->text_length = 0;
+	fh->dir_offset = 0;
+	fh->dir_next = -1;
+	fi->fh = (uintptr_t) fh;
+	return 0;
+}
+
+/*
+ * Frees the handle of an open file or directory.
+ * When the inode was unlinked while it was open, the last release frees it.
+*/
+int release_handle(struct fuse_file_info *fi) {
+	FileHandle *fh = get_handle(fi);
+	int i = fh->inode;
+	if (is_virtual(i)) {
+		free(fh->text);
+		free(fh);
+		fi->fh = 0;
+		return 0;
+	}
+	// Runs are shared under the namespace lock, so the files holding them cannot be freed meanwhile
+	bool dedup = options.dedup && fh->written_to > 0;
+
+	// Commit what is left in the write-back buffer
+	if (dedup) {
+		pthread_rwlock_rdlock(&namespace_lock);
+	}
+	pthread_rwlock_wrlock(inode_lock(i));
+	commit_buffer(fh);
+	if (dedup) {
+		dedup_extents(i, fh->written_from, fh->written_to);
+	}
+	pthread_rwlock_unlock(inode_lock(i));
+	if (dedup) {
+		pthread_rwlock_unlock(&namespace_lock);
+	}
+	free(fh->wb_data);
+	free(fh);
+	fi->fh = 0;
+
+	drop_reference(i, 1, 0);
+	return 0;
+}
+
+/*
+ * Read size bytes from the given file into the buffer buf, beginning offset bytes into the file. See read(2) for full details.
+ * Returns the number of bytes transferred, or 0 if offset was at or beyond the end of the file. Required for any sensible filesystem.
+*/
+int dm510fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_READ);
+	op_offset(offset);
+	int v = virtual_entry(path, fi);
+	if(v != -1){
+		return v == STATS_FILE ? read_virtual(get_handle(fi), buf, size, offset) : v == STATS_DIR ? -EISDIR : v;
+	}
+
+	// Use the open file handle, or look up the inode in the path index
+	int i = get_inode(path, fi);
+	// If inode is not found, return error code -ENOENT
+    if(i < 0){
+        return i;
+    }
+	FileHandle *fh = get_handle(fi);
+	// Readers of the same file share its lock
+	lock_inode_for_read(i);
+	int res = read_data(&filesystem[i], buf, size, offset, cache_use(fh, offset));
+	// Reads carrying on from the last one get the blocks after them asked for ahead of time
+	if(fh != NULL && res > 0 && offset == fh->last_offset){
+		cache_readahead(&filesystem[i], fh, offset + res);
+	}
+	pthread_rwlock_unlock(inode_lock(i));
+	put_inode(fi);
+	note_access(fh, offset, res);
+	op_bytes(res);
+	return res;
+}
+
+/*
+ * Reads from the extents of an inode, the caller holds the inode lock.
+ * use tells the block cache how the blocks are read.
+*/
+int read_data(Inode *inode, char *buf, size_t size, off_t offset, int use) {
+	// Nothing to read at or past the end of the file
+	if(offset >= inode->size){
+		return 0;
+	}
+	if(size > inode->size - offset){
+		size = inode->size - offset;
+	}
+	// Small files are read straight from the inode
+	if(inode->is_inline){
+		decryptCaesarCypher(buf, inode->inline_data + offset, size);
+		return size;
+	}
+	// Number of bytes left to read
+    size_t bytesLeft = size;
+
+	// Read loop copying one extent at a time
+    while (bytesLeft > 0){
+		uint32_t blockIndex = offset / BLOCK_SIZE;
+		off_t blockOffset = offset % BLOCK_SIZE;
+
+		// Blocks that are not mapped are holes and read as zeros, up to the next extent
+		int k = find_extent(inode, blockIndex);
+        if(k < 0){
+			size_t holeLeft = bytesLeft;
+			if((uint32_t) (-k - 1) < inode->extent_count){
+				size_t gap = (size_t) (extent_at(inode, -k - 1)->logical - blockIndex) * BLOCK_SIZE - blockOffset;
+				holeLeft = gap < bytesLeft ? gap : bytesLeft;
+			}
+			memset(buf, 0, holeLeft);
+			buf += holeLeft;
+			offset += holeLeft;
+			bytesLeft -= holeLeft;
+			continue;
+        }
+		Extent *extent = extent_at(inode, k);
+
+		// Read up to the end of the extent
+		size_t extentLeft = (size_t) (extent->logical + extent->length - blockIndex) * BLOCK_SIZE - blockOffset;
+        size_t blockRead = bytesLeft < extentLeft ? bytesLeft : extentLeft;
+		
+		if(extent->packed == EXTENT_UNWRITTEN){
+			// Preallocated blocks read as zeros until they are written
+			memset(buf, 0, blockRead);
+		} else if(extent->packed != 0){
+			// Only this cluster is decompressed, straight into the buffer when the read covers all of it
+			size_t at = offset - (off_t) extent->logical * BLOCK_SIZE;
+			cache_touch(extent->start, extent_blocks(extent), use);
+			int err;
+			if(at == 0 && blockRead == CLUSTER_SIZE){
+				err = load_cluster(extent, buf);
+			} else {
+				char plain[CLUSTER_SIZE];
+				err = load_cluster(extent, plain);
+				memcpy(buf, plain + at, blockRead);
+			}
+			if(err < 0){
+				return bytesLeft == size ? err : (int) (size - bytesLeft);
+			}
+		} else {
+			// Copy data from the extent to the buffer, decrypting it on the way
+			uint32_t start = extent->start + (blockIndex - extent->logical);
+			cache_touch(start, (blockOffset + blockRead + BLOCK_SIZE - 1) / BLOCK_SIZE, use);
+			decryptCaesarCypher(buf, blocks[start].data + blockOffset, blockRead);
+		}
+
+		// Move the buffer pointer and update counters
+        buf += blockRead;
+        offset += blockRead;
+        bytesLeft -= blockRead;
+    }
+	// Return the number of bytes read
+    return size-bytesLeft;
+}
+
+const char zero_run[ZERO_RUN_SIZE];
+
+/*
+ * Maps a read onto the image, so it can be replied without copying: the stored bytes are the bytes of the file when
+ * there is no encryption, in plain extents, and holes and unwritten extents point at zeros.
+ * Fills runs with the pieces of the read, adjacent blocks in one piece.
+ * Returns the number of pieces, 0 at or past the end of the file, or -1 when the read has to be copied:
+ * encrypted, inline or compressed data, or more than max_runs pieces.
+ * The caller holds the inode lock for as long as the pieces are used.
+*/
+int map_read(Inode *inode, size_t size, off_t offset, int use, ReadRun *runs, int max_runs) {
+	if(shift != 0 || inode->is_inline){
+		return -1;
+	}
+	if(offset >= inode->size){
+		return 0;
+	}
+	if(size > inode->size - offset){
+		size = inode->size - offset;
+	}
+	int count = 0;
+	while(size > 0){
+		uint32_t blockIndex = offset / BLOCK_SIZE;
+		off_t blockOffset = offset % BLOCK_SIZE;
+		size_t length = size;
+		const char *data = NULL;
+
+		// Holes and preallocated blocks not written yet are zeros
+		int k = find_extent(inode, blockIndex);
+		Extent *extent = k >= 0 ? extent_at(inode, k) : NULL;
+		if(extent == NULL || extent->packed == EXTENT_UNWRITTEN){
+			if(extent != NULL){
+				size_t extentLeft = (size_t) (extent->logical + extent->length - blockIndex) * BLOCK_SIZE - blockOffset;
+				length = extentLeft < length ? extentLeft : length;
+			} else if((uint32_t) (-k - 1) < inode->extent_count){
+				size_t gap = (size_t) (extent_at(inode, -k - 1)->logical - blockIndex) * BLOCK_SIZE - blockOffset;
+				length = gap < length ? gap : length;
+			}
+			length = length < ZERO_RUN_SIZE ? length : ZERO_RUN_SIZE;
+		} else {
+			if(extent->packed != 0){
+				return -1;
+			}
+			size_t extentLeft = (size_t) (extent->logical + extent->length - blockIndex) * BLOCK_SIZE - blockOffset;
+			length = extentLeft < length ? extentLeft : length;
+			data = blocks[extent->start + (blockIndex - extent->logical)].data + blockOffset;
+		}
+
+		if(data != NULL && count > 0 && runs[count - 1].data + runs[count - 1].length == data){
+			runs[count - 1].length += length;
+		} else if(count == max_runs){
+			return -1;
+		} else {
+			runs[count++] = (ReadRun) { data, length };
+		}
+		offset += length;
+		size -= length;
+	}
+
+	// The blocks are only counted as read once the read is known not to be copied instead
+	for(int r = 0; r < count; r++){
+		if(runs[r].data != NULL){
+			size_t at = runs[r].data - blocks[0].data;
+			cache_touch(at / BLOCK_SIZE, (at % BLOCK_SIZE + runs[r].length + BLOCK_SIZE - 1) / BLOCK_SIZE, use);
+		}
+	}
+	return count;
+}
+
+/*
+ * Makes a directory
+*/
+int dm510fs_mkdir(const char *path, mode_t mode) {
+	OP_SCOPE(OP_MKDIR);
+	int res = make_path(path, S_IFDIR | 0755, true);
+	return res < 0 ? res : 0;
+}
+
+/*
+ * This is the only FUSE function that doesn't have a directly corresponding system call, although close(2) is related.
+ * Release is called when FUSE is completely done with a file; at that point, you can free up any temporarily allocated data structures.
+ */
+int dm510fs_release(const char *path, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_RELEASE);
+	return release_handle(fi);
+}
+
+/*
+ * Release a directory opened with opendir
+*/
+int dm510fs_releasedir(const char *path, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_RELEASEDIR);
+	return release_handle(fi);
+}
+
+/*
+ * Called on each close of an open file, commits its write-back buffer so the data is visible everywhere,
+ * and waits until the journal holds every change made to the file.
+ * Reports an error from an earlier commit of the buffer that could not be returned to the write that caused it.
+*/
+int dm510fs_flush(const char *path, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FLUSH);
+	FileHandle *fh = get_handle(fi);
+	if (is_virtual(fh->inode)) {
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(inode_lock(fh->inode));
+	int res = commit_buffer(fh);
+	if (res == 0) {
+		res = fh->wb_error;
+	}
+	fh->wb_error = 0;
+	pthread_rwlock_unlock(inode_lock(fh->inode));
+	if (res == 0) {
+		res = journal_wait(__atomic_load_n(&inode_state[fh->inode].journal_sequence, __ATOMIC_SEQ_CST));
+	}
+	return res;
+}
+
+/*
+ * Synchronize file contents: commits the write-back buffer and waits for the journal commit holding the file
+*/
+int dm510fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FSYNC);
+	(void) datasync;
+	return dm510fs_flush(path, fi);
+}
+
+/*
+ * Synchronize a directory, waits for the journal commit holding its last change
+*/
+int dm510fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FSYNCDIR);
+	(void) datasync;
+	FileHandle *fh = get_handle(fi);
+	if (is_virtual(fh->inode)) {
+		return 0;
+	}
+	return journal_wait(__atomic_load_n(&inode_state[fh->inode].journal_sequence, __ATOMIC_SEQ_CST));
+}
+
+/**
+ * Initialize filesystem
+ *
+ * The return value will passed in the `private_data` field of
+ * `struct fuse_context` to all file operations, and as a
+ * parameter to the destroy() method. It overrides the initial
+ * value provided to fuse_main() / fuse_new().
+ */
+void* dm510fs_init(struct fuse_conn_info *conn) {
+	start_tracing();
+	TRACE(TRACE_INFO, "init filesystem", 0, 0, 0);
+
+	// Ask the kernel for large requests, so each round trip moves more data through one copy pass.
+	// Spliced write requests arrive in a pipe, and write_buf reads them straight into the extents.
+	if (conn != NULL) {
+		conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_READ);
+		conn->max_write = MAX_WRITE;
+		conn->max_readahead = MAX_READAHEAD;
+	}
+
+	select_caesar_kernel();
+	select_crc32c_kernel();
+
+	// Creating and removing files must not starve behind a steady stream of readers
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&namespace_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	for(int j = 0; j < INODE_LOCK_STRIPES; j++) {
+		pthread_rwlock_init(&inode_locks[j], NULL);
+	}
+
+	// Per-mount state, the pages are only backed once they are touched
+	inode_state = mmap(NULL, (size_t) MAX_INODES * sizeof(InodeState), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (inode_state == MAP_FAILED || loadFileSystem(IMAGE_FILE) < 0 || open_journal(JOURNAL_FILE) < 0) {
+		perror("Error mounting the image\n");
+		exit(1);
+	}
+
+	// After a crash the operations committed to the journal are brought back first. The indexes and the free space map
+	// may be half updated, they are rebuilt from the inodes. After a clean unmount the journal is empty and they can be
+	// trusted as they are, and only the orphans left by the last mount are freed.
+	int groups = replay_journal();
+	if (groups > 0 || !super->clean) {
+		TRACE(TRACE_INFO, "init: image was not unmounted cleanly, replayed %lld journal commits, rebuilding it", groups, 0, 0);
+		rebuild_index();
+		rebuild_block_map();
+	} else {
+		free_orphans();
+	}
+	super->clean = 0;
+	// The journal starts out empty, on top of an image holding everything it had
+	if (checkpoint_now() < 0) {
+		exit(1);
+	}
+	start_journal();
+	start_cache();
+
+    return NULL;
+}
+
+/**
+ * Clean up filesystem
+ * Called on filesystem exit.
+ */
+void dm510fs_destroy(void *private_data) {
+	// The statistics of the whole mount go out with the trace, taken while the image is still mapped
+	char *text = NULL;
+	ssize_t length = -1;
+	stop_cache();
+	if (TRACE_INFO <= TRACE_LEVEL && TRACE_INFO <= options.trace_level) {
+		length = format_stats(&text);
+	}
+	saveFileSystem(IMAGE_FILE);
+
+	TRACE(TRACE_INFO, "file saved", 0, 0, 0);
+	TRACE(TRACE_INFO, "destroy filesystem", 0, 0, 0);
+	stop_tracing();
+	if (length >= 0) {
+		fwrite(text, 1, length, stdout);
+		free(text);
+	}
+}
+
+/*
+ * Makes a file 
+*/
+int dm510fs_mknod(const char *path, mode_t mode, dev_t rdev){
+	OP_SCOPE(OP_MKNOD);
+	int res = make_path(path, mode | S_IFREG, false);
+	return res < 0 ? res : 0;
+}
+
+/*
+ * Creates the inode for a new path, returns its index
+*/
+int make_path(const char *path, mode_t mode, bool is_dir){
+	const char *name;
+	int v = lookup_virtual_path(path);
+	if(v != -1){
+		return v < 0 ? -EACCES : -EEXIST;
+	}
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	int parent = lookup_parent(path, &name);
+	int res = parent != -1 ? make_inode(parent, name, mode, is_dir, 0) : -ENOENT;
+	pthread_rwlock_unlock(&namespace_lock);
+	return res;
+}
+
+/*
+ * Takes an unused inode slot, reusing freed slots before the table grows.
+ * Returns its index, or -1 when the table is full.
+*/
+int alloc_inode(){
+	int i = super->free_inodes;
+	if(i != -1){
+		super->free_inodes = filesystem[i].hash_next;
+		return i;
+	}
+	if(super->inode_count == MAX_INODES){
+		return -1;
+	}
+	return super->inode_count++;
+}
+
+/*
+ * Creates the inode for a new file or directory and links it into its parent, the caller holds the namespace write lock.
+ * lookups is the number of references the caller hands to the kernel along with the new inode.
+ * Returns the index of the inode.
+*/
+int make_inode(int parent, const char *name, mode_t mode, bool is_dir, uint64_t lookups){
+	// The statistics entries take no new names and cannot be shadowed
+	int v = lookup_virtual(parent, name);
+	if(v != -1) {
+		return v < 0 ? -EACCES : -EEXIST;
+	}
+	if(filesystem[parent].is_dir == false) {
+		return -ENOTDIR;
+	}
+	// A directory removed while the kernel still refers to it takes no new entries
+	if(filesystem[parent].nlink == 0) {
+		return -ENOENT;
+	}
+	size_t length = strlen(name);
+	if(length >= MAX_NAME_LENGTH) {
+		return -ENAMETOOLONG;
+	}
+	if(length == 0 || lookup_child(parent, name, length) != -1) {
+		return -EEXIST;
+	}
+
+	int i = alloc_inode();
+	if(i == -1) {
+		TRACE(TRACE_ERROR, "make_inode: no free inode", 0, 0, 0);
+		return -ENOSPC;
+	}
+	int res = store_name(name, length, &filesystem[i].name_offset);
+	if(res < 0) {
+		filesystem[i].hash_next = super->free_inodes;
+		super->free_inodes = i;
+		return res;
+	}
+	filesystem[i].is_active = true;
+	filesystem[i].is_dir = is_dir;
+	filesystem[i].mode = mode;
+	filesystem[i].nlink = is_dir ? 2 : 1;
+	filesystem[i].name_length = length;
+	filesystem[i].first_child = -1;
+	filesystem[i].child_count = 0;
+	inode_state[i].open_count = 0;
+	inode_state[i].lookup_count = lookups;
+	inode_state[i].buffered = NULL;
+	inode_state[i].buffered_end = 0;
+	inode_state[i].journal_sequence = 0;
+	filesystem[i].extent_count = 0;
+	filesystem[i].block_count = 0;
+	filesystem[i].indirect = -1;
+	filesystem[i].size = 0;
+	// New files start out inline
+	filesystem[i].is_inline = !is_dir;
+	memset(filesystem[i].inline_data, 0, INLINE_DATA_SIZE);
+	filesystem[i].a_time = time(NULL);
+	filesystem[i].m_time = filesystem[i].a_time;
+	filesystem[i].c_time = filesystem[i].a_time;
+	dir_add_child(parent, i);
+	super->used_inodes++;
+	index_insert(i);
+	journal_links(i);
+	journal_end();
+
+	TRACE(TRACE_DEBUG, "make_inode: inode %lld in directory %lld", i, parent, 0);
+	op_inode(i);
+	return i;
+}
+
+/*
+ * Function that tells the time of an action
+*/
+int dm510fs_utime(const char *path, struct utimbuf *time){
+	OP_SCOPE(OP_SETATTR);
+	if(lookup_virtual_path(path) != -1){
+		return -EACCES;
+	}
+
+	// Adds the times to the inode of the path
+	pthread_rwlock_rdlock(&namespace_lock);
+	int i = lookup_inode(path);
+	if(i == -1){
+		pthread_rwlock_unlock(&namespace_lock);
+		TRACE(TRACE_DEBUG, "utime: path not found", 0, 0, 0);
+		return -ENOENT;
+	}
+	pthread_rwlock_wrlock(inode_lock(i));
+	filesystem[i].a_time = time->actime;
+	filesystem[i].m_time = time->modtime;
+	change_inode(&filesystem[i]);
+	journal_inode(i);
+	journal_end();
+	pthread_rwlock_unlock(inode_lock(i));
+	pthread_rwlock_unlock(&namespace_lock);
+	return 0;
+}
+
+/*
+ * Maps blocks for a write starting in an unmapped file block.
+ * Allocates as many contiguous blocks as the write needs (up to the next extent).
+*/
+int map_blocks(Inode *inode, uint32_t pos, uint32_t blockIndex, off_t blockOffset, size_t bytesLeft){
+	uint32_t allocated;
+	int start = map_run(inode, pos, blockIndex, (blockOffset + bytesLeft + BLOCK_SIZE - 1) / BLOCK_SIZE, &allocated, false);
+	if(start < 0){
+		return start;
+	}
+
+	clear_around(start, allocated, blockOffset, bytesLeft);
+	return 0;
+}
+
+/*
+ * Blocks may hold old data, clears the parts of count blocks from start that a write of length bytes
+ * at blockOffset into the first of them does not cover
+*/
+void clear_around(uint32_t start, uint32_t count, off_t blockOffset, size_t length){
+	if(blockOffset > 0){
+		memset(blocks[start].data, 0, blockOffset);
+	}
+	size_t covered = (size_t) count * BLOCK_SIZE;
+	if(blockOffset + length < covered){
+		memset(blocks[start].data + blockOffset + length, 0, covered - blockOffset - length);
+	}
+}
+
+/*
+ * Marks file blocks [first, first + count) of unwritten extent k as written, ahead of a write of length bytes at
+ * blockOffset into the first of them, clearing what the write does not cover. The blocks join the written extent
+ * before them when they follow it on the image, so a preallocated file written in order stays in few extents.
+ * The caller looks the extent up again.
+*/
+int write_unwritten(Inode *inode, uint32_t k, uint32_t first, uint32_t count, off_t blockOffset, size_t length){
+	Extent *e = extent_at(inode, k);
+	uint32_t start = e->start + (first - e->logical);
+	Extent *previous = k > 0 ? extent_at(inode, k - 1) : NULL;
+	bool join = first == e->logical && previous != NULL && previous->packed == 0 &&
+				previous->logical + previous->length == first && previous->start + previous->length == start;
+	if(!join){
+		int err = reserve_extents(inode, remap_pieces(inode, k, first, count));
+		if(err < 0){
+			return err;
+		}
+	}
+	clear_around(start, count, blockOffset, length);
+	if(!join){
+		remap_extent(inode, k, first, count, start);
+		return 0;
+	}
+	previous->length += count;
+	if(count < e->length){
+		e->logical += count;
+		e->start += count;
+		e->length -= count;
+		return 0;
+	}
+	for(uint32_t j = k + 1; j < inode->extent_count; j++){
+		*extent_at(inode, j - 1) = *extent_at(inode, j);
+	}
+	inode->extent_count--;
+	if(inode->extent_count <= INODE_EXTENTS && inode->indirect != -1){
+		free_blocks(inode->indirect, 1);
+		inode->block_count--;
+		inode->indirect = -1;
+	}
+	return 0;
+}
+
+/*
+ * Maps up to wanted unmapped file blocks from blockIndex, stopping at the next extent, to one run of new blocks,
+ * growing the previous extent when it is of the same kind and the blocks right after it are free. pos is where the
+ * block would be inserted in the extent map. Returns the first block of the run and stores its length in allocated,
+ * the caller clears it, unless the run is unwritten and reads as zeros without.
+*/
+int map_run(Inode *inode, uint32_t pos, uint32_t blockIndex, uint32_t wanted, uint32_t *allocated, bool unwritten){
+	if(pos < inode->extent_count){
+		uint32_t gap = extent_at(inode, pos)->logical - blockIndex;
+		if(gap < wanted){
+			wanted = gap;
+		}
+	}
+
+	Extent *previous = pos > 0 ? extent_at(inode, pos - 1) : NULL;
+	uint32_t packed = unwritten ? EXTENT_UNWRITTEN : 0;
+	bool extend = previous != NULL && previous->packed == packed && previous->logical + previous->length == blockIndex;
+	int start = alloc_blocks(extend ? (int) (previous->start + previous->length) : -1, wanted, allocated);
+	if(start < 0){
+		return -ENOSPC;
+	}
+
+	if(extend && (uint32_t) start == previous->start + previous->length){
+		previous->length += *allocated;
+		inode->block_count += *allocated;
+		return start;
+	}
+	Extent extent = { .logical = blockIndex, .start = start, .length = *allocated, .packed = packed };
+	int err = insert_extent(inode, pos, extent);
+	if(err < 0){
+		free_blocks(start, *allocated);
+		return err;
+	}
+	inode->block_count += *allocated;
+	return start;
+}
+
+/*
+ * Gives file blocks [first, first + count) of extent k blocks of their own, copying what they hold,
+ * so they can be written without changing the files they are shared with.
+ * Copies fewer blocks when free space has no run that long, the caller looks the extent up again.
+*/
+int unshare_blocks(Inode *inode, uint32_t k, uint32_t first, uint32_t count){
+	uint32_t allocated;
+	int start = alloc_blocks(-1, count, &allocated);
+	if(start < 0){
+		return -ENOSPC;
+	}
+	int err = reserve_extents(inode, remap_pieces(inode, k, first, allocated));
+	if(err < 0){
+		release_blocks(start, allocated);
+		return err;
+	}
+	Extent *extent = extent_at(inode, k);
+	uint32_t old = extent->start + (first - extent->logical);
+	cache_touch(start, allocated, TOUCH_ACCESS);
+	memcpy(blocks[start].data, blocks[old].data, (size_t) allocated * BLOCK_SIZE);
+	remap_extent(inode, k, first, allocated, start);
+	free_blocks(old, allocated);
+	return 0;
+}
+
+/*
+ * Looks for a stored run with the same contents as a plain extent of inode i, and adds a reference to it.
+ * Returns its first block, or -1 if there is none. The caller holds the namespace lock for reading and
+ * the inode lock for writing, the inode holding a candidate is only checked when its lock is free.
+*/
+int find_duplicate(int i, const Extent *e, uint32_t crc){
+	Fingerprint bucket[DEDUP_WAYS];
+	pthread_mutex_lock(&dedup_lock);
+	memcpy(bucket, &fingerprints[(size_t) crc % DEDUP_BUCKETS * DEDUP_WAYS], sizeof(bucket));
+	pthread_mutex_unlock(&dedup_lock);
+
+	for(int w = 0; w < DEDUP_WAYS; w++){
+		Fingerprint *f = &bucket[w];
+		if(f->crc != crc || f->length != e->length || f->start == e->start || f->inode < 0 || f->inode >= MAX_INODES){
+			continue;
+		}
+		pthread_rwlock_t *lock = inode_lock(f->inode);
+		bool held = lock == inode_lock(i);
+		if(!held && pthread_rwlock_tryrdlock(lock) != 0){
+			continue;
+		}
+		// The run must still be where the index saw it, in a plain extent of a file
+		Inode *owner = &filesystem[f->inode];
+		int k = owner->is_active && !owner->is_dir && !owner->is_inline ? find_extent(owner, f->logical) : -1;
+		Extent *o = k >= 0 ? extent_at(owner, k) : NULL;
+		bool same = o != NULL && o->packed == 0 && o->start + (f->logical - o->logical) == f->start &&
+					f->logical + f->length <= o->logical + o->length &&
+					memcmp(blocks[f->start].data, blocks[e->start].data, (size_t) f->length * BLOCK_SIZE) == 0 &&
+					share_blocks(f->start, f->length);
+		if(!held){
+			pthread_rwlock_unlock(lock);
+		}
+		if(same){
+			return f->start;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Adds a plain extent of inode i to the fingerprint index, replacing an entry for the same place in the file
+*/
+void index_extent(int i, const Extent *e, uint32_t crc){
+	pthread_mutex_lock(&dedup_lock);
+	Fingerprint *bucket = &fingerprints[(size_t) crc % DEDUP_BUCKETS * DEDUP_WAYS];
+	int w = crc / DEDUP_BUCKETS % DEDUP_WAYS;
+	for(int v = 0; v < DEDUP_WAYS; v++){
+		if(bucket[v].length == 0 || (bucket[v].inode == i && bucket[v].logical == e->logical)){
+			w = v;
+			break;
+		}
+	}
+	bucket[w] = (Fingerprint) { crc, e->length, e->start, e->logical, i };
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+/*
+ * Shares the plain extents of inode i that overlap a range with stored runs of the same contents,
+ * freeing the blocks they had, and indexes the extents that found none.
+ * Extents are fingerprinted whole and as stored, after encryption, compressed clusters are left alone.
+ * The caller holds the namespace lock for reading and the inode lock for writing.
+*/
+void dedup_extents(int i, off_t from, off_t to){
+	Inode *inode = &filesystem[i];
+	if(inode->is_inline || inode->nlink == 0){
+		return;
+	}
+	uint32_t first = from / BLOCK_SIZE;
+	uint32_t end = (to + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int k = find_extent(inode, first);
+	bool changed = false;
+	for(k = k < 0 ? -k - 1 : k; k < (int) inode->extent_count; k++){
+		Extent *e = extent_at(inode, k);
+		if(e->logical >= end){
+			break;
+		}
+		if(e->packed != 0){
+			continue;
+		}
+		uint32_t crc = ~crc32c_kernel(~0u, blocks[e->start].data, (size_t) e->length * BLOCK_SIZE);
+		int start = find_duplicate(i, e, crc);
+		if(start >= 0){
+			free_blocks(e->start, e->length);
+			e->start = start;
+			changed = true;
+		} else {
+			index_extent(i, e, crc);
+		}
+	}
+	if(changed){
+		journal_inode(i);
+		journal_end();
+	}
+}
+
+/*
+ * Writes to a file
+*/
+int dm510fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	OP_SCOPE(OP_WRITE);
+	op_offset(offset);
+
+	// Use the open file handle, or look up the inode in the path index
+	int i = get_inode(path, fi);
+	// If inode is not found, return error code -ENOENT
+    if(i < 0){
+        return i;
+    }
+	if(filesystem[i].is_dir){
+		put_inode(fi);
+		return -EISDIR;
+	}
+	FileHandle *fh = get_handle(fi);
+	bool buffered = fh != NULL && size < options.writeback_size;
+	bool was_inline = false;
+	int res;
+	pthread_rwlock_wrlock(inode_lock(i));
+	// Small writes through a handle collect in its write-back buffer
+	if(buffered){
+		res = buffer_write(fh, buf, size, offset);
+	} else {
+		commit_inode(i);
+		was_inline = filesystem[i].is_inline;
+		res = write_data(&filesystem[i], buf, size, offset);
+	}
+	// Buffered writes count as modifications when they are made, not when they are committed
+	if(res > 0){
+		touch_inode(&filesystem[i]);
+	}
+	// Buffered data is journaled when it is committed
+	if(!buffered){
+		journal_write(i, offset, res, was_inline);
+	}
+	pthread_rwlock_unlock(inode_lock(i));
+	put_inode(fi);
+	note_access(fh, offset, res);
+	note_write(fh, offset, res);
+	op_bytes(res);
+	return res;
+}
+
+/*
+ * Writes to the extents of an inode, the caller holds the inode lock for writing
+*/
+int write_data(Inode *inode, const char *buf, size_t size, off_t offset){
+	return write_extents(inode, size, offset, copy_from_memory, &buf);
+}
+
+/*
+ * Copies the next part of a write from a memory buffer into an extent, encrypting it on the way
+*/
+ssize_t copy_from_memory(char *data, size_t length, void *source){
+	const char **buf = source;
+
+	encryptCaesarCypher(data, *buf, length);
+	*buf += length;
+	return length;
+}
+
+/*
+ * Writes to the contents of an inline file, the write fits in the inode
+*/
+int write_inline(Inode *inode, size_t size, off_t offset, ssize_t (*copy)(char *, size_t, void *), void *source){
+	ssize_t copied = size > 0 ? copy(inode->inline_data + offset, size, source) : 0;
+	if(copied < 0){
+		return copied;
+	}
+	if(offset + copied > inode->size){
+		inode->size = offset + copied;
+	}
+	return copied;
+}
+
+/*
+ * Moves the contents of an inline file out to a block, when a write will not fit in the inode
+*/
+int promote_inline(Inode *inode){
+	char data[INLINE_DATA_SIZE];
+	const char *source = data;
+	size_t length = inode->size < INLINE_DATA_SIZE ? inode->size : INLINE_DATA_SIZE;
+	memcpy(data, inode->inline_data, sizeof(data));
+
+	inode->is_inline = false;
+	if(length == 0){
+		return 0;
+	}
+	int res = write_extents(inode, length, 0, copy_encrypted, &source);
+	if(res < 0){
+		// Nothing was mapped, the file stays inline
+		inode->is_inline = true;
+		memcpy(inode->inline_data, data, sizeof(data));
+		return res;
+	}
+	return 0;
+}
+
+/*
+ * Moves the contents of a file shrunk to an inline size back into the inode and frees its blocks
+*/
+void demote_to_inline(Inode *inode, off_t size){
+	char data[INLINE_DATA_SIZE] = { 0 };
+	int k = find_extent(inode, 0);
+	if(k >= 0 && is_cluster(extent_at(inode, k))){
+		char plain[CLUSTER_SIZE];
+		if(load_cluster(extent_at(inode, k), plain) == 0){
+			encryptCaesarCypher(data, plain, size);
+		}
+	} else if(k >= 0 && extent_at(inode, k)->packed == 0){
+		memcpy(data, blocks[extent_at(inode, k)->start].data, size);
+	}
+	trim_extents(inode, 0);
+	inode->is_inline = true;
+	memcpy(inode->inline_data, data, sizeof(data));
+}
+
+/*
+ * Copies data that is already encrypted, used when file contents move between the inode and its blocks
+*/
+ssize_t copy_encrypted(char *data, size_t length, void *source){
+	const char **buf = source;
+
+	memcpy(data, *buf, length);
+	*buf += length;
+	return length;
+}
+
+/*
+ * Walks the extents covering a write, mapping new extents where the file has none.
+ * copy fills each piece of extent memory in turn and returns how much it copied,
+ * so the data can come from memory or straight from a FUSE buffer.
+*/
+int write_extents(Inode *inode, size_t size, off_t offset, ssize_t (*copy)(char *, size_t, void *), void *source){
+	if(offset + (off_t) size > MAX_FILE_SIZE){
+		return -EFBIG;
+	}
+	// Small files are written in the inode until a write no longer fits there
+	if(inode->is_inline){
+		if(offset + size <= INLINE_DATA_SIZE){
+			return write_inline(inode, size, offset, copy, source);
+		}
+		int err = promote_inline(inode);
+		if(err < 0){
+			return err;
+		}
+	}
+	return write_runs(inode, size, offset, copy, source, options.compress);
+}
+
+/*
+ * Writes to the extents of a file that is not inline. Compressed clusters are always written compressed,
+ * unmapped clusters only when compress is set, everything else is written to plain blocks.
+*/
+int write_runs(Inode *inode, size_t size, off_t offset, ssize_t (*copy)(char *, size_t, void *), void *source, bool compress){
+	// Number of bytes left to write
+    size_t bytesLeft = size; 
+	int err = 0;
+
+	// Write loop copying one extent at a time
+    while (bytesLeft > 0){
+		uint32_t blockIndex = offset / BLOCK_SIZE;
+		off_t blockOffset = offset % BLOCK_SIZE;
+
+		int k = find_extent(inode, blockIndex);
+		if(k >= 0 ? is_cluster(extent_at(inode, k)) : compress && inode->extent_count < CLUSTER_EXTENTS && cluster_is_unmapped(inode, -k - 1, blockIndex)){
+			ssize_t copied = write_cluster(inode, k, offset, bytesLeft, copy, source);
+			if(copied <= 0){
+				err = copied < 0 ? copied : -EIO;
+				break;
+			}
+			offset += copied;
+			bytesLeft -= copied;
+			continue;
+		}
+        if(k < 0){
+			err = map_blocks(inode, -k - 1, blockIndex, blockOffset, bytesLeft);
+			if(err < 0){
+				break;
+			}
+			continue;
+        }
+		Extent *extent = extent_at(inode, k);
+
+		// Write up to the end of the extent
+		size_t extentLeft = (size_t) (extent->logical + extent->length - blockIndex) * BLOCK_SIZE - blockOffset;
+        size_t blockWrite = bytesLeft < extentLeft ? bytesLeft : extentLeft;
+
+		// Preallocated blocks are cleared around what is written to them the first time
+		uint32_t touched = (blockOffset + blockWrite + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if(extent->packed == EXTENT_UNWRITTEN){
+			err = write_unwritten(inode, k, blockIndex, touched, blockOffset, blockWrite);
+			if(err < 0){
+				break;
+			}
+			continue;
+		}
+		// Blocks shared with other files are copied before they are written
+		if(blocks_shared(extent->start + (blockIndex - extent->logical), touched)){
+			err = unshare_blocks(inode, k, blockIndex, touched);
+			if(err < 0){
+				break;
+			}
+			continue;
+		}
+		cache_touch(extent->start + (blockIndex - extent->logical), touched, TOUCH_ACCESS);
+		char *data = blocks[extent->start + (blockIndex - extent->logical)].data + blockOffset;
+
+		ssize_t copied = copy(data, blockWrite, source);
+		if(copied <= 0){
+			err = copied < 0 ? copied : -EIO;
+			break;
+		}
+
+		// Update counters
+        offset += copied;
+        bytesLeft -= copied;
+		if((size_t) copied < blockWrite){
+			break;
+		}
+    }
+	// Grow the file if the write went past its end, a write that stored nothing leaves it as it was
+	if(bytesLeft < size && offset > inode->size){
+		inode->size = offset;
+	}
+	// Return error if nothing has been written, otherwise return the amount written
+	if(bytesLeft == size && err < 0){
+		return err;
+	}
+    return size-bytesLeft;
+}
+
+/*
+ * Whether nothing in the cluster holding a file block is mapped, pos is where the block would be inserted in the extent map
+*/
+bool cluster_is_unmapped(Inode *inode, uint32_t pos, uint32_t blockIndex){
+	uint32_t first = blockIndex / CLUSTER_BLOCKS * CLUSTER_BLOCKS;
+	if(pos > 0){
+		Extent *previous = extent_at(inode, pos - 1);
+		if(previous->logical + previous->length > first){
+			return false;
+		}
+	}
+	return pos >= inode->extent_count || extent_at(inode, pos)->logical >= first + CLUSTER_BLOCKS;
+}
+
+/*
+ * Decompresses a compressed cluster into CLUSTER_SIZE bytes of plain text, zero past the data it holds
+*/
+int load_cluster(const Extent *e, char *plain){
+	char packed[CLUSTER_SIZE];
+	const char *data = blocks[e->start].data;
+	if(shift != 0 && e->packed <= CLUSTER_SIZE){
+		decryptCaesarCypher(packed, data, e->packed);
+		data = packed;
+	}
+	ssize_t length = e->packed <= CLUSTER_SIZE ? codec_decompress(data, e->packed, plain, CLUSTER_SIZE) : -1;
+	if(length < 0){
+		return -EIO;
+	}
+	memset(plain + length, 0, CLUSTER_SIZE - length);
+	return 0;
+}
+
+/*
+ * Encrypts compressed data into the blocks of a cluster, clearing the rest of its last block.
+ * The caller journals the cluster, journal_data takes compressed clusters whole.
+*/
+void put_cluster(const Extent *e, const char *packed){
+	cache_touch(e->start, extent_blocks(e), TOUCH_ACCESS);
+	char *data = blocks[e->start].data;
+	encryptCaesarCypher(data, packed, e->packed);
+	memset(data + e->packed, 0, (size_t) extent_blocks(e) * BLOCK_SIZE - e->packed);
+}
+
+/*
+ * Stores the plain text of the cluster starting at file block first, used bytes of it, replacing the compressed
+ * extent at position k, or inserting it at -k - 1 when the cluster is not mapped.
+ * The cluster is compressed when that saves at least a block, and written to plain blocks otherwise.
+*/
+int store_cluster(Inode *inode, int k, uint32_t first, const char *plain, size_t used){
+	char packed[CLUSTER_SIZE];
+	uint32_t plain_blocks = blocks_needed(used);
+	size_t length = plain_blocks > 1 ? codec_compress(plain, used, packed, (size_t) (plain_blocks - 1) * BLOCK_SIZE) : 0;
+	uint32_t count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	Extent *e = k >= 0 ? extent_at(inode, k) : NULL;
+
+	// Rewritten where it was when it still fits, the blocks it no longer needs are freed
+	if(length > 0 && e != NULL && count <= extent_blocks(e)){
+		uint32_t held = extent_blocks(e);
+		count_cluster(e, -1);
+		if(count < held){
+			free_blocks(e->start + count, held - count);
+			inode->block_count -= held - count;
+		}
+		e->packed = length;
+		count_cluster(e, 1);
+		put_cluster(e, packed);
+		return 0;
+	}
+	if(length > 0){
+		uint32_t allocated;
+		int start = alloc_blocks(-1, count, &allocated);
+		if(start >= 0 && allocated == count){
+			Extent cluster = { first, start, CLUSTER_BLOCKS, length };
+			if(e != NULL){
+				count_cluster(e, -1);
+				free_blocks(e->start, extent_blocks(e));
+				inode->block_count -= extent_blocks(e);
+				*e = cluster;
+			} else {
+				int err = insert_extent(inode, -k - 1, cluster);
+				if(err < 0){
+					free_blocks(start, count);
+					return err;
+				}
+			}
+			inode->block_count += count;
+			count_cluster(&cluster, 1);
+			put_cluster(&cluster, packed);
+			return 0;
+		}
+		// No run of blocks is long enough, the cluster is stored plain across whatever is free
+		if(start >= 0){
+			free_blocks(start, allocated);
+		}
+	}
+
+	if(e != NULL){
+		remove_extent(inode, k);
+	}
+	const char *source = plain;
+	off_t offset = (off_t) first * BLOCK_SIZE;
+	int res = write_runs(inode, used, offset, copy_from_memory, &source, false);
+	if(res < 0){
+		return res;
+	}
+	// The caller only journals the range it changed, the rest of the cluster moved as well
+	journal_data(inode, offset, res);
+	return (size_t) res < used ? -ENOSPC : 0;
+}
+
+/*
+ * Writes the part of a write that falls in one cluster, compressed.
+ * k is the position of the compressed extent of the cluster, or -(insert position) - 1 when it is not mapped.
+ * Returns the bytes written, or an error.
+*/
+ssize_t write_cluster(Inode *inode, int k, off_t offset, size_t size, ssize_t (*copy)(char *, size_t, void *), void *source){
+	char plain[CLUSTER_SIZE];
+	uint32_t first = offset / CLUSTER_SIZE * CLUSTER_BLOCKS;
+	off_t cluster_at = (off_t) first * BLOCK_SIZE;
+	size_t at = offset - cluster_at;
+	size_t length = size < CLUSTER_SIZE - at ? size : CLUSTER_SIZE - at;
+
+	if(k >= 0){
+		int err = load_cluster(extent_at(inode, k), plain);
+		if(err < 0){
+			return err;
+		}
+	} else {
+		memset(plain, 0, CLUSTER_SIZE);
+	}
+	// The copy encrypts what it writes, the cluster is compressed as plain text and encrypted afterwards
+	ssize_t copied = copy(plain + at, length, source);
+	if(copied <= 0){
+		return copied < 0 ? copied : -EIO;
+	}
+	decryptCaesarCypher(plain + at, plain + at, copied);
+
+	off_t end = offset + copied > inode->size ? offset + copied : inode->size;
+	size_t used = end - cluster_at < CLUSTER_SIZE ? (size_t) (end - cluster_at) : CLUSTER_SIZE;
+	int err = store_cluster(inode, k, first, plain, used);
+	return err < 0 ? err : copied;
+}
+
+/*
+ * Reads into a FUSE buffer vector.
+ * The data is not lent out from the image: libfuse sends the reply after this returns, when the inode lock is no
+ * longer held, and by then a truncate, punch or unlink may have freed the blocks and another file been given them.
+ * The low-level read replies from the image while it holds the lock instead.
+ * The read is decrypted straight into one buffer allocated here, the same single pass as dm510fs_read.
+*/
+int dm510fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi){
+	OP_SCOPE(OP_READ);
+	op_offset(offset);
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+	char *mem = malloc(size > 0 ? size : 1);
+	if(bufv == NULL || mem == NULL){
+		free(bufv);
+		free(mem);
+		return -ENOMEM;
+	}
+
+	int res = dm510fs_read(path, mem, size, offset, fi);
+	if(res < 0){
+		free(bufv);
+		free(mem);
+		return res;
+	}
+	*bufv = FUSE_BUFVEC_INIT(res);
+	bufv->buf[0].mem = mem;
+	*bufp = bufv;
+	return 0;
+}
+
+/*
+ * Copies the next part of a write from a FUSE buffer vector into an extent and encrypts it there.
+ * When the request sits in a pipe this reads it straight into the extent.
+*/
+ssize_t copy_from_bufvec(char *data, size_t length, void *source){
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(length);
+	dst.buf[0].mem = data;
+
+	ssize_t copied = fuse_buf_copy(&dst, source, FUSE_BUF_SPLICE_NONBLOCK);
+	if(copied > 0){
+		encryptCaesarCypher(data, data, copied);
+	}
+	return copied;
+}
+
+/*
+ * Writes from a FUSE buffer vector.
+ * Data already in memory takes the fused copy and encrypt path of dm510fs_write.
+ * Data in a pipe (when the kernel splices write requests) is copied straight into the extents,
+ * skipping the buffer libfuse would otherwise read it into first.
+*/
+int dm510fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi){
+	OP_SCOPE(OP_WRITE);
+	op_offset(offset);
+	if(buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)){
+		return dm510fs_write(path, (const char *) buf->buf[0].mem + buf->off, buf->buf[0].size - buf->off, offset, fi);
+	}
+	int i = get_inode(path, fi);
+    if(i < 0){
+        return i;
+    }
+	if(filesystem[i].is_dir){
+		put_inode(fi);
+		return -EISDIR;
+	}
+	pthread_rwlock_wrlock(inode_lock(i));
+	commit_inode(i);
+	bool was_inline = filesystem[i].is_inline;
+	int res = write_extents(&filesystem[i], fuse_buf_size(buf), offset, copy_from_bufvec, buf);
+	if(res > 0){
+		touch_inode(&filesystem[i]);
+	}
+	journal_write(i, offset, res, was_inline);
+	pthread_rwlock_unlock(inode_lock(i));
+	put_inode(fi);
+	note_access(get_handle(fi), offset, res);
+	note_write(get_handle(fi), offset, res);
+	op_bytes(res);
+	return res;
+}
+
+/*
+ * Unlinks an inode from its directory, the caller holds the namespace write lock.
+ * The inode is freed once nothing refers to it any more.
+*/
+void drop_entry(int i){
+	int around[] = { filesystem[i].parent, filesystem[i].prev_sibling, filesystem[i].next_sibling };
+	index_remove(i);
+	dir_remove_child(i);
+	journal_entries(around, 3);
+	release_name(filesystem[i].name_offset, filesystem[i].name_length);
+	// Attributes are read under the inode lock alone by operations on inode numbers
+	pthread_rwlock_wrlock(inode_lock(i));
+	filesystem[i].nlink = 0;
+	change_inode(&filesystem[i]);
+	pthread_rwlock_unlock(inode_lock(i));
+	// Return the blocks of the file to the free pool, unless it is still open or known to the kernel.
+	// Those are listed in the image, so they are freed at the next mount if they outlive this one.
+	if(is_orphan(i)){
+		free_inode(i);
+	} else {
+		filesystem[i].hash_next = super->orphans;
+		super->orphans = i;
+	}
+	journal_entry(i);
+}
+
+/*
+ * Removes the entry of a name in a directory, the caller holds the namespace write lock
+*/
+int remove_entry(int parent, const char *name, bool is_dir){
+	int v = lookup_virtual(parent, name);
+	if(v != -1){
+		return v < 0 ? v : -EACCES;
+	}
+	int i = lookup_child(parent, name, strlen(name));
+	if(i == -1){
+		return -ENOENT;
+	}
+	if(filesystem[i].is_dir != is_dir){
+		return is_dir ? -ENOTDIR : -EISDIR;
+	}
+	// Checks if there is anything in the directory
+	if(is_dir && filesystem[i].child_count > 0){
+		return -ENOTEMPTY;
+	}
+	op_inode(i);
+	drop_entry(i);
+	journal_end();
+	return 0;
+}
+
+/*
+ * Removes the entry of a path
+*/
+int remove_path(const char *path, bool is_dir){
+	const char *name;
+	int v = lookup_virtual_path(path);
+	if(v != -1){
+		return v < 0 ? v : -EACCES;
+	}
+
+	// No other operation can be using the inode while the namespace is locked for writing
+	pthread_rwlock_wrlock(&namespace_lock);
+	int parent = lookup_parent(path, &name);
+	int res = parent != -1 ? remove_entry(parent, name, is_dir) : -ENOENT;
+	pthread_rwlock_unlock(&namespace_lock);
+	return res;
+}
+
+/*
+ * Deletes a file
+*/
+int dm510fs_unlink(const char *path){
+	OP_SCOPE(OP_UNLINK);
+	int res = remove_path(path, false);
+	if(res == -ENOENT){
+		TRACE(TRACE_DEBUG, "unlink: path not found", 0, 0, 0);
+	}
+	return res;
+}
+
+/*
+ * Deletes a directory
+*/
+int dm510fs_rmdir(const char *path){
+	OP_SCOPE(OP_RMDIR);
+
+	// The root has no parent to be removed from
+	if(strcmp(path, "/") == 0){
+		return -EBUSY;
+	}
+	int res = remove_path(path, true);
+	if(res == -ENOTEMPTY){
+		TRACE(TRACE_DEBUG, "rmdir: directory not empty", 0, 0, 0);
+	} else if(res == -ENOENT){
+		TRACE(TRACE_DEBUG, "rmdir: directory not found", 0, 0, 0);
+	}
+	return res;
+}
+
+/*
+ * Whether an inode is dir or one of the directories above it
+*/
+bool is_ancestor(int i, int dir){
+	for(; dir != -1; dir = filesystem[dir].parent){
+		if(dir == i){
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Relinks an entry under a directory with a name already stored in the arena, the caller holds the namespace write lock
+*/
+void move_entry(int i, int parent, uint32_t name_offset, uint16_t name_length){
+	int around[] = { filesystem[i].parent, filesystem[i].prev_sibling, filesystem[i].next_sibling };
+	index_remove(i);
+	dir_remove_child(i);
+	journal_entries(around, 3);
+	filesystem[i].name_offset = name_offset;
+	filesystem[i].name_length = name_length;
+	dir_add_child(parent, i);
+	index_insert(i);
+	pthread_rwlock_wrlock(inode_lock(i));
+	change_inode(&filesystem[i]);
+	pthread_rwlock_unlock(inode_lock(i));
+	journal_links(i);
+}
+
+/*
+ * Moves the entry of a name in a directory to a new directory and name, the caller holds the namespace write lock.
+ * Paths are not stored, so only the entry itself is relinked and a directory takes its whole subtree along in constant time.
+ * An existing file or empty directory at the new name is replaced, unless flags has RENAME_NOREPLACE.
+ * RENAME_EXCHANGE swaps two existing entries instead.
+*/
+int rename_entry(int parent, const char *name, int new_parent, const char *new_name, unsigned int flags){
+	if((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) || flags == (RENAME_NOREPLACE | RENAME_EXCHANGE)){
+		return -EINVAL;
+	}
+	if(lookup_virtual(parent, name) != -1 || lookup_virtual(new_parent, new_name) != -1){
+		return -EACCES;
+	}
+	int i = lookup_child(parent, name, strlen(name));
+	if(i == -1){
+		return -ENOENT;
+	}
+	if(filesystem[new_parent].is_dir == false){
+		return -ENOTDIR;
+	}
+	if(filesystem[new_parent].nlink == 0){
+		return -ENOENT;
+	}
+	size_t length = strlen(new_name);
+	if(length >= MAX_NAME_LENGTH){
+		return -ENAMETOOLONG;
+	}
+	// A directory cannot be moved into its own subtree, it would be cut off from the root
+	if(length == 0 || is_ancestor(i, new_parent)){
+		return -EINVAL;
+	}
+	int target = lookup_child(new_parent, new_name, length);
+
+	if(flags & RENAME_EXCHANGE){
+		if(target == -1){
+			return -ENOENT;
+		}
+		if(is_ancestor(target, parent)){
+			return -EINVAL;
+		}
+		// Both names are in the arena already, they only change hands
+		if(target != i){
+			uint32_t offset = filesystem[i].name_offset;
+			uint16_t old_length = filesystem[i].name_length;
+			move_entry(i, new_parent, filesystem[target].name_offset, filesystem[target].name_length);
+			move_entry(target, parent, offset, old_length);
+			journal_end();
+		}
+		return 0;
+	}
+	if(target != -1){
+		if(flags & RENAME_NOREPLACE){
+			return -EEXIST;
+		}
+		// Renaming an entry onto itself does nothing
+		if(target == i){
+			return 0;
+		}
+		if(filesystem[i].is_dir && !filesystem[target].is_dir){
+			return -ENOTDIR;
+		}
+		if(!filesystem[i].is_dir && filesystem[target].is_dir){
+			return -EISDIR;
+		}
+		if(filesystem[target].child_count > 0){
+			return -ENOTEMPTY;
+		}
+	}
+
+	// Stored first, so nothing has changed yet if the arena cannot grow
+	uint32_t offset;
+	int res = store_name(new_name, length, &offset);
+	if(res < 0){
+		return res;
+	}
+	if(target != -1){
+		drop_entry(target);
+	}
+	release_name(filesystem[i].name_offset, filesystem[i].name_length);
+	move_entry(i, new_parent, offset, length);
+	journal_end();
+	return 0;
+}
+
+/*
+ * Renames a file or directory, replacing what is at the new path.
+ * The FUSE 2 rename has no flags, RENAME_NOREPLACE and RENAME_EXCHANGE are only reachable through rename_entry.
+*/
+int dm510fs_rename(const char *path, const char *new_path){
+	OP_SCOPE(OP_RENAME);
+	const char *name;
+	const char *new_name;
+	if(lookup_virtual_path(path) != -1 || lookup_virtual_path(new_path) != -1){
+		return -EACCES;
+	}
+
+	pthread_rwlock_wrlock(&namespace_lock);
+	int parent = lookup_parent(path, &name);
+	int new_parent = lookup_parent(new_path, &new_name);
+	int res = parent != -1 && new_parent != -1 ? rename_entry(parent, name, new_parent, new_name, 0) : -ENOENT;
+	pthread_rwlock_unlock(&namespace_lock);
+	return res;
+}
+
+/*
+ * Resizes file
+*/
+int dm510fs_truncate(const char *path, off_t size){
+	OP_SCOPE(OP_SETATTR);
+	return dm510fs_ftruncate(path, size, NULL);
+}
+
+/*
+ * Resizes an open file, or the file of the path when there is no file handle
+*/
+int dm510fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi){
+	OP_SCOPE(OP_SETATTR);
+	if(virtual_entry(path, fi) != -1){
+		return -EACCES;
+	}
+	// Use the open file handle, or look up the inode in the path index
+	int i = get_inode(path, fi);
+	// If inode is not found, return error code -ENOENT
+    if(i < 0){
+        return i;
+    }
+	int res = truncate_inode(i, size);
+	put_inode(fi);
+	return res;
+}
+
+/*
+ * Resizes an inode the caller keeps alive
+*/
+int truncate_inode(int i, off_t size){
+	op_inode(i);
+	op_offset(size);
+	if(filesystem[i].is_dir){
+		return -EISDIR;
+	}
+	pthread_rwlock_wrlock(inode_lock(i));
+	commit_inode(i);
+	bool was_inline = filesystem[i].is_inline;
+	int res = truncate_data(&filesystem[i], size);
+	if(res == 0){
+		touch_inode(&filesystem[i]);
+	}
+	// The block holding the new end had its tail cleared, or an inline file grew out to its first block
+	journal_inode(i);
+	journal_data(&filesystem[i], was_inline ? 0 : size, 1);
+	journal_end();
+	pthread_rwlock_unlock(inode_lock(i));
+	return res;
+}
+
+/*
+ * Allocates space for a range of a file, or punches a hole in it with FALLOC_FL_PUNCH_HOLE
+*/
+int dm510fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi){
+	OP_SCOPE(OP_FALLOCATE);
+	if(virtual_entry(path, fi) != -1){
+		return -EACCES;
+	}
+	// Use the open file handle, or look up the inode in the path index
+	int i = get_inode(path, fi);
+	// If inode is not found, return error code -ENOENT
+    if(i < 0){
+        return i;
+    }
+	int res = fallocate_inode(i, mode, offset, length);
+	put_inode(fi);
+	return res;
+}
+
+/*
+ * Allocates or punches a range of an inode the caller keeps alive.
+ * A hole can only be punched keeping the size, as in other filesystems, and no other modes are supported.
+*/
+int fallocate_inode(int i, int mode, off_t offset, off_t length){
+	op_inode(i);
+	op_offset(offset);
+	if(filesystem[i].is_dir){
+		return -EISDIR;
+	}
+	if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0 || mode == FALLOC_FL_PUNCH_HOLE){
+		return -EOPNOTSUPP;
+	}
+	if(offset < 0 || length <= 0){
+		return -EINVAL;
+	}
+	if(offset > MAX_FILE_SIZE - length){
+		return -EFBIG;
+	}
+	pthread_rwlock_wrlock(inode_lock(i));
+	commit_inode(i);
+	Inode *inode = &filesystem[i];
+	bool was_inline = inode->is_inline;
+	off_t old_size = inode->size;
+	int res;
+	if(mode & FALLOC_FL_PUNCH_HOLE){
+		res = punch_hole(inode, offset, offset + length);
+		if(res == 0){
+			touch_inode(inode);
+		}
+	} else {
+		res = preallocate(inode, offset, offset + length);
+		if(res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + length > inode->size){
+			inode->size = offset + length;
+		}
+		if(inode->size != old_size){
+			change_inode(inode);
+		}
+	}
+	journal_inode(i);
+	if(was_inline && !inode->is_inline){
+		journal_data(inode, 0, 1);
+	}
+	// Blocks cleared by a punch, the blocks preallocated are unwritten and only change the inode
+	if(mode & FALLOC_FL_PUNCH_HOLE){
+		journal_data(inode, offset, (old_size < offset + length ? old_size : offset + length) - offset);
+	}
+	journal_end();
+	pthread_rwlock_unlock(inode_lock(i));
+	return res;
+}
+
+/*
+ * Makes [offset, end) of a file read as zeros, unmapping the blocks it covers whole so they no longer take space.
+ * The caller holds the inode lock for writing.
+*/
+int punch_hole(Inode *inode, off_t offset, off_t end){
+	// Past the end of the file there is nothing to clear, only blocks preallocated there to free
+	off_t clear = end < inode->size ? end : inode->size;
+	if(inode->is_inline){
+		if(clear > offset){
+			memset(inode->inline_data + offset, 0, clear - offset);
+		}
+		return 0;
+	}
+	// The block holding the end of the file is zero past it, so a range going past the end covers it whole
+	uint32_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t last = end / BLOCK_SIZE;
+	if(end >= inode->size && (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE > last){
+		last = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+	if(first < last){
+		int err = punch_extents(inode, first, last);
+		if(err < 0){
+			return err;
+		}
+	}
+
+	// What is still mapped in the range is a partly covered block or compressed cluster, and is written with zeros
+	// unless it is unwritten and reads as zeros already
+	while(offset < clear){
+		uint32_t blockIndex = offset / BLOCK_SIZE;
+		int k = find_extent(inode, blockIndex);
+		if(k < 0){
+			if((uint32_t) (-k - 1) >= inode->extent_count){
+				break;
+			}
+			offset = (off_t) extent_at(inode, -k - 1)->logical * BLOCK_SIZE;
+			continue;
+		}
+		Extent *extent = extent_at(inode, k);
+		off_t extentEnd = (off_t) (extent->logical + extent->length) * BLOCK_SIZE;
+		size_t length = (extentEnd < clear ? extentEnd : clear) - offset;
+		int res = extent->packed == EXTENT_UNWRITTEN ? 0 : write_runs(inode, length, offset, copy_zeros, NULL, false);
+		if(res < 0){
+			return res;
+		}
+		offset += length;
+	}
+	return 0;
+}
+
+/*
+ * Copies zeros into an extent, which encrypt to zeros
+*/
+ssize_t copy_zeros(char *data, size_t length, void *source){
+	(void) source;
+	memset(data, 0, length);
+	return length;
+}
+
+/*
+ * Maps blocks for the unmapped parts of [offset, end) of a file, in runs as long as free space allows.
+ * The runs are unwritten: they read as zeros and are only cleared where they are first written, so only the inode
+ * changes and the caller journals it. The caller holds the inode lock for writing and sets the size.
+*/
+int preallocate(Inode *inode, off_t offset, off_t end){
+	// The range fits in the inode, where space is always there
+	if(inode->is_inline){
+		if(end <= INLINE_DATA_SIZE){
+			return 0;
+		}
+		int err = promote_inline(inode);
+		if(err < 0){
+			return err;
+		}
+	}
+	uint32_t blockIndex = offset / BLOCK_SIZE;
+	uint32_t last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	while(blockIndex < last){
+		int k = find_extent(inode, blockIndex);
+		if(k >= 0){
+			Extent *extent = extent_at(inode, k);
+			blockIndex = extent->logical + extent->length;
+			continue;
+		}
+		uint32_t allocated;
+		int start = map_run(inode, -k - 1, blockIndex, last - blockIndex, &allocated, true);
+		if(start < 0){
+			return start;
+		}
+		blockIndex += allocated;
+	}
+	return 0;
+}
+
+/*
+ * Resizes the extents of an inode, the caller holds the inode lock for writing
+*/
+int truncate_data(Inode *inode, off_t size){
+	if(size > MAX_FILE_SIZE){
+		return -EFBIG;
+	}
+	// Growing a file only moves its end, everything past the old end is a hole or a block kept clear
+	if(size >= inode->size){
+		if(inode->is_inline && size > INLINE_DATA_SIZE){
+			int err = promote_inline(inode);
+			if(err < 0){
+				return err;
+			}
+		}
+		inode->size = size;
+		return 0;
+	}
+	// Inline files keep zeros past their size, and small enough files move back into the inode
+	if(inode->is_inline){
+		if(size < INLINE_DATA_SIZE){
+			memset(inode->inline_data + size, 0, INLINE_DATA_SIZE - size);
+		}
+		inode->size = size;
+		return 0;
+	}
+	if(size <= INLINE_DATA_SIZE){
+		demote_to_inline(inode, size);
+		inode->size = size;
+		return 0;
+	}
+
+	// The block holding the new end gets its tail cleared below, so it stops being shared first
+	off_t tail = size % BLOCK_SIZE;
+	int k = find_extent(inode, size / BLOCK_SIZE);
+	if(tail != 0 && k >= 0 && extent_at(inode, k)->packed == 0 &&
+	   blocks_shared(extent_at(inode, k)->start + (size / BLOCK_SIZE - extent_at(inode, k)->logical), 1)){
+		int err = unshare_blocks(inode, k, size / BLOCK_SIZE, 1);
+		if(err < 0){
+			return err;
+		}
+	}
+
+	// Free blocks that are beyond the required size
+	uint32_t remainingBlocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	trim_extents(inode, remainingBlocks);
+
+	// A compressed cluster holding the new end is stored again without what lies past it
+	int last = find_extent(inode, (size - 1) / BLOCK_SIZE);
+	if(last >= 0 && is_cluster(extent_at(inode, last))){
+		Extent *extent = extent_at(inode, last);
+		size_t used = size - (off_t) extent->logical * BLOCK_SIZE;
+		int err = 0;
+		if(used < CLUSTER_SIZE){
+			char plain[CLUSTER_SIZE];
+			err = load_cluster(extent, plain);
+			if(err == 0){
+				memset(plain + used, 0, CLUSTER_SIZE - used);
+				err = store_cluster(inode, last, extent->logical, plain, used);
+			}
+		}
+		inode->size = size;
+		return err;
+	}
+
+	// Clear the tail of the last block so a later write past the end reads back zeros
+	if(tail != 0){
+		k = find_extent(inode, size / BLOCK_SIZE);
+		if(k >= 0 && extent_at(inode, k)->packed == 0){
+			Extent *extent = extent_at(inode, k);
+			memset(blocks[extent->start + (size / BLOCK_SIZE - extent->logical)].data + tail, 0, BLOCK_SIZE - tail);
+		}
+	}
+	inode->size = size;
+
+    return 0; 
+}
+
+/*
+ * Reports filesystem statistics, all counts are kept up to date so this is constant time
+*/
+int dm510fs_statfs(const char *path, struct statvfs *stbuf){
+	OP_SCOPE(OP_STATFS);
+	(void) path;
+
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = BLOCKS_COUNT;
+	pthread_mutex_lock(&alloc_lock);
+	stbuf->f_bfree = super->free_block_count;
+	stbuf->f_bavail = super->free_block_count;
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_rwlock_rdlock(&namespace_lock);
+	stbuf->f_files = MAX_INODES;
+	stbuf->f_ffree = MAX_INODES - super->used_inodes;
+	stbuf->f_favail = MAX_INODES - super->used_inodes;
+	pthread_rwlock_unlock(&namespace_lock);
+	stbuf->f_namemax = MAX_NAME_LENGTH - 1;
+	return 0;
+}
+
+/*
+ * Function to save the file system state to a file.
+ * The filesystem already lives in the mapped image, so this stops the commit thread and checkpoints the image,
+ * writing back what the kernel has not yet written and emptying the journal, then marks the image clean.
+ * The flag is written last, so it is never on disk ahead of the data.
+*/
+int saveFileSystem(const char *filename) {
+	(void) filename;
+	int res;
+
+	stop_journal();
+	if ((res = checkpoint_now()) < 0) {
+		perror("Error writing file system state\n");
+	} else {
+		// Names freed by the last commit are listed before the image is marked clean
+		reuse_freed_names();
+		if (msync(image, image_size, MS_SYNC) < 0) {
+			res = -EIO;
+		} else {
+			super->clean = 1;
+			msync(image, sizeof(Superblock), MS_SYNC);
+		}
+	}
+	close_journal();
+	munmap(image, image_size);
+	close(image_fd);
+	munmap(inode_state, (size_t) MAX_INODES * sizeof(InodeState));
+	return res;
+}
+
+/*
+ * Sets up an empty filesystem in a new image, holding only the root directory
+*/
+void format_image() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(super->magic, IMAGE_MAGIC, sizeof(super->magic));
+	super->version = IMAGE_VERSION;
+	super->image_id = ((uint64_t) now.tv_sec << 32) ^ (uint64_t) now.tv_nsec ^ ((uint64_t) getpid() << 16);
+	super->block_size = BLOCK_SIZE;
+	super->blocks_count = BLOCKS_COUNT;
+	super->max_inodes = MAX_INODES;
+	super->inode_size = sizeof(Inode);
+	super->inline_data_size = INLINE_DATA_SIZE;
+	super->cluster_blocks = CLUSTER_BLOCKS;
+	super->name_arena_size = NAME_ARENA_SIZE;
+	super->free_inodes = -1;
+	super->orphans = -1;
+	super->next_dir_cookie = 3;
+	for (uint32_t c = 0; c < NAME_CLASSES; c++) {
+		super->free_names[c] = NO_NAME;
+	}
+	super->index_buckets = NAME_INDEX_MIN_BUCKETS;
+	for (unsigned int b = 0; b < super->index_buckets; b++) {
+		name_index[b] = -1;
+	}
+	reset_block_map();
+
+	// Add root inode, its name is empty
+	store_name("", 0, &filesystem[0].name_offset);
+	super->inode_count = 1;
+	super->used_inodes = 1;
+	filesystem[0].is_active = true;
+	filesystem[0].is_dir = true;
+	filesystem[0].mode = S_IFDIR | 0755;
+	filesystem[0].nlink = 2;
+	filesystem[0].a_time = time(NULL);
+	filesystem[0].m_time = filesystem[0].a_time;
+	filesystem[0].c_time = filesystem[0].a_time;
+	filesystem[0].indirect = -1;
+	filesystem[0].parent = -1;
+	filesystem[0].first_child = -1;
+	filesystem[0].next_sibling = -1;
+	filesystem[0].prev_sibling = -1;
+	filesystem[0].child_count = 0;
+	super->clean = 1;
+}
+
+/*
+ * Function to load the file system state from a file.
+ * Maps the image, formatting it when the file is new. Only the superblock is read here,
+ * inodes, names and blocks are paged in when they are first used, so mounting takes the same time whatever the size.
+*/
+int loadFileSystem(const char *filename) {
+	size_t inodes_at = IMAGE_ALIGN(sizeof(Superblock));
+	size_t names_at = inodes_at + IMAGE_ALIGN((size_t) MAX_INODES * sizeof(Inode));
+	size_t index_at = names_at + IMAGE_ALIGN((size_t) NAME_ARENA_SIZE);
+	size_t bitmap_at = index_at + IMAGE_ALIGN((size_t) NAME_INDEX_MAX_BUCKETS * sizeof(int));
+	size_t shares_at = bitmap_at + IMAGE_ALIGN(BITMAP_WORDS * sizeof(uint64_t));
+	size_t fingerprints_at = shares_at + IMAGE_ALIGN((size_t) BLOCKS_COUNT * sizeof(uint16_t));
+	size_t blocks_at = fingerprints_at + IMAGE_ALIGN((size_t) DEDUP_BUCKETS * DEDUP_WAYS * sizeof(Fingerprint));
+	image_size = blocks_at + (size_t) BLOCKS_COUNT * BLOCK_SIZE;
+
+	int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror("Error opening file for reading\n");
+		return -errno;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+	// A new file is sized up front, it stays sparse until written
+	bool fresh = st.st_size == 0;
+	if (fresh && ftruncate(fd, image_size) < 0) {
+		perror("Error sizing the image\n");
+		close(fd);
+		return -errno;
+	}
+	if (!fresh && (size_t) st.st_size != image_size) {
+		fprintf(stderr, "%s was made for a different geometry\n", filename);
+		close(fd);
+		return -EINVAL;
+	}
+	image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (image == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+	image_fd = fd;
+	super = (Superblock *) image;
+	filesystem = (Inode *) (image + inodes_at);
+	name_arena = image + names_at;
+	name_index = (int *) (image + index_at);
+	free_bitmap = (uint64_t *) (image + bitmap_at);
+	block_shares = (uint16_t *) (image + shares_at);
+	fingerprints = (Fingerprint *) (image + fingerprints_at);
+	blocks = (Block *) (image + blocks_at);
+
+	if (fresh) {
+		format_image();
+	} else if (memcmp(super->magic, IMAGE_MAGIC, sizeof(super->magic)) != 0 || super->version != IMAGE_VERSION ||
+			   super->block_size != BLOCK_SIZE || super->blocks_count != BLOCKS_COUNT || super->max_inodes != MAX_INODES ||
+			   super->inode_size != sizeof(Inode) || super->inline_data_size != INLINE_DATA_SIZE ||
+			   super->cluster_blocks != CLUSTER_BLOCKS || super->name_arena_size != NAME_ARENA_SIZE) {
+		fprintf(stderr, "%s is not an image of this build of the filesystem\n", filename);
+		munmap(image, image_size);
+		close(image_fd);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Caesar encryption of file contents, copies length bytes from src to dst and encrypts them in the same pass
+*/ 
+void encryptCaesarCypher(char *dst, const char *src, size_t length){
+	if (shift == 0) {
+		memcpy(dst, src, length);
+	} else {
+		caesar_kernel(dst, src, length, shift);
+	}
+}
+
+/*
+ * Caesar decryption of file contents, copies and decrypts in one pass.
+ * Shifting forward by 26 - shift undoes the encryption.
+*/ 
+void decryptCaesarCypher(char *dst, const char *src, size_t length){
+	if (shift == 0) {
+		memcpy(dst, src, length);
+	} else {
+		caesar_kernel(dst, src, length, 26 - shift);
+	}
+}
+
+/*
+ * Scalar Caesar kernel, copies src to dst shifting letters forward by key (0 - 25) and keeping their case.
+ * This is the reference the vector kernels must match.
+*/ 
+void caesar_scalar(char *dst, const char *src, size_t length, int key){
+	for (size_t i = 0; i < length; i++){
+		char c = src[i];
+
+		// Shift uppercase letters
+        if (c >= 'A' && c <= 'Z') {
+            c = c > 'Z' - key ? c + key - 26 : c + key;
+        }
+
+		// Shift lowercase letters
+        else if (c >= 'a' && c <= 'z') {
+            c = c > 'z' - key ? c + key - 26 : c + key;
+        }
+		dst[i] = c;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * SSE2 Caesar kernel, copies and shifts 16 bytes at a time.
+ * Letters are found with range compares, shifted by key and wrapped by subtracting 26 when they pass 'Z' or 'z'.
+ * Bytes of 0x80 and up compare as negative, so they are never taken for letters.
+*/ 
+__attribute__((target("sse2")))
+void caesar_sse2(char *dst, const char *src, size_t length, int key){
+	const __m128i upper_low = _mm_set1_epi8('A' - 1), upper_high = _mm_set1_epi8('Z' + 1);
+	const __m128i lower_low = _mm_set1_epi8('a' - 1), lower_high = _mm_set1_epi8('z' + 1);
+	const __m128i upper_wrap = _mm_set1_epi8('Z' - key), lower_wrap = _mm_set1_epi8('z' - key);
+	const __m128i shift_by = _mm_set1_epi8(key), alphabet = _mm_set1_epi8(26);
+	size_t i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, upper_low), _mm_cmpgt_epi8(upper_high, v));
+		__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(v, lower_low), _mm_cmpgt_epi8(lower_high, v));
+		__m128i wrap = _mm_or_si128(_mm_and_si128(upper, _mm_cmpgt_epi8(v, upper_wrap)),
+									_mm_and_si128(lower, _mm_cmpgt_epi8(v, lower_wrap)));
+		v = _mm_add_epi8(v, _mm_and_si128(_mm_or_si128(upper, lower), shift_by));
+		v = _mm_sub_epi8(v, _mm_and_si128(wrap, alphabet));
+		_mm_storeu_si128((__m128i *) (dst + i), v);
+	}
+	caesar_scalar(dst + i, src + i, length - i, key);
+}
+
+/*
+ * AVX2 Caesar kernel, the SSE2 kernel widened to 32 bytes at a time
+*/ 
+__attribute__((target("avx2")))
+void caesar_avx2(char *dst, const char *src, size_t length, int key){
+	const __m256i upper_low = _mm256_set1_epi8('A' - 1), upper_high = _mm256_set1_epi8('Z' + 1);
+	const __m256i lower_low = _mm256_set1_epi8('a' - 1), lower_high = _mm256_set1_epi8('z' + 1);
+	const __m256i upper_wrap = _mm256_set1_epi8('Z' - key), lower_wrap = _mm256_set1_epi8('z' - key);
+	const __m256i shift_by = _mm256_set1_epi8(key), alphabet = _mm256_set1_epi8(26);
+	size_t i = 0;
+
+	for (; i + 32 <= length; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, upper_low), _mm256_cmpgt_epi8(upper_high, v));
+		__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(v, lower_low), _mm256_cmpgt_epi8(lower_high, v));
+		__m256i wrap = _mm256_or_si256(_mm256_and_si256(upper, _mm256_cmpgt_epi8(v, upper_wrap)),
+									   _mm256_and_si256(lower, _mm256_cmpgt_epi8(v, lower_wrap)));
+		v = _mm256_add_epi8(v, _mm256_and_si256(_mm256_or_si256(upper, lower), shift_by));
+		v = _mm256_sub_epi8(v, _mm256_and_si256(wrap, alphabet));
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+	}
+	caesar_sse2(dst + i, src + i, length - i, key);
+}
+#endif
+
+/*
+ * Picks the fastest Caesar kernel the CPU supports
+*/ 
+void select_caesar_kernel(){
+	caesar_kernel = caesar_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		caesar_kernel = caesar_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		caesar_kernel = caesar_sse2;
+	}
+#endif
+}
+
+/*
+ * Table of the bytewise CRC-32C (Castagnoli) kernel, filled in by select_crc32c_kernel
+*/
+uint32_t crc32c_table[256];
+
+/*
+ * Scalar CRC-32C kernel, one byte at a time from the table.
+ * The caller starts with ~0 and inverts the result.
+*/ 
+uint32_t crc32c_scalar(uint32_t crc, const void *data, size_t length){
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < length; i++) {
+		crc = crc32c_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * SSE4.2 CRC-32C kernel, the crc32 instruction takes 8 bytes at a time
+*/ 
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t length){
+	const unsigned char *bytes = data;
+	uint64_t crc64 = crc;
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t) crc64;
+	for (; i < length; i++) {
+		crc = _mm_crc32_u8(crc, bytes[i]);
+	}
+	return crc;
+}
+#endif
+
+/*
+ * Fills in the CRC-32C table and picks the fastest kernel the CPU supports
+*/ 
+void select_crc32c_kernel(){
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = n;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		}
+		crc32c_table[n] = crc;
+	}
+	crc32c_kernel = crc32c_scalar;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_kernel = crc32c_sse42;
+	}
+#endif
+}
+
+/*
+ * Compression codec for clusters, in the LZ4 block format: sequences of a token, literals, and a match
+ * copied from up to 64 KiB back. The token holds the literal count in its high nibble and the match length
+ * minus 4 in its low one, a nibble of 15 is continued in the following bytes. The last sequence has no match,
+ * and the last 5 bytes are always literals.
+*/
+#define CODEC_MIN_MATCH 4
+#define CODEC_HASH_BITS 12
+#define CODEC_END_LITERALS 5 // bytes at the end that are always literals
+#define CODEC_MATCH_LIMIT 12 // no match starts this close to the end
+
+/*
+ * Hashes the 4 bytes a match starts with
+*/
+static inline uint32_t codec_hash(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - CODEC_HASH_BITS);
+}
+
+/*
+ * Counts the bytes two words have in common before their first difference, in memory order
+*/
+static inline size_t codec_common_bytes(uint64_t a, uint64_t b) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(a ^ b) >> 3;
+#else
+	return __builtin_ctzll(a ^ b) >> 3;
+#endif
+}
+
+/*
+ * Writes the continuation bytes of a length that did not fit its nibble
+*/
+static inline uint8_t *codec_put_length(uint8_t *out, size_t length) {
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
+
+/*
+ * Compresses length bytes (at most 64 KiB) into dst.
+ * Returns the compressed size, or 0 when it would not fit in capacity bytes.
+*/
+size_t codec_compress(const char *src, size_t length, char *dst, size_t capacity) {
+	uint16_t table[1 << CODEC_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	const uint8_t *in = (const uint8_t *) src;
+	uint8_t *out = (uint8_t *) dst;
+	uint8_t *out_end = out + capacity;
+	size_t anchor = 0;
+	size_t pos = 1;
+	size_t limit = length > CODEC_MATCH_LIMIT ? length - CODEC_MATCH_LIMIT : 0;
+
+	while (pos < limit) {
+		uint32_t sequence, earlier;
+		memcpy(&sequence, in + pos, sizeof(sequence));
+		uint32_t h = codec_hash(sequence);
+		size_t candidate = table[h];
+		table[h] = pos;
+		memcpy(&earlier, in + candidate, sizeof(earlier));
+		if (earlier != sequence) {
+			// Steps grow through data that does not match, so incompressible data is passed over quickly
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+		// Matches are extended a word at a time, then byte by byte near the end
+		size_t match = CODEC_MIN_MATCH;
+		size_t match_end = length - CODEC_END_LITERALS;
+		while (pos + match + sizeof(uint64_t) <= match_end) {
+			uint64_t a, b;
+			memcpy(&a, in + candidate + match, sizeof(a));
+			memcpy(&b, in + pos + match, sizeof(b));
+			if (a != b) {
+				match += codec_common_bytes(a, b);
+				break;
+			}
+			match += sizeof(uint64_t);
+		}
+		if (pos + match + sizeof(uint64_t) > match_end) {
+			while (pos + match < match_end && in[candidate + match] == in[pos + match]) {
+				match++;
+			}
+		}
+
+		size_t literals = pos - anchor;
+		if ((size_t) (out_end - out) < 1 + literals / 255 + 1 + literals + 2 + (match - CODEC_MIN_MATCH) / 255 + 1) {
+			return 0;
+		}
+		uint8_t *token = out++;
+		*token = (literals < 15 ? literals : 15) << 4;
+		if (literals >= 15) {
+			out = codec_put_length(out, literals - 15);
+		}
+		memcpy(out, in + anchor, literals);
+		out += literals;
+		*out++ = (pos - candidate) & 0xFF;
+		*out++ = (pos - candidate) >> 8;
+		size_t extra = match - CODEC_MIN_MATCH;
+		*token |= extra < 15 ? extra : 15;
+		if (extra >= 15) {
+			out = codec_put_length(out, extra - 15);
+		}
+		pos += match;
+		anchor = pos;
+	}
+
+	size_t literals = length - anchor;
+	if ((size_t) (out_end - out) < 1 + literals / 255 + 1 + literals) {
+		return 0;
+	}
+	uint8_t *token = out++;
+	*token = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15) {
+		out = codec_put_length(out, literals - 15);
+	}
+	memcpy(out, in + anchor, literals);
+	out += literals;
+	return out - (uint8_t *) dst;
+}
+
+/*
+ * Reads the continuation bytes of a length, returns false when they run past the end
+*/
+static inline bool codec_get_length(const uint8_t **in, const uint8_t *in_end, size_t *length) {
+	uint8_t byte;
+	do {
+		if (*in >= in_end) {
+			return false;
+		}
+		byte = *(*in)++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+/*
+ * Decompresses length bytes into at most capacity bytes of dst.
+ * Every length and offset is checked, so damaged data fails instead of reading or writing out of bounds.
+ * Returns the decompressed size, or -1 if the data is damaged.
+*/
+ssize_t codec_decompress(const char *src, size_t length, char *dst, size_t capacity) {
+	const uint8_t *in = (const uint8_t *) src;
+	const uint8_t *in_end = in + length;
+	uint8_t *out = (uint8_t *) dst;
+	uint8_t *out_end = out + capacity;
+
+	while (in < in_end) {
+		uint8_t token = *in++;
+		size_t literals = token >> 4;
+		if (literals == 15 && !codec_get_length(&in, in_end, &literals)) {
+			return -1;
+		}
+		if (literals <= 16 && in_end - in >= 16 && out_end - out >= 16) {
+			// Short literals are copied as 16 bytes, the extra bytes are overwritten by what follows
+			memcpy(out, in, 16);
+		} else if (literals > (size_t) (in_end - in) || literals > (size_t) (out_end - out)) {
+			return -1;
+		} else {
+			memcpy(out, in, literals);
+		}
+		in += literals;
+		out += literals;
+		if (in == in_end) {
+			break;
+		}
+
+		if (in_end - in < 2) {
+			return -1;
+		}
+		size_t offset = in[0] | (size_t) in[1] << 8;
+		in += 2;
+		size_t match = token & 15;
+		if (match == 15 && !codec_get_length(&in, in_end, &match)) {
+			return -1;
+		}
+		match += CODEC_MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (out - (uint8_t *) dst) || match > (size_t) (out_end - out)) {
+			return -1;
+		}
+		// A match closer than its length repeats bytes it is still writing
+		const uint8_t *from = out - offset;
+		if (offset >= sizeof(uint64_t) && (size_t) (out_end - out) >= match + sizeof(uint64_t)) {
+			// Copied a word at a time, every word read was written before
+			for (size_t k = 0; k < match; k += sizeof(uint64_t)) {
+				memcpy(out + k, from + k, sizeof(uint64_t));
+			}
+		} else if (offset >= match) {
+			memcpy(out, from, match);
+		} else {
+			for (size_t k = 0; k < match; k++) {
+				out[k] = from[k];
+			}
+		}
+		out += match;
+	}
+	return out - (uint8_t *) dst;
+}
+
+/*
+ * Helper function for marking a run of blocks as free or used in the bitmap, a word at a time
+*/ 
+void mark_blocks(uint32_t start, uint32_t count, bool free) {
+	if (free) {
+		super->free_block_count += count;
+	} else {
+		super->free_block_count -= count;
+	}
+	while (count > 0) {
+		uint32_t bit = start % 64;
+		uint32_t bits = 64 - bit < count ? 64 - bit : count;
+		uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << bit;
+		if (free) {
+			free_bitmap[start / 64] |= mask;
+		} else {
+			free_bitmap[start / 64] &= ~mask;
+		}
+		start += bits;
+		count -= bits;
+	}
+}
+
+/*
+ * Helper function for marking every block as free
+*/ 
+void reset_block_map() {
+	memset(free_bitmap, 0, BITMAP_WORDS * sizeof(uint64_t));
+	super->free_block_count = 0;
+	super->alloc_cursor = 0;
+	mark_blocks(0, BLOCKS_COUNT, true);
+}
+
+/*
+ * Helper function for finding the first free block in [from, to), returns -1 if there is none
+*/ 
+int next_free_block(uint32_t from, uint32_t to) {
+	if (from >= to) {
+		return -1;
+	}
+	uint32_t w = from / 64;
+	uint64_t word = free_bitmap[w] & (~0ULL << (from % 64));
+	while (word == 0) {
+		w++;
+		if (w * 64 >= to) {
+			return -1;
+		}
+		word = free_bitmap[w];
+	}
+	uint32_t block = w * 64 + __builtin_ctzll(word);
+	return block < to ? (int) block : -1;
+}
+
+/*
+ * Helper function for counting the free blocks starting at a free block, up to max
+*/ 
+uint32_t free_run_length(uint32_t start, uint32_t max) {
+	uint32_t length = 0;
+	while (length < max && start + length < BLOCKS_COUNT) {
+		uint32_t pos = start + length;
+		// The first used block is the lowest set bit of the inverted word
+		uint64_t used = ~free_bitmap[pos / 64] >> (pos % 64);
+		if (used != 0) {
+			length += __builtin_ctzll(used);
+			break;
+		}
+		length += 64 - pos % 64;
+	}
+	return length < max ? length : max;
+}
+
+/*
+ * Helper function for finding a run of count free blocks in [from, to).
+ * Returns 1 when one is found, otherwise the longest shorter run is kept in best_start/best_length.
+*/ 
+int search_free_run(uint32_t from, uint32_t to, uint32_t count, uint32_t *best_start, uint32_t *best_length) {
+	int block;
+	while ((block = next_free_block(from, to)) >= 0) {
+		uint32_t length = free_run_length(block, count);
+		if (length > *best_length) {
+			*best_start = block;
+			*best_length = length;
+		}
+		if (length == count) {
+			return 1;
+		}
+		from = block + length;
+	}
+	return 0;
+}
+
+/*
+ * Helper function for finding free blocks of data
+*/ 
+int find_free_block() {
+	int block = next_free_block(super->alloc_cursor, BLOCKS_COUNT);
+	if (block < 0) {
+		block = next_free_block(0, super->alloc_cursor);
+	}
+	// Returns -1 if no free block was found
+	return block;
+}
+
+/*
+ * Helper function for allocating a run of up to count contiguous blocks.
+ * Starts at hint when that block is free, so extents can keep growing in place.
+ * Otherwise takes the first run of count free blocks after the last allocation,
+ * or the longest shorter run if there is none.
+ * Returns the first block and stores the run length in allocated, or -1 if the disk is full.
+*/ 
+int alloc_blocks(int hint, uint32_t count, uint32_t *allocated) {
+	uint32_t start = 0;
+	uint32_t length = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	if (count == 0 || super->free_block_count == 0) {
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	if (hint >= 0 && hint < BLOCKS_COUNT && next_free_block(hint, hint + 1) == hint) {
+		start = hint;
+		length = free_run_length(hint, count);
+	} else if (!search_free_run(super->alloc_cursor, BLOCKS_COUNT, count, &start, &length)) {
+		search_free_run(0, super->alloc_cursor, count, &start, &length);
+	}
+	if (length == 0) {
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	mark_blocks(start, length, false);
+	super->alloc_cursor = (start + length) % BLOCKS_COUNT;
+	pthread_mutex_unlock(&alloc_lock);
+	*allocated = length;
+	return start;
+}
+
+/*
+ * Helper function for returning a run of blocks to the free pool once the operation freeing them is committed
+*/ 
+void free_blocks(uint32_t start, uint32_t count) {
+	defer_free(false, start, count);
+}
+
+/*
+ * Helper function for returning a run of blocks to the free pool right away
+*/ 
+void release_blocks(uint32_t start, uint32_t count) {
+	pthread_mutex_lock(&alloc_lock);
+	drop_blocks(start, count);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Helper function for dropping a reference to each block of a run, the caller holds alloc_lock.
+ * Blocks no other extent shares are freed, the others only lose the reference.
+*/ 
+void drop_blocks(uint32_t start, uint32_t count) {
+	uint32_t from = start;
+	for (uint32_t b = start; b < start + count; b++) {
+		if (block_shares[b] > 0) {
+			__atomic_store_n(&block_shares[b], block_shares[b] - 1, __ATOMIC_RELAXED);
+			super->shared_blocks--;
+			mark_blocks(from, b - from, true);
+			from = b + 1;
+		}
+	}
+	mark_blocks(from, start + count - from, true);
+}
+
+/*
+ * Helper function for adding a reference to a run of used blocks, returns false if one of them cannot take another
+*/ 
+bool share_blocks(uint32_t start, uint32_t count) {
+	pthread_mutex_lock(&alloc_lock);
+	bool shared = true;
+	for (uint32_t b = start; b < start + count; b++) {
+		if (next_free_block(b, b + 1) >= 0 || block_shares[b] == MAX_SHARES) {
+			shared = false;
+			break;
+		}
+	}
+	for (uint32_t b = start; shared && b < start + count; b++) {
+		__atomic_store_n(&block_shares[b], block_shares[b] + 1, __ATOMIC_RELAXED);
+	}
+	if (shared) {
+		super->shared_blocks += count;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return shared;
+}
+
+/*
+ * Helper function for checking whether any block of a run is shared with another extent.
+ * Only the holder of the run writes it, under its inode lock, and references are only added under that lock,
+ * so a run found unshared stays so until the lock is dropped.
+*/ 
+bool blocks_shared(uint32_t start, uint32_t count) {
+	for (uint32_t b = start; b < start + count; b++) {
+		if (__atomic_load_n(&block_shares[b], __ATOMIC_RELAXED) > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Helper function for finding amount of blocks needed
+*/ 
+int blocks_needed(size_t size){
+	int sum = 0; 
+	while ( size > BLOCK_SIZE * sum){
+		sum = sum + 1; 
+	}
+	return sum;
+}
+
+
+
+/*
+ * Tracing.
+ * Messages are not formatted where they happen. Each thread appends the format and arguments of its messages to a
+ * ring of its own, without locks, and a trace thread formats what the rings hold and writes it to stdout every
+ * TRACE_INTERVAL_MS, so operations never wait for the terminal. When a ring is full its thread drops messages and
+ * counts them. Threads take a free ring when they write their first message and give it back when they exit.
+ * Operations are counted here as well, with the bytes they read or write and a histogram of how long they take.
+*/
+#define TRACE_RINGS 64
+#define TRACE_RING_EVENTS 1024 // a power of two
+#define TRACE_INTERVAL_MS 100
+// Latency bucket k counts operations that took less than 2^k nanoseconds and at least half that, the last one the rest
+#define LATENCY_BUCKETS 32
+
+/* A message as it is traced, formatted later*/
+typedef struct TraceEvent {
+	uint64_t time; // nanoseconds since tracing started
+	const char *format; // a string literal, formatted with name, if any, then a, b, c and d
+	const char *name;
+	int64_t a;
+	int64_t b;
+	int64_t c;
+	int64_t d;
+} TraceEvent;
+
+/* Messages of one thread, written by that thread and read by the trace thread*/
+typedef struct TraceRing {
+	uint64_t head __attribute__((aligned(64))); // messages written
+	uint64_t tail __attribute__((aligned(64))); // messages taken by the trace thread
+	int owned; // whether a thread writes to the ring
+	TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+TraceRing trace_rings[TRACE_RINGS];
+uint32_t trace_ring_count; // rings handed out so far, the ones past it have never been used
+__thread TraceRing *thread_ring;
+pthread_key_t trace_key; // gives the ring of a thread back when it exits
+pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+uint64_t trace_written;
+uint64_t trace_dropped;
+struct timespec trace_start;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_work = PTHREAD_COND_INITIALIZER;
+pthread_t trace_thread;
+bool trace_running;
+bool trace_stopping;
+
+// Counters are kept in stripes, each thread counts in its own so counting does not bounce one cache line between them
+#define COUNTER_STRIPES 16
+unsigned int next_counter_stripe;
+__thread int counter_stripe = -1;
+
+/* Counts of one operation*/
+typedef struct OpCounters {
+	uint64_t calls;
+	uint64_t bytes; // read or written
+	uint64_t nanoseconds; // spent in all the calls
+	uint64_t latency[LATENCY_BUCKETS];
+} OpCounters;
+
+/* Counts of every operation made by one stripe of threads*/
+typedef struct OpStripe {
+	OpCounters ops[OP_COUNT];
+} __attribute__((aligned(64))) OpStripe;
+
+OpStripe op_stripes[COUNTER_STRIPES];
+const char *op_names[OP_COUNT] = { "lookup", "forget", "getattr", "setattr", "mknod", "mkdir", "create", "unlink",
+								   "rmdir", "rename", "open", "opendir", "read", "write", "readdir", "flush", "fsync",
+								   "fsyncdir", "release", "releasedir", "statfs", "fallocate" };
+
+/* The operation a thread is in*/
+typedef struct OpState {
+	int depth; // operations called from the outermost one are part of it
+	int op;
+	uint64_t started;
+	uint64_t bytes;
+	int inode; // the inode it works on, -1 until it is known
+	off_t offset; // where it reads or writes, or the size it sets
+} OpState;
+
+__thread OpState op_state;
+
+/*
+ * Returns the stripe of counters of the calling thread
+*/
+int thread_stripe() {
+	if (counter_stripe < 0) {
+		counter_stripe = __atomic_fetch_add(&next_counter_stripe, 1, __ATOMIC_RELAXED) % COUNTER_STRIPES;
+	}
+	return counter_stripe;
+}
+
+/*
+ * Nanoseconds on the monotonic clock
+*/
+uint64_t monotonic_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Gives the ring of an exiting thread back
+*/
+void release_ring(void *ring) {
+	__atomic_store_n(&((TraceRing *) ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Takes a free ring for the calling thread, returns NULL when every ring is taken
+*/
+TraceRing *claim_ring() {
+	for (uint32_t r = 0; r < TRACE_RINGS; r++) {
+		TraceRing *ring = &trace_rings[r];
+		int free = 0;
+		if (__atomic_compare_exchange_n(&ring->owned, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			// The trace thread only looks at rings up to the highest one ever handed out
+			uint32_t seen = __atomic_load_n(&trace_ring_count, __ATOMIC_RELAXED);
+			while (seen < r + 1 && !__atomic_compare_exchange_n(&trace_ring_count, &seen, r + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			}
+			pthread_setspecific(trace_key, ring);
+			thread_ring = ring;
+			return ring;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Appends a message to the ring of the calling thread, or counts it as dropped when the ring is full
+*/
+void trace_event(const char *format, const char *name, int64_t a, int64_t b, int64_t c, int64_t d) {
+	TraceRing *ring = thread_ring != NULL ? thread_ring : claim_ring();
+	if (ring == NULL) {
+		__atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_EVENTS) {
+		__atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	TraceEvent *event = &ring->events[head % TRACE_RING_EVENTS];
+	event->time = (uint64_t) (now.tv_sec - trace_start.tv_sec) * 1000000000 + now.tv_nsec - trace_start.tv_nsec;
+	event->format = format;
+	event->name = name;
+	event->a = a;
+	event->b = b;
+	event->c = c;
+	event->d = d;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Formats the messages the rings hold and writes them to stdout.
+ * Messages of one thread come out in order, messages of different threads carry their times.
+*/
+void drain_rings() {
+	uint32_t count = __atomic_load_n(&trace_ring_count, __ATOMIC_ACQUIRE);
+	bool wrote = false;
+	for (uint32_t r = 0; r < count; r++) {
+		TraceRing *ring = &trace_rings[r];
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = ring->tail;
+		uint64_t tail = first;
+		for (; tail < head; tail++) {
+			TraceEvent *event = &ring->events[tail % TRACE_RING_EVENTS];
+			char message[256];
+			if (event->name != NULL) {
+				snprintf(message, sizeof(message), event->format, event->name, event->a, event->b, event->c, event->d);
+			} else {
+				snprintf(message, sizeof(message), event->format, event->a, event->b, event->c, event->d);
+			}
+			printf("[%llu.%06llu] %s\n", (unsigned long long) (event->time / 1000000000),
+				   (unsigned long long) (event->time % 1000000000 / 1000), message);
+			wrote = true;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&trace_written, tail - first, __ATOMIC_RELAXED);
+	}
+	if (wrote) {
+		fflush(stdout);
+	}
+}
+
+/*
+ * The trace thread, writes out the rings every TRACE_INTERVAL_MS until tracing stops
+*/
+void *trace_main(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&trace_lock);
+	while (!trace_stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += TRACE_INTERVAL_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&trace_work, &trace_lock, &deadline);
+		pthread_mutex_unlock(&trace_lock);
+		drain_rings();
+		pthread_mutex_lock(&trace_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return NULL;
+}
+
+/*
+ * Makes the key that gives rings back, once for every mount
+*/
+void make_trace_key() {
+	pthread_key_create(&trace_key, release_ring);
+}
+
+/*
+ * Starts the trace thread, messages traced before it starts are kept in the rings
+*/
+void start_tracing() {
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	pthread_once(&trace_once, make_trace_key);
+	trace_stopping = false;
+	trace_running = pthread_create(&trace_thread, NULL, trace_main, NULL) == 0;
+}
+
+/*
+ * Stops the trace thread and writes out what is left in the rings
+*/
+void stop_tracing() {
+	if (trace_running) {
+		pthread_mutex_lock(&trace_lock);
+		trace_stopping = true;
+		pthread_cond_signal(&trace_work);
+		pthread_mutex_unlock(&trace_lock);
+		pthread_join(trace_thread, NULL);
+		trace_running = false;
+	}
+	drain_rings();
+}
+
+/*
+ * Starts counting an operation, unless the thread is already in one
+*/
+int op_begin(int op) {
+	if (op_state.depth++ == 0) {
+		op_state.op = op;
+		op_state.bytes = 0;
+		op_state.inode = -1;
+		op_state.offset = 0;
+		op_state.started = monotonic_ns();
+	}
+	return op;
+}
+
+/*
+ * Adds the bytes a read or write returned to the operation the thread is in
+*/
+void op_bytes(int res) {
+	if (res > 0) {
+		op_state.bytes += res;
+	}
+}
+
+/*
+ * Records the inode the operation the thread is in works on, for its trace message
+*/
+void op_inode(int i) {
+	op_state.inode = i;
+}
+
+/*
+ * Records the offset the operation the thread is in reads or writes at, or the size it sets
+*/
+void op_offset(off_t offset) {
+	op_state.offset = offset;
+}
+
+/*
+ * Counts the operation the thread is in once its outermost function returns.
+ * At the debug level it is traced with what it worked on, in a form a harness can replay.
+*/
+void op_end(int *scope) {
+	(void) scope;
+	if (--op_state.depth > 0) {
+		return;
+	}
+	uint64_t took = monotonic_ns() - op_state.started;
+	int bucket = took == 0 ? 0 : 64 - __builtin_clzll(took);
+	OpCounters *counters = &op_stripes[thread_stripe()].ops[op_state.op];
+	__atomic_add_fetch(&counters->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters->bytes, op_state.bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters->nanoseconds, took, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counters->latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+	if (TRACE_DEBUG <= TRACE_LEVEL && TRACE_DEBUG <= options.trace_level) {
+		trace_event("%s: inode %lld offset %lld, %lld bytes in %lld ns", op_names[op_state.op], op_state.inode,
+					(int64_t) op_state.offset, (int64_t) op_state.bytes, (int64_t) took);
+	}
+}
+
+
+/*
+ * Block cache.
+ * File blocks live in the mapped image, so the kernel pages them in when they are first touched and pages them out
+ * when it likes. With -o cache=<bytes> the blocks resident in memory are kept within a budget instead.
+ * Reads and writes mark the chunks of the block region they touch as resident and referenced, and when more chunks
+ * are resident than the budget allows, the cache thread sweeps a clock hand over them. A chunk starts out cold and
+ * the first pass of the hand forgets how it was used until then, a cold chunk referenced again by the time the hand
+ * comes round turns hot, a hot chunk the hand finds unreferenced turns cold again, and a cold chunk it finds
+ * unreferenced is evicted. A scan only touches a chunk while it passes through it, so it only pushes out cold
+ * chunks, and files in steady use stay in memory.
+ * Evicting writes the chunk back to the image and drops its pages from the mapping and the page cache, the next
+ * access faults them in again. Faults only bring in the page they hit, reads that carry on where the last read of
+ * their handle ended ask for the blocks of the following extents ahead of time instead.
+*/
+#define CACHE_CHUNK (64 * 1024)
+#define CACHE_CHUNK_BLOCKS (CACHE_CHUNK > BLOCK_SIZE ? CACHE_CHUNK / BLOCK_SIZE : 1)
+#define CACHE_CHUNKS ((BLOCKS_COUNT + CACHE_CHUNK_BLOCKS - 1) / CACHE_CHUNK_BLOCKS)
+// How far ahead of a sequential read blocks are asked for
+#define CACHE_READAHEAD (1024 * 1024)
+
+// Chunk states
+#define CHUNK_RESIDENT 1
+#define CHUNK_REFERENCED 2 // touched since the hand last passed
+#define CHUNK_HOT 4
+#define CHUNK_NEW 8 // not passed by the hand since it came in, references until then do not count
+
+/* Cache counters, one set per stripe of threads*/
+typedef struct CacheCounters {
+	uint64_t hits; // chunk accesses that found the chunk resident
+	uint64_t misses; // chunk accesses that faulted it in
+	uint64_t evictions;
+	uint64_t readahead; // chunks asked for ahead of sequential reads
+} __attribute__((aligned(64))) CacheCounters;
+
+CacheCounters cache_counters[COUNTER_STRIPES];
+
+uint8_t *cache_chunks; // state of each chunk, in memory only, the pages are only backed once they are touched
+uint32_t cache_resident; // chunks marked resident
+uint32_t cache_budget; // chunks that may be resident, 0 when there is no budget
+uint32_t cache_hand;
+uint32_t cache_hot; // hot chunks, only the cache thread changes them
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_work = PTHREAD_COND_INITIALIZER; // wakes the cache thread when the budget is exceeded
+pthread_t cache_thread;
+bool cache_running;
+bool cache_stopping;
+
+/*
+ * Returns the counters of the calling thread
+*/
+CacheCounters *thread_counters() {
+	return &cache_counters[thread_stripe()];
+}
+
+/*
+ * Tells how a read at offset through a handle uses the blocks it reads.
+ * Once a sequential run has gone on for longer than the readahead window it is taken for a scan, and the blocks
+ * it reads do not count as used again.
+*/
+int cache_use(FileHandle *fh, off_t offset) {
+	if (fh != NULL && offset == fh->last_offset && offset - fh->run_start > CACHE_READAHEAD) {
+		return TOUCH_STREAM;
+	}
+	return TOUCH_ACCESS;
+}
+
+/*
+ * Marks the chunks holding a run of blocks as resident and referenced, counting hits and misses.
+ * Scans do not mark them referenced, readahead counts the chunks it brings in separately.
+*/
+void cache_touch(uint32_t start, uint32_t count, int use) {
+	if (count == 0) {
+		return;
+	}
+	CacheCounters *counters = thread_counters();
+	uint32_t last = (start + count - 1) / CACHE_CHUNK_BLOCKS;
+	for (uint32_t chunk = start / CACHE_CHUNK_BLOCKS; chunk <= last; chunk++) {
+		uint8_t *state = &cache_chunks[chunk];
+		uint8_t seen = __atomic_load_n(state, __ATOMIC_RELAXED);
+		if (seen & CHUNK_RESIDENT) {
+			if (use != TOUCH_AHEAD) {
+				if (use == TOUCH_ACCESS && !(seen & CHUNK_REFERENCED)) {
+					__atomic_or_fetch(state, CHUNK_REFERENCED, __ATOMIC_RELAXED);
+				}
+				__atomic_add_fetch(&counters->hits, 1, __ATOMIC_RELAXED);
+			}
+			continue;
+		}
+		if (__atomic_fetch_or(state, CHUNK_RESIDENT | CHUNK_NEW, __ATOMIC_RELAXED) & CHUNK_RESIDENT) {
+			continue;
+		}
+		__atomic_add_fetch(use == TOUCH_AHEAD ? &counters->readahead : &counters->misses, 1, __ATOMIC_RELAXED);
+		// The cache thread is woken once as the budget is passed, it evicts until well below it
+		if (__atomic_add_fetch(&cache_resident, 1, __ATOMIC_RELAXED) == cache_budget + 1 && cache_budget > 0) {
+			pthread_mutex_lock(&cache_lock);
+			pthread_cond_signal(&cache_work);
+			pthread_mutex_unlock(&cache_lock);
+		}
+	}
+}
+
+/*
+ * Asks for the blocks of the extents that follow a sequential read, up to CACHE_READAHEAD past where it ended.
+ * The caller holds the inode lock for reading.
+*/
+void cache_readahead(Inode *inode, FileHandle *fh, off_t end) {
+	if (inode->is_inline || end >= inode->size) {
+		return;
+	}
+	// A handle that started over, or jumped ahead of what was asked for, starts a new window
+	if (fh->readahead_end < end || fh->readahead_end > end + CACHE_READAHEAD) {
+		fh->readahead_end = end;
+	}
+	if (fh->readahead_end > end + CACHE_READAHEAD / 2) {
+		return;
+	}
+	off_t from = fh->readahead_end;
+	off_t to = end + CACHE_READAHEAD < inode->size ? end + CACHE_READAHEAD : inode->size;
+	fh->readahead_end = to;
+	uint32_t first = from / BLOCK_SIZE;
+	uint32_t stop = (to + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int k = find_extent(inode, first);
+	for (k = k < 0 ? -k - 1 : k; k < (int) inode->extent_count; k++) {
+		Extent *e = extent_at(inode, k);
+		if (e->logical >= stop) {
+			break;
+		}
+		uint32_t start = e->start;
+		uint32_t count = extent_blocks(e);
+		if (e->packed == 0) {
+			uint32_t skip = e->logical < first ? first - e->logical : 0;
+			start += skip;
+			count = (e->logical + e->length < stop ? e->logical + e->length : stop) - e->logical - skip;
+		}
+		posix_fadvise(image_fd, blocks[start].data - image, (off_t) count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+		cache_touch(start, count, TOUCH_AHEAD);
+	}
+}
+
+/*
+ * Writes a chunk back to the image and drops its pages from memory.
+ * Pages touched meanwhile are only faulted in again, the image mapping is shared so nothing is lost.
+*/
+void evict_chunk(uint32_t chunk) {
+	uint32_t first = chunk * CACHE_CHUNK_BLOCKS;
+	uint32_t count = BLOCKS_COUNT - first < CACHE_CHUNK_BLOCKS ? BLOCKS_COUNT - first : CACHE_CHUNK_BLOCKS;
+	char *data = blocks[first].data;
+	size_t length = (size_t) count * BLOCK_SIZE;
+	off_t at = data - image;
+	sync_file_range(image_fd, at, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	// Only whole pages are dropped from the mapping, a block size that is not a multiple of the page leaves the edges
+	uintptr_t from = ((uintptr_t) data + 4095) & ~(uintptr_t) 4095;
+	uintptr_t to = ((uintptr_t) data + length) & ~(uintptr_t) 4095;
+	if (to > from) {
+		madvise((void *) from, to - from, MADV_DONTNEED);
+	}
+	posix_fadvise(image_fd, at, length, POSIX_FADV_DONTNEED);
+	__atomic_add_fetch(&thread_counters()->evictions, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sweeps the clock hand until the resident chunks are an eighth below the budget.
+ * Hot chunks may take up to three quarters of the budget, while they do the hand leaves them hot.
+ * Hot chunks take up to three passes to evict, the sweep stops after that many.
+*/
+void evict_chunks() {
+	uint32_t target = cache_budget - cache_budget / 8;
+	uint32_t hot_limit = cache_budget - cache_budget / 4;
+	for (uint64_t step = 0; step < 3ULL * CACHE_CHUNKS && __atomic_load_n(&cache_resident, __ATOMIC_RELAXED) > target; step++) {
+		uint32_t chunk = cache_hand;
+		cache_hand = (cache_hand + 1) % CACHE_CHUNKS;
+		uint8_t *state = &cache_chunks[chunk];
+		uint8_t seen = __atomic_load_n(state, __ATOMIC_RELAXED);
+		if (!(seen & CHUNK_RESIDENT)) {
+			continue;
+		}
+		uint8_t next;
+		if (seen & CHUNK_NEW) {
+			// Blocks read ahead may still be on their way in, and a run of reads touches a chunk several times
+			next = CHUNK_RESIDENT;
+		} else if (seen & CHUNK_REFERENCED) {
+			next = CHUNK_RESIDENT | CHUNK_HOT;
+		} else if (seen & CHUNK_HOT) {
+			next = cache_hot > hot_limit ? CHUNK_RESIDENT : seen;
+		} else {
+			next = 0;
+		}
+		// A chunk touched meanwhile is left for the next pass
+		if (!__atomic_compare_exchange_n(state, &seen, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			continue;
+		}
+		cache_hot += (next & CHUNK_HOT ? 1 : 0) - (seen & CHUNK_HOT ? 1 : 0);
+		if (next == 0) {
+			__atomic_sub_fetch(&cache_resident, 1, __ATOMIC_RELAXED);
+			evict_chunk(chunk);
+		}
+	}
+}
+
+/*
+ * The cache thread, evicts chunks whenever more are resident than the budget allows
+*/
+void *cache_main(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&cache_lock);
+	while (!cache_stopping) {
+		if (__atomic_load_n(&cache_resident, __ATOMIC_RELAXED) <= cache_budget) {
+			pthread_cond_wait(&cache_work, &cache_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&cache_lock);
+		evict_chunks();
+		pthread_mutex_lock(&cache_lock);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+/*
+ * Sets up the chunk states, all chunks start out not resident, and starts the cache thread when there is a budget
+*/
+void start_cache() {
+	cache_chunks = mmap(NULL, CACHE_CHUNKS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (cache_chunks == MAP_FAILED) {
+		perror("Error starting the block cache\n");
+		exit(1);
+	}
+	memset(cache_counters, 0, sizeof(cache_counters));
+	cache_resident = 0;
+	cache_hand = 0;
+	cache_hot = 0;
+	cache_budget = options.cache_size == 0 ? 0 : options.cache_size / CACHE_CHUNK > 0 ? options.cache_size / CACHE_CHUNK : 1;
+	cache_stopping = false;
+	// Faults would read around the block they hit and fill the page cache behind the budget, readahead is done here
+	if (cache_budget > 0) {
+		uintptr_t at = (uintptr_t) blocks[0].data & ~(uintptr_t) 4095;
+		madvise((void *) at, (uintptr_t) blocks[0].data + (size_t) BLOCKS_COUNT * BLOCK_SIZE - at, MADV_RANDOM);
+	}
+	cache_running = cache_budget > 0 && pthread_create(&cache_thread, NULL, cache_main, NULL) == 0;
+}
+
+/*
+ * Stops the cache thread and reports the counters
+*/
+void stop_cache() {
+	if (cache_running) {
+		pthread_mutex_lock(&cache_lock);
+		cache_stopping = true;
+		pthread_cond_signal(&cache_work);
+		pthread_mutex_unlock(&cache_lock);
+		pthread_join(cache_thread, NULL);
+		cache_running = false;
+	}
+	munmap(cache_chunks, CACHE_CHUNKS);
+}
+
+
+/*
+ * Journal.
+ * An operation copies every byte range of the image it changed (inode records, names, file blocks) into redo records
+ * while it still holds its locks. The records of one operation are collected per thread and appended to the pending
+ * group in one piece by journal_end, so a group never holds half an operation.
+ * The commit thread writes the pending group to JOURNAL_FILE with a checksum and makes it durable with one fdatasync,
+ * so operations that finish close together share a commit. It commits every -o commit= seconds, or at once when
+ * fsync or flush is waiting.
+ * The image itself is only made durable by a checkpoint. The checkpointer thread writes back the parts of the image
+ * that committed groups touched, in the background, then drops the groups it covered from the front of the journal.
+ * After a crash the committed groups are copied back over the image in order, and everything derived from the
+ * inodes is rebuilt.
+ * Blocks and names freed by an operation are only reused once it is committed, so a committed operation
+ * never shares space with one that was lost.
+*/
+#define JOURNAL_MAGIC 0x4A353144 // "D15J"
+// Pending bytes at which operations wait for the commit thread instead of adding more
+#define JOURNAL_PENDING_MAX (32 * 1024 * 1024)
+// Journal size at which the checkpointer is woken before its interval is up
+#define JOURNAL_CHECKPOINT_SIZE (128 * 1024 * 1024)
+// Journal size at which the next commit checkpoints the whole image itself, when the checkpointer falls behind
+#define JOURNAL_MAX_SIZE (4 * (off_t) JOURNAL_CHECKPOINT_SIZE)
+// Parts of the image the checkpointer tracks and writes back one at a time
+#define CHECKPOINT_CHUNK (1024 * 1024)
+
+/* Header of a group of records written with one commit*/
+typedef struct JournalGroup {
+	uint32_t magic;
+	uint32_t checksum; // CRC-32C of the rest of the header and the records, a torn group fails it
+	uint64_t image_id; // the image the group belongs to
+	uint64_t length; // bytes of records after the header
+} JournalGroup;
+
+/* A range of the image as it was after an operation, followed by its bytes padded to 8*/
+typedef struct JournalRecord {
+	uint64_t offset;
+	uint64_t length;
+} JournalRecord;
+
+/* Blocks or a name freed by an operation, kept back until the operation is committed*/
+typedef struct DeferredFree {
+	bool is_name;
+	uint32_t start; // first block, or arena offset of the name
+	uint32_t count; // blocks, or granules of the name
+} DeferredFree;
+
+/* What the operation a thread is in the middle of has journaled so far*/
+typedef struct JournalOp {
+	char *records;
+	size_t length;
+	size_t capacity;
+	int *inodes; // inodes whose journal_sequence is set when the operation is appended
+	size_t inode_count;
+	size_t inode_capacity;
+	DeferredFree *frees;
+	size_t free_count;
+	size_t free_capacity;
+	bool incomplete; // memory ran out, the operation is made durable by a checkpoint instead of its records
+} JournalOp;
+
+__thread JournalOp journal_op;
+
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_work = PTHREAD_COND_INITIALIZER; // wakes the commit thread
+pthread_cond_t journal_done = PTHREAD_COND_INITIALIZER; // signalled after every commit
+pthread_t journal_thread;
+bool journal_running;
+bool journal_stopping;
+bool sync_wanted; // someone waits for the pending group, commit it without waiting for the interval
+bool checkpoint_wanted;
+int journal_error; // error of a failed checkpoint, every later wait returns it
+
+// Operations are numbered as they are appended, a commit makes every operation up to a number durable
+uint64_t journal_last;
+uint64_t journal_durable;
+
+// The group being filled, records start after room for its header. The group being written is only touched
+// by the thread holding commit_lock.
+char *pending;
+size_t pending_length;
+size_t pending_capacity;
+DeferredFree *pending_frees;
+size_t pending_free_count;
+size_t pending_free_capacity;
+char *committing;
+size_t committing_capacity;
+DeferredFree *committing_frees;
+size_t committing_free_capacity;
+
+// Names freed by committed operations, put on the free name lists by the next store_name
+DeferredFree *ready_names;
+size_t ready_name_count;
+size_t ready_name_capacity;
+
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // held while a group is written or the journal emptied or replaced
+int journal_fd = -1;
+off_t journal_size; // bytes of committed groups in the journal file
+uint64_t journal_epoch; // counts the times the journal was emptied or replaced, so offsets into it taken before are stale
+
+// The checkpointer, woken every -o checkpoint= seconds or when the journal grows past JOURNAL_CHECKPOINT_SIZE
+pthread_t checkpoint_thread;
+bool checkpoint_due;
+pthread_cond_t checkpoint_work = PTHREAD_COND_INITIALIZER;
+// One bit per CHECKPOINT_CHUNK of the image that committed groups changed since it was last written back, guarded
+// by commit_lock, and the chunks the running checkpoint is writing back, only used by the checkpointer
+uint64_t *dirty_chunks;
+uint64_t *flushing_chunks;
+size_t chunk_words;
+
+/*
+ * Grows an array to hold at least wanted items, returns the array or NULL when there is no memory, leaving it as it was
+*/
+void *grow_array(void *items, size_t *capacity, size_t wanted, size_t item_size) {
+	if (items != NULL && wanted <= *capacity) {
+		return items;
+	}
+	size_t grown = *capacity > 0 ? *capacity : 64;
+	while (grown < wanted) {
+		grown *= 2;
+	}
+	items = realloc(items, grown * item_size);
+	if (items != NULL) {
+		*capacity = grown;
+	}
+	return items;
+}
+
+/*
+ * Adds the current contents of a range of the image to the operation of this thread
+*/
+void journal_range(const void *addr, size_t length) {
+	JournalOp *op = &journal_op;
+	size_t size = sizeof(JournalRecord) + ((length + 7) & ~(size_t) 7);
+	char *records = grow_array(op->records, &op->capacity, op->length + size, 1);
+	if (records == NULL) {
+		op->incomplete = true;
+		return;
+	}
+	op->records = records;
+	JournalRecord *record = (JournalRecord *) (records + op->length);
+	record->offset = (const char *) addr - image;
+	record->length = length;
+	memcpy(record + 1, addr, length);
+	memset((char *) (record + 1) + length, 0, size - sizeof(JournalRecord) - length);
+	op->length += size;
+}
+
+/*
+ * Journals the attributes and extent map of an inode, the caller holds the inode lock.
+ * The directory entry fields at the end of the record change under the namespace write lock instead,
+ * journal_entry journals them.
+*/
+void journal_inode(int i) {
+	Inode *inode = &filesystem[i];
+	JournalOp *op = &journal_op;
+
+	journal_range(inode, offsetof(Inode, name_length));
+	if (!inode->is_inline && inode->extent_count > INODE_EXTENTS) {
+		journal_range(blocks[inode->indirect].extents, (inode->extent_count - INODE_EXTENTS) * sizeof(Extent));
+	}
+	int *inodes = grow_array(op->inodes, &op->inode_capacity, op->inode_count + 1, sizeof(int));
+	if (inodes == NULL) {
+		op->incomplete = true;
+		return;
+	}
+	op->inodes = inodes;
+	op->inodes[op->inode_count++] = i;
+}
+
+/*
+ * Journals the whole record of an inode whose directory entry changed, the caller holds the namespace write lock
+ * and no inode lock. Its attributes may be changing under an operation on its inode number, so they are copied under its lock.
+*/
+void journal_entry(int i) {
+	pthread_rwlock_rdlock(inode_lock(i));
+	journal_inode(i);
+	pthread_rwlock_unlock(inode_lock(i));
+	journal_range(&filesystem[i].name_length, sizeof(Inode) - offsetof(Inode, name_length));
+}
+
+/*
+ * Journals the inodes of a list, skipping -1
+*/
+void journal_entries(const int *entries, int count) {
+	for (int k = 0; k < count; k++) {
+		if (entries[k] != -1) {
+			journal_entry(entries[k]);
+		}
+	}
+}
+
+/*
+ * Journals an inode just linked into a directory, along with the directory and its new neighbours
+*/
+void journal_links(int i) {
+	int around[] = { i, filesystem[i].parent, filesystem[i].prev_sibling, filesystem[i].next_sibling };
+	journal_entries(around, 4);
+}
+
+/*
+ * Journals the whole blocks of a file covering a range, the caller holds the inode lock.
+ * New blocks are cleared around the data written to them, so the blocks are journaled whole.
+ * Inline contents are part of the inode record.
+*/
+void journal_data(Inode *inode, off_t offset, size_t length) {
+	if (inode->is_inline || length == 0) {
+		return;
+	}
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t end = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int k = find_extent(inode, first);
+	for (k = k < 0 ? -k - 1 : k; k < (int) inode->extent_count; k++) {
+		Extent *e = extent_at(inode, k);
+		if (e->logical >= end) {
+			break;
+		}
+		// A compressed cluster changes as a whole, what unwritten blocks hold does not matter
+		if (e->packed == EXTENT_UNWRITTEN) {
+			continue;
+		}
+		if (e->packed != 0) {
+			journal_range(blocks[e->start].data, (size_t) extent_blocks(e) * BLOCK_SIZE);
+			continue;
+		}
+		uint32_t from = e->logical > first ? e->logical : first;
+		uint32_t to = e->logical + e->length < end ? e->logical + e->length : end;
+		journal_range(blocks[e->start + (from - e->logical)].data, (size_t) (to - from) * BLOCK_SIZE);
+	}
+}
+
+/*
+ * Keeps blocks or a name freed by the operation of this thread until it is committed.
+ * Without memory to remember them they are freed now, and the operation is checkpointed before anything
+ * that reuses them can be committed.
+*/
+void defer_free(bool is_name, uint32_t start, uint32_t count) {
+	JournalOp *op = &journal_op;
+	DeferredFree *frees = grow_array(op->frees, &op->free_capacity, op->free_count + 1, sizeof(DeferredFree));
+	if (frees == NULL) {
+		op->incomplete = true;
+		if (is_name) {
+			push_free_name(start, count);
+		} else {
+			release_blocks(start, count);
+		}
+		return;
+	}
+	op->frees = frees;
+	op->frees[op->free_count++] = (DeferredFree) { is_name, start, count };
+}
+
+/*
+ * Frees the arena space of a name once the operation is committed, the caller holds the namespace write lock
+*/
+void release_name(uint32_t offset, size_t length) {
+	defer_free(true, offset, NAME_GRANULES(length));
+}
+
+/*
+ * Puts the names freed by committed operations on the free name lists, the caller holds the namespace write lock
+*/
+void reuse_freed_names() {
+	if (__atomic_load_n(&ready_name_count, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	for (size_t k = 0; k < ready_name_count; k++) {
+		push_free_name(ready_names[k].start, ready_names[k].count);
+	}
+	__atomic_store_n(&ready_name_count, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+ * Appends the operation of this thread to the pending group, ending it.
+ * Callers end an operation while they still hold its locks, so an inode changed by two operations
+ * has them in the journal in the order they happened.
+*/
+void journal_end() {
+	JournalOp *op = &journal_op;
+	if (op->length == 0 && op->free_count == 0 && !op->incomplete) {
+		op->inode_count = 0;
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	// An operation far ahead of the disk waits for the commit thread, so the pending group stays bounded
+	while (journal_running && pending_length >= JOURNAL_PENDING_MAX && journal_error == 0) {
+		sync_wanted = true;
+		pthread_cond_signal(&journal_work);
+		pthread_cond_wait(&journal_done, &journal_lock);
+	}
+	char *group = grow_array(pending, &pending_capacity, sizeof(JournalGroup) + pending_length + op->length, 1);
+	DeferredFree *frees = grow_array(pending_frees, &pending_free_capacity, pending_free_count + op->free_count, sizeof(DeferredFree));
+	if (group != NULL) {
+		pending = group;
+		if (op->length > 0) {
+			memcpy(pending + sizeof(JournalGroup) + pending_length, op->records, op->length);
+			pending_length += op->length;
+		}
+	}
+	if (frees != NULL) {
+		pending_frees = frees;
+		if (op->free_count > 0) {
+			memcpy(pending_frees + pending_free_count, op->frees, op->free_count * sizeof(DeferredFree));
+			pending_free_count += op->free_count;
+		}
+	}
+	bool incomplete = op->incomplete || group == NULL || frees == NULL;
+	uint64_t sequence = ++journal_last;
+	for (size_t k = 0; k < op->inode_count; k++) {
+		__atomic_store_n(&inode_state[op->inodes[k]].journal_sequence, sequence, __ATOMIC_SEQ_CST);
+	}
+	if (incomplete) {
+		checkpoint_wanted = true;
+		pthread_cond_signal(&journal_work);
+	} else if (options.commit_interval <= 0) {
+		pthread_cond_signal(&journal_work);
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	// Frees that could not be kept back are released now, the checkpoint covers them
+	if (frees == NULL) {
+		for (size_t k = 0; k < op->free_count; k++) {
+			if (op->frees[k].is_name) {
+				push_free_name(op->frees[k].start, op->frees[k].count);
+			} else {
+				release_blocks(op->frees[k].start, op->frees[k].count);
+			}
+		}
+	}
+	op->length = 0;
+	op->inode_count = 0;
+	op->free_count = 0;
+	op->incomplete = false;
+	if (incomplete) {
+		journal_wait(sequence);
+	}
+}
+
+/*
+ * Waits until the journal operation with a sequence number is durable.
+ * Returns 0, or the error of a commit that could not be written.
+*/
+int journal_wait(uint64_t sequence) {
+	pthread_mutex_lock(&journal_lock);
+	while (journal_running && journal_durable < sequence && journal_error == 0) {
+		sync_wanted = true;
+		pthread_cond_signal(&journal_work);
+		pthread_cond_wait(&journal_done, &journal_lock);
+	}
+	int res = journal_error;
+	pthread_mutex_unlock(&journal_lock);
+	return res;
+}
+
+/*
+ * Checksums a group, from the field after the checksum to the end of its records
+*/
+uint32_t group_checksum(JournalGroup *header) {
+	size_t skip = offsetof(JournalGroup, image_id);
+	return ~crc32c_kernel(~0u, (char *) header + skip, sizeof(JournalGroup) - skip + header->length);
+}
+
+/*
+ * Writes a group to the end of the journal and waits until it is on disk, the caller holds commit_lock
+*/
+int write_group(char *group, size_t length) {
+	JournalGroup *header = (JournalGroup *) group;
+	header->magic = JOURNAL_MAGIC;
+	header->image_id = super->image_id;
+	header->length = length;
+	header->checksum = group_checksum(header);
+
+	size_t size = sizeof(JournalGroup) + length;
+	size_t written = 0;
+	while (written < size) {
+		ssize_t res = pwrite(journal_fd, group + written, size - written, journal_size + written);
+		if (res < 0) {
+			return -errno;
+		}
+		written += res;
+	}
+	if (fdatasync(journal_fd) < 0) {
+		return -errno;
+	}
+	journal_size += size;
+	return 0;
+}
+
+/*
+ * Makes the image durable as it is now and empties the journal, the caller holds commit_lock.
+ * Operations appended up to now are all in the image, so their records are no longer needed.
+*/
+int checkpoint_image() {
+	if (msync(image, image_size, MS_SYNC) < 0) {
+		return -errno;
+	}
+	if (ftruncate(journal_fd, 0) < 0 || fsync(journal_fd) < 0) {
+		return -errno;
+	}
+	journal_size = 0;
+	journal_epoch++;
+	memset(dirty_chunks, 0, chunk_words * sizeof(uint64_t));
+	return 0;
+}
+
+/*
+ * Notes the chunks of the image changed by the records of a group that was just committed, the caller holds commit_lock
+*/
+void mark_dirty_chunks(char *group, size_t length) {
+	size_t pos = sizeof(JournalGroup);
+	while (pos < sizeof(JournalGroup) + length) {
+		JournalRecord *record = (JournalRecord *) (group + pos);
+		if (record->length > 0) {
+			size_t last = (record->offset + record->length - 1) / CHECKPOINT_CHUNK;
+			for (size_t c = record->offset / CHECKPOINT_CHUNK; c <= last; c++) {
+				dirty_chunks[c / 64] |= 1ULL << (c % 64);
+			}
+		}
+		pos += sizeof(JournalRecord) + ((record->length + 7) & ~(uint64_t) 7);
+	}
+}
+
+/*
+ * Commits everything appended so far: writes the pending group to the journal, or checkpoints the image
+ * when that was asked for, the journal is full or it cannot be written. Then releases what the committed
+ * operations freed and wakes everyone waiting.
+*/
+int commit_group() {
+	pthread_mutex_lock(&commit_lock);
+	pthread_mutex_lock(&journal_lock);
+	char *group = pending;
+	size_t length = pending_length;
+	size_t capacity = pending_capacity;
+	DeferredFree *frees = pending_frees;
+	size_t free_count = pending_free_count;
+	size_t free_capacity = pending_free_capacity;
+	pending = committing;
+	pending_capacity = committing_capacity;
+	pending_length = 0;
+	pending_frees = committing_frees;
+	pending_free_capacity = committing_free_capacity;
+	pending_free_count = 0;
+	uint64_t sequence = journal_last;
+	bool checkpoint = checkpoint_wanted || journal_size + (off_t) (sizeof(JournalGroup) + length) > JOURNAL_MAX_SIZE;
+	checkpoint_wanted = false;
+	sync_wanted = false;
+	pthread_mutex_unlock(&journal_lock);
+
+	int res = 0;
+	if (!checkpoint && length > 0) {
+		if (write_group(group, length) < 0) {
+			checkpoint = true;
+		} else {
+			mark_dirty_chunks(group, length);
+		}
+	}
+	if (checkpoint) {
+		res = checkpoint_image();
+	}
+	if (res == 0) {
+		pthread_mutex_lock(&alloc_lock);
+		for (size_t k = 0; k < free_count; k++) {
+			if (!frees[k].is_name) {
+				drop_blocks(frees[k].start, frees[k].count);
+			}
+		}
+		pthread_mutex_unlock(&alloc_lock);
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	if (res == 0) {
+		for (size_t k = 0; k < free_count; k++) {
+			if (!frees[k].is_name) {
+				continue;
+			}
+			// A name that cannot be listed stays unused until the arena is rebuilt
+			DeferredFree *names = grow_array(ready_names, &ready_name_capacity, ready_name_count + 1, sizeof(DeferredFree));
+			if (names != NULL) {
+				ready_names = names;
+				ready_names[ready_name_count] = frees[k];
+				__atomic_store_n(&ready_name_count, ready_name_count + 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		journal_durable = sequence;
+		if (journal_size >= JOURNAL_CHECKPOINT_SIZE && !checkpoint_due) {
+			checkpoint_due = true;
+			pthread_cond_signal(&checkpoint_work);
+		}
+	} else {
+		fprintf(stderr, "Error committing the journal: %s\n", strerror(-res));
+		journal_error = res;
+	}
+	pthread_cond_broadcast(&journal_done);
+	pthread_mutex_unlock(&journal_lock);
+
+	committing = group;
+	committing_capacity = capacity;
+	committing_frees = frees;
+	committing_free_capacity = free_capacity;
+	pthread_mutex_unlock(&commit_lock);
+	return res;
+}
+
+/*
+ * Returns the time a number of seconds from now, for timed waits
+*/
+struct timespec deadline_after(double seconds) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	double end = deadline.tv_sec + deadline.tv_nsec / 1e9 + seconds;
+	deadline.tv_sec = (time_t) end;
+	deadline.tv_nsec = (long) ((end - deadline.tv_sec) * 1e9);
+	return deadline;
+}
+
+/*
+ * The commit thread, commits the pending group every commit interval, or as soon as someone waits for it
+*/
+void *journal_main(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&journal_lock);
+	while (!journal_stopping) {
+		if (options.commit_interval > 0) {
+			struct timespec deadline = deadline_after(options.commit_interval);
+			while (!sync_wanted && !checkpoint_wanted && !journal_stopping) {
+				if (pthread_cond_timedwait(&journal_work, &journal_lock, &deadline) == ETIMEDOUT) {
+					break;
+				}
+			}
+		} else {
+			while (pending_length == 0 && !sync_wanted && !checkpoint_wanted && !journal_stopping) {
+				pthread_cond_wait(&journal_work, &journal_lock);
+			}
+		}
+		if (journal_stopping || (journal_durable == journal_last && !checkpoint_wanted)) {
+			sync_wanted = false;
+			continue;
+		}
+		pthread_mutex_unlock(&journal_lock);
+		commit_group();
+		pthread_mutex_lock(&journal_lock);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return NULL;
+}
+
+/*
+ * Writes back the chunks of the image in flushing_chunks and makes them durable.
+ * The chunks are written one at a time, waiting for each, so the disk never queues a burst that holds up
+ * the commits of the journal.
+*/
+int write_back_chunks() {
+	for (size_t w = 0; w < chunk_words; w++) {
+		uint64_t bits = flushing_chunks[w];
+		while (bits != 0) {
+			size_t c = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			off_t at = (off_t) c * CHECKPOINT_CHUNK;
+			size_t length = image_size - at < CHECKPOINT_CHUNK ? image_size - at : CHECKPOINT_CHUNK;
+			if (sync_file_range(image_fd, at, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+								SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+				return -errno;
+			}
+		}
+	}
+	// Writes what changed since and flushes the disk cache, the chunks are only durable after this
+	if (fdatasync(image_fd) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Copies the bytes of the journal from one offset up to another into a new journal, which starts at offset base
+*/
+int copy_journal(int to, off_t from, off_t end, off_t base) {
+	char *buffer = malloc(CHECKPOINT_CHUNK);
+	if (buffer == NULL) {
+		return -ENOMEM;
+	}
+	int res = 0;
+	while (from < end) {
+		size_t length = end - from < CHECKPOINT_CHUNK ? end - from : CHECKPOINT_CHUNK;
+		ssize_t got = pread(journal_fd, buffer, length, from);
+		if (got <= 0) {
+			res = got < 0 ? -errno : -EIO;
+			break;
+		}
+		ssize_t done = 0;
+		while (done < got) {
+			ssize_t put = pwrite(to, buffer + done, got - done, from - base + done);
+			if (put < 0) {
+				res = -errno;
+				break;
+			}
+			done += put;
+		}
+		if (res < 0) {
+			break;
+		}
+		from += got;
+	}
+	free(buffer);
+	return res;
+}
+
+/*
+ * Makes a rename in the directory of the journal durable
+*/
+int sync_journal_directory() {
+	int fd = open(".", O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return -errno;
+	}
+	int res = fsync(fd) < 0 ? -errno : 0;
+	close(fd);
+	return res;
+}
+
+/*
+ * Replaces the journal with one holding only the groups from start on, once the image holds everything before them.
+ * The groups are copied to JOURNAL_NEW_FILE, the bulk of them without commit_lock so commits go on meanwhile,
+ * then the groups committed since are copied and the new journal renamed over the old one under it.
+ * A crash leaves either journal in place, each holding every group committed up to then.
+ * Returns 0, -EAGAIN when a checkpoint emptied the journal in the meantime, or another error.
+*/
+int trim_journal(off_t start, uint64_t epoch) {
+	int fd = open(JOURNAL_NEW_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	pthread_mutex_lock(&commit_lock);
+	off_t end = journal_size;
+	pthread_mutex_unlock(&commit_lock);
+	int res = copy_journal(fd, start, end, start);
+	if (res == 0 && fdatasync(fd) < 0) {
+		res = -errno;
+	}
+
+	pthread_mutex_lock(&commit_lock);
+	if (res == 0 && journal_epoch != epoch) {
+		res = -EAGAIN;
+	}
+	if (res == 0) {
+		res = copy_journal(fd, end, journal_size, start);
+	}
+	if (res == 0 && (fdatasync(fd) < 0 || rename(JOURNAL_NEW_FILE, JOURNAL_FILE) < 0)) {
+		res = -errno;
+	}
+	if (res == 0) {
+		close(journal_fd);
+		journal_fd = fd;
+		journal_size -= start;
+		journal_epoch++;
+		res = sync_journal_directory();
+	}
+	pthread_mutex_unlock(&commit_lock);
+	if (fd != journal_fd) {
+		close(fd);
+		unlink(JOURNAL_NEW_FILE);
+	}
+	return res;
+}
+
+/*
+ * Writes back the parts of the image that the groups committed so far changed, then drops those groups from the journal.
+ * Commits go on while it runs, their changes are left for the next checkpoint.
+*/
+int background_checkpoint() {
+	pthread_mutex_lock(&commit_lock);
+	off_t start = journal_size;
+	uint64_t epoch = journal_epoch;
+	memcpy(flushing_chunks, dirty_chunks, chunk_words * sizeof(uint64_t));
+	memset(dirty_chunks, 0, chunk_words * sizeof(uint64_t));
+	pthread_mutex_unlock(&commit_lock);
+	if (start == 0) {
+		return 0;
+	}
+
+	// The superblock holds the inode count that replay starts from
+	flushing_chunks[0] |= 1;
+	int res = write_back_chunks();
+	if (res < 0) {
+		// The chunks are written back by the next checkpoint instead, the journal still covers them
+		pthread_mutex_lock(&commit_lock);
+		for (size_t w = 0; w < chunk_words; w++) {
+			dirty_chunks[w] |= flushing_chunks[w];
+		}
+		pthread_mutex_unlock(&commit_lock);
+		return res;
+	}
+	res = trim_journal(start, epoch);
+	return res == -EAGAIN ? 0 : res;
+}
+
+/*
+ * The checkpointer thread, checkpoints every checkpoint interval, or when the journal grows past JOURNAL_CHECKPOINT_SIZE
+*/
+void *checkpoint_main(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&journal_lock);
+	while (!journal_stopping) {
+		struct timespec deadline = deadline_after(options.checkpoint_interval);
+		while (!checkpoint_due && !journal_stopping) {
+			if (options.checkpoint_interval <= 0) {
+				pthread_cond_wait(&checkpoint_work, &journal_lock);
+			} else if (pthread_cond_timedwait(&checkpoint_work, &journal_lock, &deadline) == ETIMEDOUT) {
+				break;
+			}
+		}
+		if (journal_stopping) {
+			break;
+		}
+		checkpoint_due = false;
+		pthread_mutex_unlock(&journal_lock);
+		int res = background_checkpoint();
+		if (res < 0) {
+			fprintf(stderr, "Error checkpointing the image: %s\n", strerror(-res));
+		}
+		pthread_mutex_lock(&journal_lock);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return NULL;
+}
+
+/*
+ * Opens the journal next to the image, it is replayed before anything else touches the image.
+ * A new journal left over by a checkpoint that did not finish is not needed, the old one is still complete.
+*/
+int open_journal(const char *filename) {
+	unlink(JOURNAL_NEW_FILE);
+	chunk_words = ((image_size + CHECKPOINT_CHUNK - 1) / CHECKPOINT_CHUNK + 63) / 64;
+	dirty_chunks = calloc(chunk_words, sizeof(uint64_t));
+	flushing_chunks = calloc(chunk_words, sizeof(uint64_t));
+	if (dirty_chunks == NULL || flushing_chunks == NULL) {
+		return -ENOMEM;
+	}
+	journal_fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (journal_fd < 0) {
+		perror("Error opening the journal\n");
+		return -errno;
+	}
+	struct stat st;
+	if (fstat(journal_fd, &st) < 0) {
+		return -errno;
+	}
+	journal_size = st.st_size;
+	return 0;
+}
+
+/*
+ * Closes the journal at unmount, after the last checkpoint emptied it
+*/
+void close_journal() {
+	close(journal_fd);
+	journal_fd = -1;
+	free(dirty_chunks);
+	free(flushing_chunks);
+	dirty_chunks = NULL;
+	flushing_chunks = NULL;
+}
+
+/*
+ * Copies the committed groups in the journal back over the image, in the order they were committed.
+ * Replay stops at the first group that is torn or fails its checksum, no operation after it was reported durable.
+ * Returns the number of groups replayed.
+*/
+int replay_journal() {
+	int groups = 0;
+	off_t at = 0;
+	JournalGroup header;
+	while (pread(journal_fd, &header, sizeof(header), at) == sizeof(header) && header.magic == JOURNAL_MAGIC &&
+		   header.image_id == super->image_id && header.length <= (uint64_t) (journal_size - at - sizeof(header))) {
+		char *group = malloc(sizeof(header) + header.length);
+		if (group == NULL) {
+			perror("Error replaying the journal\n");
+			exit(1);
+		}
+		memcpy(group, &header, sizeof(header));
+		if (pread(journal_fd, group + sizeof(header), header.length, at + sizeof(header)) != (ssize_t) header.length ||
+			group_checksum((JournalGroup *) group) != header.checksum) {
+			free(group);
+			break;
+		}
+		// Records stay inside the image and off the superblock, whose counts are rebuilt
+		size_t pos = sizeof(header);
+		while (pos + sizeof(JournalRecord) <= sizeof(header) + header.length) {
+			JournalRecord *record = (JournalRecord *) (group + pos);
+			size_t size = sizeof(JournalRecord) + ((record->length + 7) & ~(uint64_t) 7);
+			if (record->offset < IMAGE_ALIGN(sizeof(Superblock)) || record->offset > image_size ||
+				record->length > image_size - record->offset || size > sizeof(header) + header.length - pos) {
+				break;
+			}
+			memcpy(image + record->offset, record + 1, record->length);
+			// Inodes past the end of the table were handed out by the operations replayed
+			char *table = (char *) filesystem;
+			if (image + record->offset >= table && image + record->offset < table + (size_t) MAX_INODES * sizeof(Inode)) {
+				int i = (image + record->offset - table) / sizeof(Inode);
+				if (i >= super->inode_count) {
+					super->inode_count = i + 1;
+				}
+			}
+			pos += size;
+		}
+		free(group);
+		at += sizeof(header) + header.length;
+		groups++;
+	}
+	return groups;
+}
+
+/*
+ * Starts the commit thread and the checkpointer, with nothing committed or pending yet
+*/
+void start_journal() {
+	journal_stopping = false;
+	journal_error = 0;
+	journal_last = 0;
+	journal_durable = 0;
+	checkpoint_due = false;
+	journal_running = pthread_create(&journal_thread, NULL, journal_main, NULL) == 0;
+	if (!journal_running || pthread_create(&checkpoint_thread, NULL, checkpoint_main, NULL) != 0) {
+		perror("Error starting the commit thread\n");
+		exit(1);
+	}
+}
+
+/*
+ * Stops the commit thread and the checkpointer, whatever is still pending is left for the caller to commit
+*/
+void stop_journal() {
+	if (!journal_running) {
+		return;
+	}
+	pthread_mutex_lock(&journal_lock);
+	journal_stopping = true;
+	pthread_cond_signal(&journal_work);
+	pthread_cond_signal(&checkpoint_work);
+	pthread_mutex_unlock(&journal_lock);
+	pthread_join(journal_thread, NULL);
+	pthread_join(checkpoint_thread, NULL);
+	pthread_mutex_lock(&journal_lock);
+	journal_running = false;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/*
+ * Checkpoints the image right away, committing everything appended so far.
+ * Used at mount and unmount, while the commit thread is not running.
+*/
+int checkpoint_now() {
+	pthread_mutex_lock(&journal_lock);
+	checkpoint_wanted = true;
+	pthread_mutex_unlock(&journal_lock);
+	return commit_group();
+}
+
+
+/*
+ * Statistics file.
+ * /.dm510fs/stats is a read-only file that is not stored anywhere, its text is made from the counters when it is
+ * opened. Its directory and the file take the inode numbers past the end of the table, and are not listed in the root.
+ * The file has no size, it is opened for direct I/O so the kernel reads it up to the end of the text all the same.
+*/
+
+/*
+ * Whether an inode index is one of the statistics entries
+*/
+bool is_virtual(int i) {
+	return i >= MAX_INODES;
+}
+
+/*
+ * Returns the statistics entry a name in a directory refers to, -ENOENT for other names in the statistics
+ * directory, -ENOTDIR under the statistics file, or -1 when the name is an ordinary one
+*/
+int lookup_virtual(int parent, const char *name) {
+	if (parent == 0 && strcmp(name, STATS_DIR_NAME) == 0) {
+		return STATS_DIR;
+	}
+	if (parent == STATS_DIR) {
+		return strcmp(name, STATS_FILE_NAME) == 0 ? STATS_FILE : -ENOENT;
+	}
+	return parent == STATS_FILE ? -ENOTDIR : -1;
+}
+
+/*
+ * Returns the statistics entry of a path, or -1 when the path is an ordinary one
+*/
+int lookup_virtual_path(const char *path) {
+	if (path == NULL || strncmp(path, "/" STATS_DIR_NAME, strlen(STATS_DIR_NAME) + 1) != 0) {
+		return -1;
+	}
+	const char *rest = path + strlen(STATS_DIR_NAME) + 1;
+	if (*rest == '\0') {
+		return STATS_DIR;
+	}
+	if (*rest != '/') {
+		return -1;
+	}
+	return strcmp(rest + 1, STATS_FILE_NAME) == 0 ? STATS_FILE : -ENOENT;
+}
 
-	for (int i = 0; i< length; i++){
-		char c = text[i];
-		
-		
-		// Encrypt uppercase letters
-        if (c >= 'A' && c <= 'Z') {
-            text[i] = ((c - 'A' + shift) % 26) + 'A';
-        }
-        
-		// Encrypt lowercase letters
-        else if (c >= 'a' && c <= 'z') {
-            text[i] = ((c - 'a' + shift) % 26) + 'a';
-        }
+/*
+ * Returns the statistics entry an operation works on, from its open handle or its path, or -1 for ordinary files
+*/
+int virtual_entry(const char *path, struct fuse_file_info *fi) {
+	FileHandle *fh = get_handle(fi);
+	if (fh != NULL) {
+		return is_virtual(fh->inode) ? fh->inode : -1;
+	}
+	return lookup_virtual_path(path);
+}
 
+/*
+ * Fills in the attributes of a statistics entry
+*/
+void stat_virtual(int i, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = INODE_NUMBER(i);
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_mode = i == STATS_DIR ? S_IFDIR | 0555 : S_IFREG | 0444;
+	stbuf->st_nlink = i == STATS_DIR ? 2 : 1;
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+}
+
+/*
+ * Sums one counter over the stripes
+*/
+uint64_t sum_stripes(const uint64_t *first, size_t stride) {
+	uint64_t total = 0;
+	for (int s = 0; s < COUNTER_STRIPES; s++) {
+		total += __atomic_load_n((const uint64_t *) ((const char *) first + s * stride), __ATOMIC_RELAXED);
 	}
+	return total;
 }
 
 /*
- * Caesar decryption of file contents
-*/ 
-void decryptCaesarCypher(char *text, int length){
-	for(int i = 0; i< length; i++){
-		char c = text[i];
+ * Upper bound in microseconds of the latency bucket holding the given fraction of the calls counted in latency
+*/
+double latency_percentile(const uint64_t *latency, uint64_t calls, double fraction) {
+	uint64_t seen = 0;
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		seen += latency[b];
+		if (seen > 0 && seen >= fraction * calls) {
+			return (double) (1ULL << b) / 1000;
+		}
+	}
+	return (double) (1ULL << (LATENCY_BUCKETS - 1)) / 1000;
+}
 
-		// Decrypt uppercase
-		if (c >= 'A' && c <= 'Z') {
-			text[i] = ((c - 'A' - shift) % 26) + 'A';
+/*
+ * Writes the statistics text, returns its length, or -ENOMEM.
+ * The counters are read while operations go on, so they may be a few operations apart.
+*/
+ssize_t format_stats(char **text) {
+	size_t length;
+	FILE *out = open_memstream(text, &length);
+	if (out == NULL) {
+		return -ENOMEM;
+	}
+	// Rates are over the time since the mount
+	double seconds = (double) (monotonic_ns() - ((uint64_t) trace_start.tv_sec * 1000000000 + trace_start.tv_nsec)) / 1e9;
+	fprintf(out, "mounted_s %.3f\n\n", seconds);
+	fprintf(out, "%-12s %12s %12s %16s %12s %10s %10s %10s %10s\n", "operation", "calls", "ops_per_s", "bytes", "total_ms",
+			"avg_us", "p50_us", "p99_us", "p999_us");
+	for (int op = 0; op < OP_COUNT; op++) {
+		OpCounters total;
+		size_t stride = sizeof(OpStripe);
+		total.calls = sum_stripes(&op_stripes[0].ops[op].calls, stride);
+		total.bytes = sum_stripes(&op_stripes[0].ops[op].bytes, stride);
+		total.nanoseconds = sum_stripes(&op_stripes[0].ops[op].nanoseconds, stride);
+		for (int b = 0; b < LATENCY_BUCKETS; b++) {
+			total.latency[b] = sum_stripes(&op_stripes[0].ops[op].latency[b], stride);
+		}
+		if (total.calls == 0) {
+			continue;
 		}
+		fprintf(out, "%-12s %12llu %12.0f %16llu %12.3f %10.3f %10.3f %10.3f %10.3f\n", op_names[op], (unsigned long long) total.calls,
+				seconds > 0 ? total.calls / seconds : 0.0, (unsigned long long) total.bytes, (double) total.nanoseconds / 1e6,
+				(double) total.nanoseconds / total.calls / 1e3, latency_percentile(total.latency, total.calls, 0.5),
+				latency_percentile(total.latency, total.calls, 0.99), latency_percentile(total.latency, total.calls, 0.999));
+	}
+	// Histograms, each bucket is named after the latency it counts operations below
+	fprintf(out, "\nlatency histograms, calls per bucket, bucket <N counts calls faster than N and at least N/2\n");
+	for (int op = 0; op < OP_COUNT; op++) {
+		bool any = false;
+		for (int b = 0; b < LATENCY_BUCKETS; b++) {
+			uint64_t calls = sum_stripes(&op_stripes[0].ops[op].latency[b], sizeof(OpStripe));
+			if (calls == 0) {
+				continue;
+			}
+			if (!any) {
+				fprintf(out, "%-12s", op_names[op]);
+				any = true;
+			}
+			uint64_t bound = 1ULL << b;
+			const char *unit = bound >= 1000000000 ? "s" : bound >= 1000000 ? "ms" : bound >= 1000 ? "us" : "ns";
+			uint64_t scale = bound >= 1000000000 ? 1000000000 : bound >= 1000000 ? 1000000 : bound >= 1000 ? 1000 : 1;
+			fprintf(out, " %s%llu%s:%llu", b == LATENCY_BUCKETS - 1 ? ">=" : "<", (unsigned long long) (bound / scale), unit,
+					(unsigned long long) calls);
+		}
+		if (any) {
+			fprintf(out, "\n");
+		}
+	}
 
-		// Decrypt lowercase letters
-        else if (c >= 'a' && c <= 'z') {
-            text[i] = ((c - 'a' - shift) % 26) + 'a';
+	fprintf(out, "\ncache\n");
+	size_t stride = sizeof(CacheCounters);
+	fprintf(out, "  budget_chunks %u\n  resident_chunks %u\n  hot_chunks %u\n", cache_budget,
+			__atomic_load_n(&cache_resident, __ATOMIC_RELAXED), __atomic_load_n(&cache_hot, __ATOMIC_RELAXED));
+	fprintf(out, "  hits %llu\n  misses %llu\n  evictions %llu\n  readahead_chunks %llu\n",
+			(unsigned long long) sum_stripes(&cache_counters[0].hits, stride), (unsigned long long) sum_stripes(&cache_counters[0].misses, stride),
+			(unsigned long long) sum_stripes(&cache_counters[0].evictions, stride), (unsigned long long) sum_stripes(&cache_counters[0].readahead, stride));
 
-        }
+	uint64_t packed = __atomic_load_n(&super->packed_blocks, __ATOMIC_RELAXED);
+	uint64_t stored = __atomic_load_n(&super->packed_stored, __ATOMIC_RELAXED);
+	fprintf(out, "\ncompression\n  blocks_compressed %llu\n  blocks_stored %llu\n  ratio %.2f\n",
+			(unsigned long long) packed, (unsigned long long) stored, stored > 0 ? (double) packed / stored : 1.0);
+	fprintf(out, "\ndedup\n  shared_references %llu\n",
+			(unsigned long long) __atomic_load_n(&super->shared_blocks, __ATOMIC_RELAXED));
+
+	// Counters kept under a lock are read under it, one lock at a time
+	pthread_mutex_lock(&alloc_lock);
+	uint32_t free_blocks = super->free_block_count;
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_mutex_lock(&journal_lock);
+	uint64_t last = journal_last;
+	uint64_t durable = journal_durable;
+	pthread_mutex_unlock(&journal_lock);
+	pthread_mutex_lock(&commit_lock);
+	off_t journal_bytes = journal_size;
+	pthread_mutex_unlock(&commit_lock);
+	fprintf(out, "\nspace\n  free_blocks %u of %u\n  inodes %d of %d\n", free_blocks,
+			BLOCKS_COUNT, __atomic_load_n(&super->used_inodes, __ATOMIC_RELAXED), MAX_INODES);
+	fprintf(out, "\njournal\n  operations %llu\n  durable %llu\n  bytes %lld\n",
+			(unsigned long long) last, (unsigned long long) durable, (long long) journal_bytes);
+	fprintf(out, "\ntrace\n  level %d of %d\n  messages %llu\n  dropped %llu\n", options.trace_level, TRACE_LEVEL,
+			(unsigned long long) __atomic_load_n(&trace_written, __ATOMIC_RELAXED),
+			(unsigned long long) __atomic_load_n(&trace_dropped, __ATOMIC_RELAXED));
+	if (fclose(out) != 0) {
+		free(*text);
+		return -ENOMEM;
 	}
+	return length;
 }
 
 /*
- * Helper function for finding free blocks of data
-*/ 
-int find_free_block() {
-    for (int i = 0; i < BLOCKS_COUNT; i++) {
-        if (blocks[i].is_free) {
-            // Found a free block, return its index
-            return i;
-        }
-    }
-    // No free block found, return -1
-    return -1;
+ * Opens a statistics entry for reading, the file gets the statistics as they are now
+*/
+int open_virtual(int i, struct fuse_file_info *fi, bool is_dir) {
+	if ((i == STATS_DIR) != is_dir) {
+		return is_dir ? -ENOTDIR : -EISDIR;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	FileHandle *fh = calloc(1, sizeof(FileHandle));
+	if (fh == NULL) {
+		return -ENOMEM;
+	}
+	fh->inode = i;
+	fh->dir_next = -1;
+	if (i == STATS_FILE) {
+		ssize_t length = format_stats(&fh->text);
+		if (length < 0) {
+			free(fh);
+			return length;
+		}
+		fh->text_length = length;
+		fi->direct_io = 1;
+	}
+	fi->fh = (uintptr_t) fh;
+	return 0;
 }
 
 /*
- * Helper function for finding amount of blocks needed
-*/ 
-int blocks_needed(size_t size){
-	int sum = 0; 
-	while ( size > BLOCK_SIZE * sum){
-		sum = sum + 1; 
+ * Reads the statistics file, from the text taken when the handle was opened, or from new text without one
+*/
+int read_virtual(FileHandle *fh, char *buf, size_t size, off_t offset) {
+	char *text = fh != NULL ? fh->text : NULL;
+	size_t length = fh != NULL ? fh->text_length : 0;
+	if (fh == NULL) {
+		ssize_t res = format_stats(&text);
+		if (res < 0) {
+			return res;
+		}
+		length = res;
 	}
-	return sum;
+	size_t copied = 0;
+	if ((size_t) offset < length) {
+		copied = length - offset < size ? length - offset : size;
+		memcpy(buf, text + offset, copied);
+	}
+	if (fh == NULL) {
+		free(text);
+	}
+	return copied;
+}
+
+/*
+ * Lists the statistics directory
+*/
+int readdir_virtual(void *buf, fuse_fill_dir_t filler, off_t offset) {
+	struct stat st;
+	if (offset < 1) {
+		stat_virtual(STATS_DIR, &st);
+		if (filler(buf, ".", &st, 1) != 0) {
+			return 0;
+		}
+	}
+	if (offset < 2) {
+		stat_inode(0, &st);
+		if (filler(buf, "..", &st, 2) != 0) {
+			return 0;
+		}
+	}
+	if (offset < 3) {
+		stat_virtual(STATS_FILE, &st);
+		filler(buf, STATS_FILE_NAME, &st, 3);
+	}
+	return 0;
+}
+
+
+/*
+ * Low-level front end.
+ * The kernel refers to inodes by number and keeps a lookup count for each one it has been handed,
+ * an inode is not freed while that count is above zero, so its number cannot be reused under the kernel.
+ * Replies carry the entry and attribute timeouts, so repeated lookups and stats are answered from the kernel caches.
+*/
+
+/*
+ * Hands the kernel a reference to an inode, already counted in its lookup_count, along with an open handle for create.
+ * The reference is dropped again when the reply cannot be delivered.
+*/
+void reply_entry(fuse_req_t req, int i, struct fuse_file_info *fi) {
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = INODE_NUMBER(i);
+	e.attr_timeout = options.attr_timeout;
+	e.entry_timeout = options.entry_timeout;
+	stat_inode(i, &e.attr);
+
+	if (fi == NULL) {
+		if (fuse_reply_entry(req, &e) == -ENOENT) {
+			drop_reference(i, 0, 1);
+		}
+	} else if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+		release_handle(fi);
+		drop_reference(i, 0, 1);
+	}
+}
+
+/*
+ * Replies with the result of an operation that returns 0 or a negative error
+*/
+void reply_result(fuse_req_t req, int res) {
+	fuse_reply_err(req, res < 0 ? -res : 0);
+}
+
+/*
+ * Initialize filesystem
+*/
+void dm510fs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	(void) userdata;
+	dm510fs_init(conn);
+}
+
+/*
+ * Looks up a name in a directory and hands the kernel a reference to its inode.
+ * With a negative timeout, names that do not exist are cached by the kernel as well.
+*/
+void dm510fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	OP_SCOPE(OP_LOOKUP);
+	size_t length = strlen(name);
+	if (length >= MAX_NAME_LENGTH) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	// The statistics entries are never freed, so the kernel's references to them are not counted
+	int v = lookup_virtual(INODE_INDEX(parent), name);
+	if (v != -1) {
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		if (v < 0) {
+			fuse_reply_err(req, -v);
+			return;
+		}
+		e.ino = INODE_NUMBER(v);
+		e.attr_timeout = options.attr_timeout;
+		e.entry_timeout = options.entry_timeout;
+		stat_virtual(v, &e.attr);
+		fuse_reply_entry(req, &e);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&namespace_lock);
+	int i = lookup_child(INODE_INDEX(parent), name, length);
+	if (i != -1) {
+		// Counted under the namespace lock, so unlink cannot free the inode before the reply
+		__atomic_add_fetch(&inode_state[i].lookup_count, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_rwlock_unlock(&namespace_lock);
+
+	if (i != -1) {
+		op_inode(i);
+		reply_entry(req, i, NULL);
+	} else if (options.negative_timeout > 0) {
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = options.negative_timeout;
+		fuse_reply_entry(req, &e);
+	} else {
+		fuse_reply_err(req, ENOENT);
+	}
+}
+
+/*
+ * The kernel drops references to an inode, an unlinked inode is freed with the last one
+*/
+void dm510fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	OP_SCOPE(OP_FORGET);
+	if (!is_virtual(INODE_INDEX(ino))) {
+		drop_reference(INODE_INDEX(ino), 0, nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+/*
+ * Forget for a batch of inodes at once, sent when the kernel evicts many inodes
+*/
+void dm510fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	OP_SCOPE(OP_FORGET);
+	for (size_t k = 0; k < count; k++) {
+		if (!is_virtual(INODE_INDEX(forgets[k].ino))) {
+			drop_reference(INODE_INDEX(forgets[k].ino), 0, forgets[k].nlookup);
+		}
+	}
+	fuse_reply_none(req);
+}
+
+/*
+ * Return file attributes, the kernel may cache them for attr_timeout seconds
+*/
+void dm510fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_GETATTR);
+	(void) fi;
+	struct stat st;
+	op_inode(INODE_INDEX(ino));
+	if (is_virtual(INODE_INDEX(ino))) {
+		stat_virtual(INODE_INDEX(ino), &st);
+	} else {
+		stat_inode(INODE_INDEX(ino), &st);
+	}
+	fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+/*
+ * Changes the size or times of an inode, mode and owner cannot be changed in this filesystem
+*/
+void dm510fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_SETATTR);
+	(void) fi;
+	int i = INODE_INDEX(ino);
+
+	if (is_virtual(i)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		int res = truncate_inode(i, attr->st_size);
+		if (res < 0) {
+			reply_result(req, res);
+			return;
+		}
+	}
+	if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		time_t now = time(NULL);
+		pthread_rwlock_wrlock(inode_lock(i));
+		if (to_set & FUSE_SET_ATTR_ATIME) {
+			filesystem[i].a_time = to_set & FUSE_SET_ATTR_ATIME_NOW ? now : attr->st_atime;
+		}
+		if (to_set & FUSE_SET_ATTR_MTIME) {
+			filesystem[i].m_time = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : attr->st_mtime;
+		}
+		change_inode(&filesystem[i]);
+		journal_inode(i);
+		journal_end();
+		pthread_rwlock_unlock(inode_lock(i));
+	}
+
+	struct stat st;
+	stat_inode(i, &st);
+	fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+/*
+ * Creates an inode in a directory, counting the reference the reply hands to the kernel.
+ * Returns the index of the inode.
+*/
+int ll_make_inode(fuse_ino_t parent, const char *name, mode_t mode, bool is_dir) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int res = make_inode(INODE_INDEX(parent), name, mode, is_dir, 1);
+	pthread_rwlock_unlock(&namespace_lock);
+	return res;
+}
+
+/*
+ * Removes the entry of a name in a directory the kernel holds a reference to
+*/
+int ll_remove_entry(fuse_ino_t parent, const char *name, bool is_dir) {
+	pthread_rwlock_wrlock(&namespace_lock);
+	int res = remove_entry(INODE_INDEX(parent), name, is_dir);
+	pthread_rwlock_unlock(&namespace_lock);
+	return res;
+}
+
+/*
+ * Makes a file
+*/
+void dm510fs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	OP_SCOPE(OP_MKNOD);
+	(void) rdev;
+	int i = ll_make_inode(parent, name, mode | S_IFREG, false);
+	if (i < 0) {
+		reply_result(req, i);
+		return;
+	}
+	reply_entry(req, i, NULL);
+}
+
+/*
+ * Makes a directory
+*/
+void dm510fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	OP_SCOPE(OP_MKDIR);
+	(void) mode;
+	int i = ll_make_inode(parent, name, S_IFDIR | 0755, true);
+	if (i < 0) {
+		reply_result(req, i);
+		return;
+	}
+	reply_entry(req, i, NULL);
+}
+
+/*
+ * Makes and opens a file in one request, instead of a mknod followed by an open
+*/
+void dm510fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_CREATE);
+	int i = ll_make_inode(parent, name, mode | S_IFREG, false);
+	if (i < 0) {
+		reply_result(req, i);
+		return;
+	}
+	int res = open_inode(i, fi, false);
+	if (res < 0) {
+		drop_reference(i, 0, 1);
+		reply_result(req, res);
+		return;
+	}
+	reply_entry(req, i, fi);
+}
+
+/*
+ * Deletes a file, the inode stays until the kernel forgets it
+*/
+void dm510fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	OP_SCOPE(OP_UNLINK);
+	reply_result(req, ll_remove_entry(parent, name, false));
+}
+
+/*
+ * Deletes a directory
+*/
+void dm510fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	OP_SCOPE(OP_RMDIR);
+	reply_result(req, ll_remove_entry(parent, name, true));
+}
+
+/*
+ * Renames an entry, the kernel moves its own cached entries along
+*/
+void dm510fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+	OP_SCOPE(OP_RENAME);
+	pthread_rwlock_wrlock(&namespace_lock);
+	int res = rename_entry(INODE_INDEX(parent), name, INODE_INDEX(newparent), newname, 0);
+	pthread_rwlock_unlock(&namespace_lock);
+	reply_result(req, res);
+}
+
+/*
+ * Open a file
+*/
+void dm510fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_OPEN);
+	int i = INODE_INDEX(ino);
+	op_inode(i);
+	int res = is_virtual(i) ? open_virtual(i, fi, false) : open_inode(i, fi, false);
+	if (res < 0) {
+		reply_result(req, res);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * Open a directory
+*/
+void dm510fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_OPENDIR);
+	int i = INODE_INDEX(ino);
+	op_inode(i);
+	int res = is_virtual(i) ? open_virtual(i, fi, true) : open_inode(i, fi, true);
+	if (res < 0) {
+		reply_result(req, res);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+/*
+ * Read from an open file
+*/
+void dm510fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_READ);
+	int i = INODE_INDEX(ino);
+	op_inode(i);
+	op_offset(off);
+	// Without encryption the reply points into the mapped image, sent while the inode lock keeps the blocks in place
+	if(shift == 0 && !is_virtual(i)){
+		FileHandle *fh = get_handle(fi);
+		ReadRun runs[MAX_READ_RUNS];
+		_Alignas(struct fuse_bufvec) char space[sizeof(struct fuse_bufvec) + (MAX_READ_RUNS - 1) * sizeof(struct fuse_buf)];
+		struct fuse_bufvec *reply = (struct fuse_bufvec *) space;
+		lock_inode_for_read(i);
+		int count = map_read(&filesystem[i], size, off, cache_use(fh, off), runs, MAX_READ_RUNS);
+		if(count >= 0){
+			*reply = (struct fuse_bufvec) FUSE_BUFVEC_INIT(0);
+			reply->count = count > 0 ? count : 1;
+			size_t res = 0;
+			for(int r = 0; r < count; r++){
+				reply->buf[r] = (struct fuse_buf) { .size = runs[r].length, .mem = (void *) (runs[r].data != NULL ? runs[r].data : zero_run) };
+				res += runs[r].length;
+			}
+			fuse_reply_data(req, reply, 0);
+			if(fh != NULL && res > 0 && off == fh->last_offset){
+				cache_readahead(&filesystem[i], fh, off + res);
+			}
+			pthread_rwlock_unlock(inode_lock(i));
+			note_access(fh, off, res);
+			op_bytes(res);
+			return;
+		}
+		pthread_rwlock_unlock(inode_lock(i));
+	}
+	char *buf = malloc(size > 0 ? size : 1);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int res = dm510fs_read(NULL, buf, size, off, fi);
+	if (res < 0) {
+		reply_result(req, res);
+	} else {
+		fuse_reply_buf(req, buf, res);
+	}
+	free(buf);
+}
+
+/*
+ * Write to an open file
+*/
+void dm510fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_WRITE);
+	(void) ino;
+	int res = dm510fs_write(NULL, buf, size, off, fi);
+	if (res < 0) {
+		reply_result(req, res);
+	} else {
+		fuse_reply_write(req, res);
+	}
+}
+
+/*
+ * Write to an open file from a FUSE buffer vector
+*/
+void dm510fs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_WRITE);
+	(void) ino;
+	int res = dm510fs_write_buf(NULL, bufv, off, fi);
+	if (res < 0) {
+		reply_result(req, res);
+	} else {
+		fuse_reply_write(req, res);
+	}
+}
+
+/* Reply buffer filled by dm510fs_readdir through fill_dir_buffer*/
+typedef struct DirBuffer {
+	fuse_req_t req;
+	char *data;
+	size_t size;
+	size_t used;
+} DirBuffer;
+
+/*
+ * Filler for dm510fs_readdir that adds entries to a reply buffer, returns 1 once the next entry does not fit
+*/
+int fill_dir_buffer(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	DirBuffer *b = buf;
+	size_t length = fuse_add_direntry(b->req, b->data + b->used, b->size - b->used, name, stbuf, off);
+	if (length > b->size - b->used) {
+		return 1;
+	}
+	b->used += length;
+	return 0;
+}
+
+/*
+ * List an open directory, as many entries as fit in size bytes starting after offset off
+*/
+void dm510fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_READDIR);
+	(void) ino;
+	DirBuffer b = { req, malloc(size > 0 ? size : 1), size, 0 };
+	if (b.data == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int res = dm510fs_readdir(NULL, &b, fill_dir_buffer, off, fi);
+	if (res < 0) {
+		reply_result(req, res);
+	} else {
+		fuse_reply_buf(req, b.data, b.used);
+	}
+	free(b.data);
+}
+
+/*
+ * Called on each close of an open file
+*/
+void dm510fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FLUSH);
+	(void) ino;
+	reply_result(req, dm510fs_flush(NULL, fi));
+}
+
+/*
+ * Synchronize file contents
+*/
+void dm510fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FSYNC);
+	(void) ino;
+	reply_result(req, dm510fs_fsync(NULL, datasync, fi));
+}
+
+/*
+ * Synchronize an open directory
+*/
+void dm510fs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FSYNCDIR);
+	(void) ino;
+	reply_result(req, dm510fs_fsyncdir(NULL, datasync, fi));
+}
+
+/*
+ * Release an open file or directory
+*/
+void dm510fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_RELEASE);
+	(void) ino;
+	reply_result(req, release_handle(fi));
+}
+
+/*
+ * Allocates space for a range of a file, or punches a hole in it
+*/
+void dm510fs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	OP_SCOPE(OP_FALLOCATE);
+	(void) fi;
+	int i = INODE_INDEX(ino);
+
+	if (is_virtual(i)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	reply_result(req, fallocate_inode(i, mode, offset, length));
+}
+
+/*
+ * Reports filesystem statistics
+*/
+void dm510fs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	OP_SCOPE(OP_STATFS);
+	(void) ino;
+	struct statvfs st;
+	dm510fs_statfs(NULL, &st);
+	fuse_reply_statfs(req, &st);
 }
 
+/*
+ * Mounts the filesystem and serves it through the low-level front end until it is unmounted.
+ * This is what fuse_main does for the high-level API.
+*/
+int run_lowlevel(struct fuse_args *args) {
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+	int err = -1;
 
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+		return 1;
+	}
+	struct fuse_chan *ch = fuse_mount(mountpoint, args);
+	if (ch != NULL) {
+		struct fuse_session *se = fuse_lowlevel_new(args, &dm510fs_ll_oper, sizeof(dm510fs_ll_oper), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				channel = ch;
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				channel = NULL;
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return err ? 1 : 0;
+}
 
+// A driver that calls the callbacks in its own process, like the tests and benchmarks of the Makefile, builds this file
+// with -DDM510FS_NO_MAIN and includes it
+#ifndef DM510FS_NO_MAIN
 int main( int argc, char *argv[] ) {
     if(argc > 1){
-        shift = atoi(argv[argc - 1]); 
+        // Reduce the shift to 0 - 25, so negative shifts work as well
+        shift = ((atoi(argv[argc - 1]) % 26) + 26) % 26; 
     } else {
         printf("Shift value not provided. Using default shift of 0.\n");
         shift = 0;
     }
-	fuse_main( argc-1, argv, &dm510fs_oper );
-	return 0;
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv);
+	if(fuse_opt_parse(&args, &options, dm510fs_opts, NULL) == -1){
+		return 1;
+	}
+	int res;
+	if(options.high_level){
+		// The high-level API reads the cache timeouts itself
+		char timeouts[128];
+		snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%f,attr_timeout=%f,negative_timeout=%f",
+				 options.entry_timeout, options.attr_timeout, options.negative_timeout);
+		fuse_opt_add_arg(&args, timeouts);
+		res = fuse_main( args.argc, args.argv, &dm510fs_oper, NULL );
+	} else {
+		res = run_lowlevel(&args);
+	}
+	fuse_opt_free_args(&args);
+	return res;
 }
+#endif
     
 
     
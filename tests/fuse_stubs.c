@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include "fuse_stubs.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int invalidations;
+
+/*
+ * Clears a request for the next call, freeing the data of its last reply
+*/
+void reset_req(struct fuse_req *req) {
+	free(req->data);
+	memset(req, 0, sizeof(*req));
+}
+
+/*
+ * Stores a copy of reply data in the request
+*/
+static int store_data(fuse_req_t req, const char *data, size_t size) {
+	free(req->data);
+	req->data = malloc(size > 0 ? size : 1);
+	if (req->data == NULL) {
+		return -ENOMEM;
+	}
+	memcpy(req->data, data, size);
+	req->size = size;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_err(fuse_req_t req, int err) {
+	req->err = err;
+	req->replied = 1;
+	return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) {
+	req->replied = 2;
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+	req->entry = *e;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi) {
+	req->entry = *e;
+	req->fi = *fi;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout) {
+	(void) attr_timeout;
+	req->attr = *attr;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+	req->fi = *fi;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+	req->size = count;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) {
+	return store_data(req, buf, size);
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags) {
+	size_t size = fuse_buf_size(bufv);
+	free(req->data);
+	req->data = malloc(size > 0 ? size : 1);
+	if (req->data == NULL) {
+		return fuse_reply_err(req, ENOMEM);
+	}
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = req->data;
+	ssize_t copied = fuse_buf_copy(&dst, bufv, flags);
+	if (copied < 0) {
+		return fuse_reply_err(req, (int) -copied);
+	}
+	req->size = copied;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+int fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf) {
+	req->statfs = *stbuf;
+	req->err = 0;
+	req->replied = 1;
+	return 0;
+}
+
+/*
+ * Adds a directory entry in the layout the kernel reads: inode, offset, name length, type, then the name padded to 8 bytes
+*/
+size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize, const char *name, const struct stat *stbuf, off_t off) {
+	(void) req;
+	size_t length = strlen(name);
+	size_t size = (24 + length + 7) & ~(size_t) 7;
+	if (buf == NULL || size > bufsize) {
+		return size;
+	}
+	uint64_t ino = stbuf->st_ino;
+	uint64_t next = off;
+	uint32_t namelen = length;
+	uint32_t type = (stbuf->st_mode & S_IFMT) >> 12;
+	memset(buf, 0, size);
+	memcpy(buf, &ino, 8);
+	memcpy(buf + 8, &next, 8);
+	memcpy(buf + 16, &namelen, 4);
+	memcpy(buf + 20, &type, 4);
+	memcpy(buf + 24, name, length);
+	return size;
+}
+
+size_t fuse_buf_size(const struct fuse_bufvec *bufv) {
+	size_t size = 0;
+	for (size_t k = bufv->idx; k < bufv->count; k++) {
+		size += bufv->buf[k].size;
+	}
+	return size - bufv->off;
+}
+
+/*
+ * Copies between the memory or file descriptors of two buffers, at their positions when FUSE_BUF_FD_SEEK is set
+*/
+static ssize_t copy_buf(const struct fuse_buf *dst, size_t dst_off, const struct fuse_buf *src, size_t src_off, size_t length) {
+	if (!(dst->flags & FUSE_BUF_IS_FD) && !(src->flags & FUSE_BUF_IS_FD)) {
+		memmove((char *) dst->mem + dst_off, (const char *) src->mem + src_off, length);
+		return length;
+	}
+	if (!(dst->flags & FUSE_BUF_IS_FD)) {
+		return src->flags & FUSE_BUF_FD_SEEK ? pread(src->fd, (char *) dst->mem + dst_off, length, src->pos + src_off)
+											 : read(src->fd, (char *) dst->mem + dst_off, length);
+	}
+	if (!(src->flags & FUSE_BUF_IS_FD)) {
+		return dst->flags & FUSE_BUF_FD_SEEK ? pwrite(dst->fd, (const char *) src->mem + src_off, length, dst->pos + dst_off)
+											 : write(dst->fd, (const char *) src->mem + src_off, length);
+	}
+	char bounce[65536];
+	size_t chunk = length < sizeof(bounce) ? length : sizeof(bounce);
+	struct fuse_buf mem = { .size = chunk, .mem = bounce };
+	ssize_t got = copy_buf(&mem, 0, src, src_off, chunk);
+	return got <= 0 ? got : copy_buf(dst, dst_off, &mem, 0, got);
+}
+
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src, enum fuse_buf_copy_flags flags) {
+	(void) flags;
+	ssize_t copied = 0;
+	while (dst->idx < dst->count && src->idx < src->count) {
+		const struct fuse_buf *d = &dst->buf[dst->idx];
+		const struct fuse_buf *s = &src->buf[src->idx];
+		size_t length = d->size - dst->off < s->size - src->off ? d->size - dst->off : s->size - src->off;
+		ssize_t res = length > 0 ? copy_buf(d, dst->off, s, src->off, length) : 0;
+		if (res < 0) {
+			return copied > 0 ? copied : -errno;
+		}
+		copied += res;
+		dst->off += res;
+		src->off += res;
+		if (dst->off == d->size) {
+			dst->idx++;
+			dst->off = 0;
+		}
+		if (src->off == s->size) {
+			src->idx++;
+			src->off = 0;
+		}
+		if ((size_t) res < length) {
+			break;
+		}
+	}
+	return copied;
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino, off_t off, off_t len) {
+	(void) ch;
+	(void) ino;
+	(void) off;
+	(void) len;
+	invalidations++;
+	return 0;
+}
+
+// Nothing is mounted in process, the rest of libfuse does nothing
+
+int fuse_main_real(int argc, char *argv[], const struct fuse_operations *op, size_t op_size, void *user_data) {
+	(void) argc;
+	(void) argv;
+	(void) op;
+	(void) op_size;
+	(void) user_data;
+	return 1;
+}
+
+int fuse_opt_parse(struct fuse_args *args, void *data, const struct fuse_opt opts[], fuse_opt_proc_t proc) {
+	(void) args;
+	(void) data;
+	(void) opts;
+	(void) proc;
+	return 0;
+}
+
+int fuse_opt_add_arg(struct fuse_args *args, const char *arg) {
+	(void) args;
+	(void) arg;
+	return 0;
+}
+
+void fuse_opt_free_args(struct fuse_args *args) {
+	(void) args;
+}
+
+int fuse_parse_cmdline(struct fuse_args *args, char **mountpoint, int *multithreaded, int *foreground) {
+	(void) args;
+	(void) mountpoint;
+	(void) multithreaded;
+	(void) foreground;
+	return -1;
+}
+
+struct fuse_chan *fuse_mount(const char *mountpoint, struct fuse_args *args) {
+	(void) mountpoint;
+	(void) args;
+	return NULL;
+}
+
+void fuse_unmount(const char *mountpoint, struct fuse_chan *ch) {
+	(void) mountpoint;
+	(void) ch;
+}
+
+int fuse_daemonize(int foreground) {
+	(void) foreground;
+	return 0;
+}
+
+int fuse_set_signal_handlers(struct fuse_session *se) {
+	(void) se;
+	return -1;
+}
+
+void fuse_remove_signal_handlers(struct fuse_session *se) {
+	(void) se;
+}
+
+struct fuse_session *fuse_lowlevel_new(struct fuse_args *args, const struct fuse_lowlevel_ops *op, size_t op_size, void *userdata) {
+	(void) args;
+	(void) op;
+	(void) op_size;
+	(void) userdata;
+	return NULL;
+}
+
+void fuse_session_add_chan(struct fuse_session *se, struct fuse_chan *ch) {
+	(void) se;
+	(void) ch;
+}
+
+void fuse_session_remove_chan(struct fuse_chan *ch) {
+	(void) ch;
+}
+
+void fuse_session_destroy(struct fuse_session *se) {
+	(void) se;
+}
+
+int fuse_session_loop(struct fuse_session *se) {
+	(void) se;
+	return -1;
+}
+
+int fuse_session_loop_mt(struct fuse_session *se) {
+	(void) se;
+	return -1;
+}
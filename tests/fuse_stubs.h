@@ -0,0 +1,33 @@
+/*
+ * libfuse in place of the library, for the tests and benchmarks that call the callbacks of filesystem.c in their
+ * own process. Only the FUSE headers are needed to build them, not the library or a mount.
+ * A low-level request is a struct fuse_req the caller owns, the reply to it is stored in it.
+*/
+#ifndef DM510FS_FUSE_STUBS_H
+#define DM510FS_FUSE_STUBS_H
+
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+/* A low-level request and the reply it got*/
+struct fuse_req {
+	int replied; // 1 once a reply was sent, 2 for fuse_reply_none
+	int err; // errno of fuse_reply_err, 0 for any other reply
+	struct fuse_entry_param entry;
+	struct stat attr;
+	struct fuse_file_info fi; // of fuse_reply_open and fuse_reply_create
+	struct statvfs statfs;
+	char *data; // the data of fuse_reply_buf or fuse_reply_data, freed by reset_req
+	size_t size; // bytes of data, or bytes written
+};
+
+// Clears a request for the next call, freeing the data of its last reply
+void reset_req(struct fuse_req *req);
+
+// Inode invalidations the low-level front end sent the kernel
+extern int invalidations;
+
+#endif
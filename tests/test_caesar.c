@@ -0,0 +1,108 @@
+/*
+ * Checks every Caesar kernel the CPU runs, forced one at a time, is bit-exact with caesar_scalar: on random bytes
+ * of every value, at every key, length and alignment up to a few vectors, in place and not, and through the
+ * filesystem, where decryption must give back what was written.
+*/
+#include "../filesystem.c"
+#include "util.h"
+
+#define MAX_LENGTH 300
+#define ROUNDS 2000
+
+typedef struct Kernel {
+	const char *name;
+	void (*run)(char *dst, const char *src, size_t length, int key);
+	bool supported;
+} Kernel;
+
+/*
+ * Checks a kernel against the scalar one on random buffers
+*/
+static void check_kernel(const Kernel *kernel, unsigned int *seed) {
+	static char src[MAX_LENGTH + 64], expected[MAX_LENGTH + 64], got[MAX_LENGTH + 64 + 2], in_place[MAX_LENGTH + 64];
+	for (int round = 0; round < ROUNDS; round++) {
+		size_t length = rand_r(seed) % (MAX_LENGTH + 1);
+		size_t align = rand_r(seed) % 32;
+		int key = round % 26;
+		// Letters of both cases, the bytes just outside their ranges, and bytes of any value
+		for (size_t b = 0; b < length; b++) {
+			switch (rand_r(seed) % 4) {
+			case 0:
+				src[align + b] = 'A' + rand_r(seed) % 26;
+				break;
+			case 1:
+				src[align + b] = 'a' + rand_r(seed) % 26;
+				break;
+			case 2:
+				src[align + b] = "@AZ[`az{"[rand_r(seed) % 8];
+				break;
+			default:
+				src[align + b] = (char) rand_r(seed);
+			}
+		}
+		caesar_scalar(expected, src + align, length, key);
+
+		// The bytes around the output must be left alone
+		got[0] = got[length + 1] = 0x5a;
+		kernel->run(got + 1, src + align, length, key);
+		CHECK(got[0] == 0x5a && got[length + 1] == 0x5a);
+		CHECK(memcmp(got + 1, expected, length) == 0);
+
+		memcpy(in_place + align, src + align, length);
+		kernel->run(in_place + align, in_place + align, length, key);
+		CHECK(memcmp(in_place + align, expected, length) == 0);
+
+		kernel->run(got + 1, expected, length, (26 - key) % 26);
+		CHECK(memcmp(got + 1, src + align, length) == 0);
+	}
+}
+
+/*
+ * Writes and reads back a file with the kernel as the one the filesystem uses
+*/
+static void check_filesystem(const Kernel *kernel, unsigned int *seed) {
+	static char data[3 * BLOCK_SIZE + 77], out[sizeof(data)], stored[sizeof(data)];
+	for (size_t b = 0; b < sizeof(data); b++) {
+		data[b] = (char) rand_r(seed);
+	}
+	mount_fs();
+	caesar_kernel = kernel->run;
+	for (shift = 1; shift < 26; shift++) {
+		CHECK(dm510fs_oper.mknod("/f", S_IFREG | 0644, 0) == 0);
+		CHECK(dm510fs_oper.write("/f", data, sizeof(data), 0, NULL) == (int) sizeof(data));
+		CHECK(dm510fs_oper.read("/f", out, sizeof(out), 0, NULL) == (int) sizeof(out));
+		CHECK(memcmp(out, data, sizeof(data)) == 0);
+
+		// What is stored is the scalar encryption
+		int i = lookup_inode("/f");
+		CHECK(i >= 0 && filesystem[i].extent_count > 0);
+		caesar_scalar(stored, data, BLOCK_SIZE, shift);
+		CHECK(memcmp(blocks[filesystem[i].extents[0].start].data, stored, BLOCK_SIZE) == 0);
+		CHECK(dm510fs_oper.unlink("/f") == 0);
+	}
+	shift = 0;
+	unmount_fs();
+}
+
+int main(void) {
+	Kernel kernels[] = {
+		{ "scalar", caesar_scalar, true },
+#if defined(__x86_64__) || defined(__i386__)
+		{ "sse2", caesar_sse2, __builtin_cpu_supports("sse2") },
+		{ "avx2", caesar_avx2, __builtin_cpu_supports("avx2") },
+#endif
+	};
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	unsigned int seed = 1;
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (!kernels[k].supported) {
+			printf("caesar %s: not supported by this CPU, skipped\n", kernels[k].name);
+			continue;
+		}
+		check_kernel(&kernels[k], &seed);
+		check_filesystem(&kernels[k], &seed);
+		printf("caesar %s: ok\n", kernels[k].name);
+	}
+	return 0;
+}
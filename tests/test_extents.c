@@ -0,0 +1,144 @@
+/*
+ * Random writes, truncates and reads of two files against a model of each, with and without encryption, through
+ * paths and through handles with their write-back buffers. Writes land at or before the end of the file and of any
+ * length, so extents are split, grown and merged; truncates shrink and grow the files. Every block must be free again
+ * once the files are unlinked. Last, a buffered write past the end of a file on a full disk must not grow the file
+ * when its commit fails.
+*/
+#include "../filesystem.c"
+#include "util.h"
+
+#define MAX_SIZE (1024 * 1024)
+#define STEPS 3000
+
+typedef struct Model {
+	const char *path;
+	char data[MAX_SIZE];
+	off_t size;
+} Model;
+
+static Model models[2] = { { .path = "/f" }, { .path = "/g" } };
+static char out[MAX_SIZE + 1];
+
+/*
+ * Reads a file whole and compares it with its model
+*/
+static void check_model(const Model *m) {
+	struct stat st;
+	CHECK(dm510fs_oper.getattr(m->path, &st) == 0 && st.st_size == m->size);
+	memset(out, 1, m->size + 1);
+	CHECK(dm510fs_oper.read(m->path, out, MAX_SIZE + 1, 0, NULL) == (int) m->size);
+	CHECK(memcmp(out, m->data, m->size) == 0);
+}
+
+static void run(unsigned int *seed) {
+	struct statvfs empty;
+	CHECK(dm510fs_oper.statfs("/", &empty) == 0);
+	struct fuse_file_info handles[2];
+	for (int f = 0; f < 2; f++) {
+		models[f].size = 0;
+		memset(models[f].data, 0, MAX_SIZE);
+		CHECK(dm510fs_oper.mknod(models[f].path, S_IFREG | 0644, 0) == 0);
+		handles[f] = (struct fuse_file_info) { .flags = O_RDWR };
+		CHECK(dm510fs_oper.open(models[f].path, &handles[f]) == 0);
+	}
+	for (int step = 0; step < STEPS; step++) {
+		int f = rand_r(seed) % 2;
+		Model *m = &models[f];
+		int op = rand_r(seed) % 10;
+		if (op < 7) {
+			off_t offset = rand_r(seed) % (m->size + 1);
+			size_t length = rand_r(seed) % (op < 3 ? 200 : 20000);
+			length = offset + length > MAX_SIZE ? MAX_SIZE - offset : length;
+			for (size_t b = 0; b < length; b++) {
+				m->data[offset + b] = "AbCz!09xyZ"[rand_r(seed) % 10];
+			}
+			// Small writes go through the handle, where they are buffered
+			bool buffered = op < 3;
+			CHECK(dm510fs_oper.write(buffered ? NULL : m->path, m->data + offset, length, offset,
+									 buffered ? &handles[f] : NULL) == (int) length);
+			m->size = offset + (off_t) length > m->size ? offset + (off_t) length : m->size;
+		} else if (op < 9) {
+			off_t size = rand_r(seed) % (op == 7 ? m->size + 1 : MAX_SIZE);
+			CHECK(dm510fs_oper.truncate(m->path, size) == 0);
+			if (size < m->size) {
+				memset(m->data + size, 0, m->size - size);
+			}
+			m->size = size;
+		} else {
+			check_model(m);
+		}
+		int i = lookup_inode(m->path);
+		CHECK(filesystem[i].extent_count <= MAX_EXTENTS);
+	}
+	for (int f = 0; f < 2; f++) {
+		CHECK(dm510fs_oper.release(NULL, &handles[f]) == 0);
+		check_model(&models[f]);
+	}
+
+	// The files read back the same after a remount
+	unmount_fs();
+	mount_fs();
+	for (int f = 0; f < 2; f++) {
+		check_model(&models[f]);
+		CHECK(dm510fs_oper.unlink(models[f].path) == 0);
+	}
+	journal_wait(journal_last);
+	struct statvfs st;
+	CHECK(dm510fs_oper.statfs("/", &st) == 0);
+	CHECK(st.f_bfree == empty.f_bfree);
+}
+
+/*
+ * Fills the disk, then buffers a write past the end of an empty file. The size with the buffered data is reported
+ * while it is held, but the inode keeps its own until the commit, which fails, so neither the journal nor the image
+ * ever hold the larger size.
+*/
+static void check_full_disk(unsigned int *seed) {
+	static char chunk[MAX_SIZE];
+	for (size_t b = 0; b < MAX_SIZE; b++) {
+		chunk[b] = (char) rand_r(seed);
+	}
+	CHECK(dm510fs_oper.mknod("/full", S_IFREG | 0644, 0) == 0);
+	off_t filled = 0;
+	int res;
+	while ((res = dm510fs_oper.write("/full", chunk, MAX_SIZE, filled, NULL)) == MAX_SIZE) {
+		filled += res;
+		chunk[0]++;
+	}
+
+	CHECK(dm510fs_oper.mknod("/late", S_IFREG | 0644, 0) == 0);
+	struct fuse_file_info fi = { .flags = O_RDWR };
+	CHECK(dm510fs_oper.open("/late", &fi) == 0);
+	int i = get_handle(&fi)->inode;
+	CHECK(dm510fs_oper.write(NULL, chunk, 100, 2 * BLOCK_SIZE, &fi) == 100);
+	struct stat st;
+	CHECK(dm510fs_oper.getattr("/late", &st) == 0 && st.st_size == 2 * BLOCK_SIZE + 100);
+	CHECK(filesystem[i].size == 0);
+	CHECK(dm510fs_oper.flush("/late", &fi) == -ENOSPC);
+	CHECK(dm510fs_oper.getattr("/late", &st) == 0 && st.st_size == 0);
+	CHECK(dm510fs_oper.release("/late", &fi) == 0);
+
+	crash_fs();
+	mount_fs();
+	CHECK(dm510fs_oper.getattr("/late", &st) == 0 && st.st_size == 0);
+	CHECK(dm510fs_oper.unlink("/late") == 0);
+	CHECK(dm510fs_oper.unlink("/full") == 0);
+}
+
+int main(void) {
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	unsigned int seed = 1;
+	for (shift = 0; shift < 6; shift += 3) {
+		mount_fs();
+		run(&seed);
+		unmount_fs();
+		printf("extents: shift %d ok\n", shift);
+	}
+	mount_fs();
+	check_full_disk(&seed);
+	unmount_fs();
+	printf("extents: full disk ok\n");
+	return 0;
+}
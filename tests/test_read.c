@@ -0,0 +1,166 @@
+/*
+ * Checks dm510fs_read, dm510fs_read_buf and dm510fs_ll_read return the same bytes as a model of the file, over data,
+ * holes, a tail past the last block, inline and compressed files, files in more pieces than a read is replied in
+ * without copying, and with and without encryption. read_buf must reply with its own copy of the data, which stays
+ * the same when the blocks are freed and given to another file before libfuse sends it.
+*/
+#include "../filesystem.c"
+#include "fuse_stubs.h"
+#include "util.h"
+
+#define FILE_SIZE (400 * 1024)
+#define READS 3000
+
+static char model[FILE_SIZE];
+
+/*
+ * Writes to a file and to its model
+*/
+static void write_both(const char *path, size_t size, off_t offset, unsigned int *seed) {
+	char buf[64 * 1024];
+	CHECK(size <= sizeof(buf));
+	for (size_t b = 0; b < size; b++) {
+		// Runs of letters compress, and are changed by the cypher
+		buf[b] = b % 512 < 256 ? 'a' + b % 26 : (char) rand_r(seed);
+	}
+	CHECK(dm510fs_oper.write(path, buf, size, offset, NULL) == (int) size);
+	memcpy(model + offset, buf, size);
+}
+
+/*
+ * Hands out a buffer vector the way libfuse replies with it, then frees it as libfuse does, returns the bytes copied
+*/
+static ssize_t deliver(struct fuse_bufvec *bufv, char *out, size_t size) {
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = out;
+	ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+	for (size_t k = 0; k < bufv->count; k++) {
+		free(bufv->buf[k].mem);
+	}
+	free(bufv);
+	return copied;
+}
+
+/*
+ * Reads a range of a file the three ways and compares each with the model
+*/
+static void check_range(const char *path, off_t size, size_t length, off_t offset) {
+	static char out[FILE_SIZE + BLOCK_SIZE];
+	size_t expected = offset >= size ? 0 : (size_t) (size - offset) < length ? (size_t) (size - offset) : length;
+
+	memset(out, 0x55, length);
+	CHECK(dm510fs_oper.read(path, out, length, offset, NULL) == (int) expected);
+	CHECK(memcmp(out, model + offset, expected) == 0);
+
+	struct fuse_file_info fi = { .flags = O_RDONLY };
+	CHECK(dm510fs_oper.open(path, &fi) == 0);
+	struct fuse_bufvec *bufv = NULL;
+	CHECK(dm510fs_oper.read_buf(NULL, &bufv, length, offset, &fi) == 0);
+	CHECK(fuse_buf_size(bufv) == expected);
+	for (size_t k = 0; k < bufv->count; k++) {
+		CHECK(!(bufv->buf[k].flags & FUSE_BUF_IS_FD));
+	}
+	memset(out, 0x55, length);
+	CHECK(deliver(bufv, out, length) == (ssize_t) expected);
+	CHECK(memcmp(out, model + offset, expected) == 0);
+
+	int i = lookup_inode(path);
+	struct fuse_req req = { 0 };
+	dm510fs_ll_oper.read(&req, INODE_NUMBER(i), length, offset, &fi);
+	CHECK(req.replied == 1 && req.err == 0 && req.size == expected);
+	CHECK(memcmp(req.data, model + offset, expected) == 0);
+	reset_req(&req);
+	CHECK(dm510fs_oper.release(NULL, &fi) == 0);
+}
+
+/*
+ * Reads random ranges of a file, and the ranges at its ends
+*/
+static void check_file(const char *path, off_t size, unsigned int *seed) {
+	check_range(path, size, 0, 0);
+	check_range(path, size, size, 0);
+	check_range(path, size, BLOCK_SIZE, size);
+	check_range(path, size, BLOCK_SIZE, size - 1);
+	for (int r = 0; r < READS; r++) {
+		size_t length = 1 + rand_r(seed) % (r % 4 == 0 ? FILE_SIZE : 3 * BLOCK_SIZE);
+		off_t offset = rand_r(seed) % (size + BLOCK_SIZE);
+		check_range(path, size, length, offset);
+	}
+}
+
+/*
+ * Reads a file with read_buf, then truncates it and writes another file into the blocks it freed before the reply
+ * is delivered, which must still hold what was read
+*/
+static void check_reuse(unsigned int *seed) {
+	static char out[16 * BLOCK_SIZE];
+	memset(model, 0, sizeof(model));
+	CHECK(dm510fs_oper.mknod("/old", S_IFREG | 0644, 0) == 0);
+	write_both("/old", sizeof(out), 0, seed);
+	struct fuse_file_info fi = { .flags = O_RDONLY };
+	CHECK(dm510fs_oper.open("/old", &fi) == 0);
+	struct fuse_bufvec *bufv = NULL;
+	CHECK(dm510fs_oper.read_buf(NULL, &bufv, sizeof(out), 0, &fi) == 0);
+
+	// The next allocation starts where the freed blocks are, so the new file takes them
+	Inode *old = &filesystem[lookup_inode("/old")];
+	uint32_t start = old->is_inline ? 0 : extent_at(old, 0)->start;
+	CHECK(dm510fs_oper.truncate("/old", 0) == 0);
+	journal_wait(journal_last);
+	super->alloc_cursor = start;
+	char other[sizeof(out)];
+	memset(other, 'X', sizeof(other));
+	CHECK(dm510fs_oper.mknod("/new", S_IFREG | 0644, 0) == 0);
+	CHECK(dm510fs_oper.write("/new", other, sizeof(other), 0, NULL) == (int) sizeof(other));
+	Inode *new = &filesystem[lookup_inode("/new")];
+	CHECK(options.compress || extent_at(new, 0)->start == start);
+
+	CHECK(deliver(bufv, out, sizeof(out)) == (ssize_t) sizeof(out));
+	CHECK(memcmp(out, model, sizeof(out)) == 0);
+	CHECK(dm510fs_oper.release(NULL, &fi) == 0);
+	CHECK(dm510fs_oper.unlink("/old") == 0);
+	CHECK(dm510fs_oper.unlink("/new") == 0);
+}
+
+static void check_all(unsigned int *seed) {
+	memset(model, 0, sizeof(model));
+	CHECK(dm510fs_oper.mknod("/f", S_IFREG | 0644, 0) == 0);
+	write_both("/f", 40 * 1024, 0, seed);
+	write_both("/f", 20 * 1024, 200 * 1024 + 100, seed);
+	CHECK(dm510fs_oper.truncate("/f", FILE_SIZE) == 0);
+	check_file("/f", FILE_SIZE, seed);
+	CHECK(dm510fs_oper.unlink("/f") == 0);
+
+	// Every other block written, more pieces than fit a reply
+	memset(model, 0, sizeof(model));
+	CHECK(dm510fs_oper.mknod("/holes", S_IFREG | 0644, 0) == 0);
+	for (int b = 0; b < 80; b += 2) {
+		write_both("/holes", BLOCK_SIZE, (off_t) b * BLOCK_SIZE, seed);
+	}
+	check_file("/holes", 79 * BLOCK_SIZE, seed);
+	CHECK(dm510fs_oper.unlink("/holes") == 0);
+
+	memset(model, 0, sizeof(model));
+	CHECK(dm510fs_oper.mknod("/small", S_IFREG | 0644, 0) == 0);
+	write_both("/small", 50, 0, seed);
+	check_file("/small", 50, seed);
+	CHECK(dm510fs_oper.unlink("/small") == 0);
+
+	check_reuse(seed);
+}
+
+int main(void) {
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	unsigned int seed = 1;
+	for (int compress = 0; compress < 2; compress++) {
+		options.compress = compress;
+		for (shift = 0; shift < 6; shift += 5) {
+			mount_fs();
+			check_all(&seed);
+			unmount_fs();
+			printf("read: shift %d, %s data, ok\n", shift, compress ? "compressed" : "plain");
+		}
+	}
+	return 0;
+}
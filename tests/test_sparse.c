@@ -0,0 +1,330 @@
+/*
+ * Random sparse writes, truncates that shrink and grow, punched holes and preallocated ranges on a few files against
+ * a model of each, with deduplication on, compression switched on and off, and encryption. Files are written whole
+ * from a few templates so their extents are shared. Every so often the files are read back, and every block of the
+ * image is checked to be free or used by exactly the extents that hold it, with the counts of the superblock.
+ * Then the image is copied, more is done, and a crash that brings the copy back must replay to the same files.
+*/
+#include "../filesystem.c"
+#include "util.h"
+
+#define FILES 8
+#define TEMPLATES 3
+#define MAX_SIZE (600 * 1024)
+#define STEPS 4000
+#define CRASH_STEPS 300
+
+typedef struct Model {
+	char path[16];
+	char data[MAX_SIZE];
+	off_t size;
+} Model;
+
+static Model models[FILES];
+static char templates[TEMPLATES][MAX_SIZE];
+static size_t template_sizes[TEMPLATES];
+static char out[MAX_SIZE + BLOCK_SIZE];
+static char buf[MAX_SIZE];
+static uint16_t references[BLOCKS_COUNT];
+
+static void fill(char *data, size_t size, unsigned int *seed) {
+	for (size_t b = 0; b < size; b++) {
+		data[b] = (char) rand_r(seed);
+	}
+}
+
+/*
+ * Reads every file whole and compares it with its model
+*/
+static void check_files(void) {
+	for (int f = 0; f < FILES; f++) {
+		Model *m = &models[f];
+		struct stat st;
+		CHECK(dm510fs_oper.getattr(m->path, &st) == 0 && st.st_size == m->size);
+		CHECK(dm510fs_oper.read(m->path, out, sizeof(out), 0, NULL) == (int) m->size);
+		CHECK(memcmp(out, m->data, m->size) == 0);
+	}
+}
+
+/*
+ * Checks each block is free or used by the extents holding it, with a share for every reference past the first,
+ * and the block, sharing and compression counts of the superblock. Blocks freed wait for their commit.
+*/
+static void check_blocks(void) {
+	CHECK(journal_wait(journal_last) == 0);
+	memset(references, 0, sizeof(references));
+	uint64_t packed = 0, stored = 0;
+	for (int i = 0; i < super->inode_count; i++) {
+		Inode *inode = &filesystem[i];
+		if (!inode->is_active || inode->is_inline) {
+			continue;
+		}
+		uint32_t held = inode->indirect != -1;
+		if (inode->indirect != -1) {
+			references[inode->indirect]++;
+		}
+		for (uint32_t k = 0; k < inode->extent_count; k++) {
+			Extent *e = extent_at(inode, k);
+			held += extent_blocks(e);
+			for (uint32_t b = 0; b < extent_blocks(e); b++) {
+				references[e->start + b]++;
+			}
+			if (is_cluster(e)) {
+				packed += e->length;
+				stored += extent_blocks(e);
+			}
+		}
+		CHECK(held == inode->block_count);
+	}
+	uint32_t used = 0;
+	uint64_t shared = 0;
+	for (uint32_t b = 0; b < BLOCKS_COUNT; b++) {
+		bool is_free = next_free_block(b, b + 1) == (int) b;
+		if (references[b] > 0) {
+			used++;
+			shared += references[b] - 1;
+			CHECK(!is_free && block_shares[b] == references[b] - 1);
+		} else {
+			CHECK(is_free && block_shares[b] == 0);
+		}
+	}
+	CHECK(BLOCKS_COUNT - super->free_block_count == used);
+	CHECK(shared == super->shared_blocks);
+	CHECK(packed == super->packed_blocks && stored == super->packed_stored);
+}
+
+/*
+ * Writes to a file and its model, zeros fill the model between its end and the write
+*/
+static void write_both(Model *m, const char *data, size_t length, off_t offset, bool handle) {
+	struct fuse_file_info fi = { .flags = O_WRONLY };
+	CHECK(!handle || dm510fs_oper.open(m->path, &fi) == 0);
+	CHECK(dm510fs_oper.write(handle ? NULL : m->path, data, length, offset, handle ? &fi : NULL) == (int) length);
+	CHECK(!handle || dm510fs_oper.release(NULL, &fi) == 0);
+	if (offset > m->size) {
+		memset(m->data + m->size, 0, offset - m->size);
+	}
+	memcpy(m->data + offset, data, length);
+	if (offset + (off_t) length > m->size) {
+		m->size = offset + length;
+	}
+}
+
+/*
+ * Rewrites a file with a template through a handle, so the release shares its extents with the other copies
+*/
+static void write_template(Model *m, int t, unsigned int *seed) {
+	CHECK(dm510fs_oper.truncate(m->path, 0) == 0);
+	m->size = 0;
+	struct fuse_file_info fi = { .flags = O_WRONLY };
+	CHECK(dm510fs_oper.open(m->path, &fi) == 0);
+	size_t piece = rand_r(seed) % 2 ? BLOCK_SIZE : 128 * 1024;
+	for (size_t at = 0; at < template_sizes[t]; at += piece) {
+		size_t length = at + piece > template_sizes[t] ? template_sizes[t] - at : piece;
+		CHECK(dm510fs_oper.write(NULL, templates[t] + at, length, at, &fi) == (int) length);
+	}
+	CHECK(dm510fs_oper.release(NULL, &fi) == 0);
+	memcpy(m->data, templates[t], template_sizes[t]);
+	m->size = template_sizes[t];
+}
+
+static void truncate_both(Model *m, unsigned int *seed) {
+	off_t size = rand_r(seed) % 2 ? rand_r(seed) % (m->size + 1) : rand_r(seed) % MAX_SIZE;
+	CHECK(dm510fs_oper.truncate(m->path, size) == 0);
+	if (size > m->size) {
+		memset(m->data + m->size, 0, size - m->size);
+	}
+	m->size = size;
+}
+
+/*
+ * Punches a hole, or preallocates a range keeping the size or growing it, by path or through a handle
+*/
+static void fallocate_both(Model *m, unsigned int *seed) {
+	off_t offset = rand_r(seed) % (rand_r(seed) % 2 ? m->size + 1 : MAX_SIZE);
+	off_t length = 1 + rand_r(seed) % (rand_r(seed) % 2 ? 9000 : 200000);
+	if (offset + length > MAX_SIZE) {
+		length = MAX_SIZE - offset;
+	}
+	if (length <= 0) {
+		return;
+	}
+	int kind = rand_r(seed) % 3;
+	int mode = kind == 0 ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : kind == 1 ? FALLOC_FL_KEEP_SIZE : 0;
+	struct fuse_file_info fi = { .flags = O_WRONLY };
+	bool handle = rand_r(seed) % 2;
+	CHECK(!handle || dm510fs_oper.open(m->path, &fi) == 0);
+	CHECK(dm510fs_oper.fallocate(handle ? NULL : m->path, mode, offset, length, handle ? &fi : NULL) == 0);
+	CHECK(!handle || dm510fs_oper.release(NULL, &fi) == 0);
+	if (kind == 0 && offset < m->size) {
+		off_t end = offset + length < m->size ? offset + length : m->size;
+		memset(m->data + offset, 0, end - offset);
+	} else if (kind == 2 && offset + length > m->size) {
+		memset(m->data + m->size, 0, offset + length - m->size);
+		m->size = offset + length;
+	}
+}
+
+static void step(unsigned int *seed, bool remounts) {
+	Model *m = &models[rand_r(seed) % FILES];
+	int op = rand_r(seed) % 12;
+	if (op < 4) {
+		write_template(m, rand_r(seed) % TEMPLATES, seed);
+	} else if (op < 7) {
+		size_t length = 1 + rand_r(seed) % (rand_r(seed) % 4 == 0 ? 100000 : 5000);
+		off_t offset = rand_r(seed) % (rand_r(seed) % 4 == 0 ? MAX_SIZE : m->size + 1);
+		if (offset + (off_t) length <= MAX_SIZE) {
+			fill(buf, length, seed);
+			write_both(m, buf, length, offset, op < 6);
+		}
+	} else if (op < 9) {
+		truncate_both(m, seed);
+	} else if (op == 9) {
+		CHECK(dm510fs_oper.unlink(m->path) == 0);
+		CHECK(dm510fs_oper.mknod(m->path, S_IFREG | 0644, 0) == 0);
+		m->size = 0;
+	} else if (op == 10) {
+		if (rand_r(seed) % 8 == 0) {
+			options.compress = !options.compress;
+		} else {
+			fallocate_both(m, seed);
+		}
+	} else if (remounts && rand_r(seed) % 20 == 0) {
+		unmount_fs();
+		mount_fs();
+	}
+}
+
+/*
+ * Edge cases: a file grown far past its data, bytes far into a sparse file, punches and preallocations around
+ * written data, and the errors of fallocate
+*/
+static void check_edges(void) {
+	struct statvfs empty, st;
+	char block[2 * BLOCK_SIZE];
+	CHECK(dm510fs_oper.statfs("/", &empty) == 0);
+	CHECK(dm510fs_oper.mknod("/a", S_IFREG | 0644, 0) == 0);
+	CHECK(dm510fs_oper.write("/a", "x", 1, 0, NULL) == 1);
+	CHECK(dm510fs_oper.truncate("/a", (off_t) 1 << 40) == 0);
+	CHECK(dm510fs_oper.statfs("/", &st) == 0 && st.f_bfree == empty.f_bfree - 1);
+	memset(block, 7, sizeof(block));
+	CHECK(dm510fs_oper.read("/a", block, sizeof(block), ((off_t) 1 << 40) - 100, NULL) == 100);
+	for (int b = 0; b < 100; b++) {
+		CHECK(block[b] == 0);
+	}
+	CHECK(dm510fs_oper.write("/a", "yz", 2, ((off_t) 1 << 30) + BLOCK_SIZE - 2, NULL) == 2);
+	CHECK(dm510fs_oper.read("/a", block, sizeof(block), (off_t) 1 << 30, NULL) == sizeof(block));
+	for (int b = 0; b < (int) sizeof(block); b++) {
+		CHECK(block[b] == (b == BLOCK_SIZE - 2 ? 'y' : b == BLOCK_SIZE - 1 ? 'z' : 0));
+	}
+
+	// Preallocated blocks read as zeros, take space and keep the size unless it grows
+	CHECK(dm510fs_oper.mknod("/b", S_IFREG | 0644, 0) == 0);
+	CHECK(dm510fs_oper.fallocate("/b", FALLOC_FL_KEEP_SIZE, 0, 1 << 20, NULL) == 0);
+	struct stat attr;
+	CHECK(dm510fs_oper.getattr("/b", &attr) == 0 && attr.st_size == 0);
+	int b = lookup_inode("/b");
+	CHECK(filesystem[b].block_count == (1 << 20) / BLOCK_SIZE);
+	CHECK(dm510fs_oper.fallocate("/b", 0, 100, 1 << 20, NULL) == 0);
+	CHECK(dm510fs_oper.getattr("/b", &attr) == 0 && attr.st_size == 100 + (1 << 20));
+	CHECK(dm510fs_oper.read("/b", out, MAX_SIZE, 1000, NULL) == MAX_SIZE);
+	for (int k = 0; k < MAX_SIZE; k++) {
+		CHECK(out[k] == 0);
+	}
+	// The first write clears the rest of the blocks it touches, which stay zeros
+	CHECK(dm510fs_oper.write("/b", "abc", 3, 5000, NULL) == 3);
+	CHECK(dm510fs_oper.read("/b", block, sizeof(block), BLOCK_SIZE, NULL) == sizeof(block));
+	for (int k = 0; k < (int) sizeof(block); k++) {
+		CHECK(block[k] == (k >= 5000 - BLOCK_SIZE && k < 5003 - BLOCK_SIZE ? "abc"[k - (5000 - BLOCK_SIZE)] : 0));
+	}
+
+	// A punch frees the blocks it covers whole and clears the rest
+	CHECK(dm510fs_oper.mknod("/e", S_IFREG | 0644, 0) == 0);
+	memset(buf, 'q', 5000);
+	CHECK(dm510fs_oper.write("/e", buf, 5000, 0, NULL) == 5000);
+	CHECK(dm510fs_oper.fallocate("/e", FALLOC_FL_KEEP_SIZE, 0, 20 * BLOCK_SIZE, NULL) == 0);
+	int e = lookup_inode("/e");
+	CHECK(filesystem[e].block_count == 20);
+	CHECK(dm510fs_oper.fallocate("/e", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 10 * BLOCK_SIZE, 5 * BLOCK_SIZE, NULL) == 0);
+	CHECK(filesystem[e].block_count == 15);
+	CHECK(dm510fs_oper.fallocate("/e", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100, 100 * BLOCK_SIZE, NULL) == 0);
+	CHECK(filesystem[e].block_count == 1);
+	CHECK(dm510fs_oper.getattr("/e", &attr) == 0 && attr.st_size == 5000);
+	CHECK(dm510fs_oper.read("/e", block, sizeof(block), 0, NULL) == 5000);
+	for (int k = 0; k < 5000; k++) {
+		CHECK(block[k] == (k < 100 ? 'q' : 0));
+	}
+
+	CHECK(dm510fs_oper.mkdir("/d", 0755) == 0);
+	CHECK(dm510fs_oper.fallocate("/a", FALLOC_FL_PUNCH_HOLE, 0, 1, NULL) == -EOPNOTSUPP);
+	CHECK(dm510fs_oper.fallocate("/a", 0x10, 0, 1, NULL) == -EOPNOTSUPP);
+	CHECK(dm510fs_oper.fallocate("/a", 0, 0, 0, NULL) == -EINVAL);
+	CHECK(dm510fs_oper.fallocate("/a", 0, -1, 5, NULL) == -EINVAL);
+	CHECK(dm510fs_oper.fallocate("/d", 0, 0, 5, NULL) == -EISDIR);
+	CHECK(dm510fs_oper.fallocate("/a", 0, MAX_FILE_SIZE, 1, NULL) == -EFBIG);
+	CHECK(dm510fs_oper.fallocate("/x", 0, 0, 5, NULL) == -ENOENT);
+	CHECK(dm510fs_oper.fallocate("/b", 0, 0, (off_t) BLOCKS_COUNT * BLOCK_SIZE * 2, NULL) == -ENOSPC);
+
+	// What was preallocated is still zeros after a remount
+	unmount_fs();
+	mount_fs();
+	CHECK(dm510fs_oper.read("/b", out, MAX_SIZE, 6000, NULL) == MAX_SIZE);
+	for (int k = 0; k < MAX_SIZE; k++) {
+		CHECK(out[k] == 0);
+	}
+	CHECK(dm510fs_oper.unlink("/a") == 0);
+	CHECK(dm510fs_oper.unlink("/b") == 0);
+	CHECK(dm510fs_oper.unlink("/e") == 0);
+	CHECK(dm510fs_oper.rmdir("/d") == 0);
+	journal_wait(journal_last);
+	CHECK(dm510fs_oper.statfs("/", &st) == 0 && st.f_bfree == empty.f_bfree);
+}
+
+int main(void) {
+	enter_scratch_dir();
+	options.trace_level = TRACE_ERROR;
+	shift = 5;
+	mount_fs();
+	check_edges();
+	printf("sparse: edge cases ok\n");
+
+	unsigned int seed = 1;
+	options.dedup = 1;
+	options.commit_interval = 0.01;
+	for (int t = 0; t < TEMPLATES; t++) {
+		template_sizes[t] = t == 0 ? 3 * BLOCK_SIZE : 1000 + rand_r(&seed) % (MAX_SIZE - 1000);
+		fill(templates[t], template_sizes[t], &seed);
+	}
+	for (int f = 0; f < FILES; f++) {
+		snprintf(models[f].path, sizeof(models[f].path), "/f%d", f);
+		CHECK(dm510fs_oper.mknod(models[f].path, S_IFREG | 0644, 0) == 0);
+	}
+	for (int s = 0; s < STEPS; s++) {
+		step(&seed, true);
+		if (s % 25 == 0) {
+			check_files();
+			check_blocks();
+		}
+	}
+	options.compress = 0;
+	check_files();
+	check_blocks();
+	printf("sparse: %d steps ok\n", STEPS);
+
+	// Only the journal brings the copy up to date, so nothing may be checkpointed meanwhile
+	unmount_fs();
+	copy_file(IMAGE_FILE, "snapshot.img");
+	options.checkpoint_interval = 1000;
+	mount_fs();
+	for (int s = 0; s < CRASH_STEPS; s++) {
+		step(&seed, false);
+	}
+	crash_fs();
+	copy_file("snapshot.img", IMAGE_FILE);
+	mount_fs();
+	check_files();
+	check_blocks();
+	unmount_fs();
+	printf("sparse: crash after %d steps ok\n", CRASH_STEPS);
+	return 0;
+}
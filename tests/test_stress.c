@@ -0,0 +1,163 @@
+/*
+ * Threads creating, writing, reading and unlinking files in one directory, while all of them overwrite and read
+ * the blocks of one shared file. Every read is checked: a file reads back what its thread wrote, and a block of the
+ * shared file holds one whole write. The files kept are checked again after a remount, and every block must be
+ * free once they are gone. Built with -fsanitize=thread by make tsan.
+*/
+#include "../filesystem.c"
+#include "util.h"
+
+#define THREADS 8
+#define ITERATIONS 200
+#define MAX_LENGTH 70000
+#define SHARED_BLOCKS 64
+
+/*
+ * The byte at an offset of file k of a thread, different for every file, so a block written to the wrong file shows
+*/
+static char pattern(int thread, int k, size_t offset) {
+	return 'a' + (thread * 7 + k * 3 + offset) % 26;
+}
+
+/*
+ * The length of file k of a thread, the same every time it is asked for
+*/
+static size_t file_length(int thread, int k) {
+	unsigned int seed = thread * ITERATIONS + k;
+	return 1 + rand_r(&seed) % MAX_LENGTH;
+}
+
+static void file_name(char *path, size_t size, int thread, int k) {
+	snprintf(path, size, "/s/t%d-%d", thread, k);
+}
+
+/*
+ * Reads a file whole and compares it with what its thread wrote
+*/
+static void check_file(int thread, int k, char *buf) {
+	char path[64];
+	file_name(path, sizeof(path), thread, k);
+	size_t length = file_length(thread, k);
+	struct stat st;
+	CHECK(dm510fs_oper.getattr(path, &st) == 0 && st.st_size == (off_t) length);
+	CHECK(dm510fs_oper.read(path, buf, MAX_LENGTH + 1, 0, NULL) == (int) length);
+	for (size_t b = 0; b < length; b++) {
+		CHECK(buf[b] == pattern(thread, k, b));
+	}
+}
+
+/*
+ * Checks a block of the shared file holds a single write: one tag byte repeated
+*/
+static void check_shared_block(const char *block) {
+	CHECK(block[0] == 'A' || (block[0] >= 'a' && block[0] < 'a' + THREADS));
+	for (int b = 1; b < BLOCK_SIZE; b++) {
+		CHECK(block[b] == block[0]);
+	}
+}
+
+static void *worker(void *arg) {
+	int thread = (int) (intptr_t) arg;
+	unsigned int seed = thread;
+	char *buf = malloc(MAX_LENGTH + 1);
+	char *out = malloc(MAX_LENGTH + 1);
+	char block[BLOCK_SIZE];
+	char tag[BLOCK_SIZE];
+	CHECK(buf != NULL && out != NULL);
+	memset(tag, 'a' + thread, BLOCK_SIZE);
+	for (int k = 0; k < ITERATIONS; k++) {
+		char path[64];
+		file_name(path, sizeof(path), thread, k);
+		CHECK(dm510fs_oper.mknod(path, S_IFREG | 0644, 0) == 0);
+		size_t length = file_length(thread, k);
+		for (size_t b = 0; b < length; b++) {
+			buf[b] = pattern(thread, k, b);
+		}
+
+		// Every other file is written through a handle, in pieces of random sizes
+		struct fuse_file_info fi = { .flags = O_RDWR };
+		bool handle = k % 2 == 0;
+		CHECK(!handle || dm510fs_oper.open(path, &fi) == 0);
+		for (size_t at = 0; at < length;) {
+			size_t n = 1 + rand_r(&seed) % 9000;
+			n = n < length - at ? n : length - at;
+			CHECK(dm510fs_oper.write(handle ? NULL : path, buf + at, n, at, handle ? &fi : NULL) == (int) n);
+			at += n;
+		}
+		if (handle) {
+			CHECK(dm510fs_oper.flush(NULL, &fi) == 0);
+			CHECK(dm510fs_oper.release(NULL, &fi) == 0);
+		}
+		check_file(thread, k, out);
+
+		int shared = rand_r(&seed) % SHARED_BLOCKS;
+		CHECK(dm510fs_oper.write("/shared", tag, BLOCK_SIZE, (off_t) shared * BLOCK_SIZE, NULL) == BLOCK_SIZE);
+		shared = rand_r(&seed) % SHARED_BLOCKS;
+		CHECK(dm510fs_oper.read("/shared", block, BLOCK_SIZE, (off_t) shared * BLOCK_SIZE, NULL) == BLOCK_SIZE);
+		check_shared_block(block);
+
+		// Half the files are kept for the check after the remount
+		if (k % 4 >= 2) {
+			CHECK(dm510fs_oper.unlink(path) == 0);
+		}
+	}
+	free(buf);
+	free(out);
+	return NULL;
+}
+
+int main(void) {
+	enter_scratch_dir();
+	shift = 3;
+	options.trace_level = TRACE_ERROR;
+	mount_fs();
+	struct statvfs empty;
+	CHECK(dm510fs_oper.statfs("/", &empty) == 0);
+	CHECK(dm510fs_oper.mkdir("/s", 0755) == 0);
+	CHECK(dm510fs_oper.mknod("/shared", S_IFREG | 0644, 0) == 0);
+	char block[BLOCK_SIZE];
+	memset(block, 'A', BLOCK_SIZE);
+	for (int b = 0; b < SHARED_BLOCKS; b++) {
+		CHECK(dm510fs_oper.write("/shared", block, BLOCK_SIZE, (off_t) b * BLOCK_SIZE, NULL) == BLOCK_SIZE);
+	}
+
+	pthread_t threads[THREADS];
+	for (int t = 0; t < THREADS; t++) {
+		CHECK(pthread_create(&threads[t], NULL, worker, (void *) (intptr_t) t) == 0);
+	}
+	for (int t = 0; t < THREADS; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	unmount_fs();
+
+	mount_fs();
+	char *buf = malloc(MAX_LENGTH + 1);
+	CHECK(buf != NULL);
+	for (int b = 0; b < SHARED_BLOCKS; b++) {
+		CHECK(dm510fs_oper.read("/shared", block, BLOCK_SIZE, (off_t) b * BLOCK_SIZE, NULL) == BLOCK_SIZE);
+		check_shared_block(block);
+	}
+	for (int t = 0; t < THREADS; t++) {
+		for (int k = 0; k < ITERATIONS; k++) {
+			char path[64];
+			file_name(path, sizeof(path), t, k);
+			if (k % 4 >= 2) {
+				struct stat st;
+				CHECK(dm510fs_oper.getattr(path, &st) == -ENOENT);
+				continue;
+			}
+			check_file(t, k, buf);
+			CHECK(dm510fs_oper.unlink(path) == 0);
+		}
+	}
+	free(buf);
+	CHECK(dm510fs_oper.unlink("/shared") == 0);
+	CHECK(dm510fs_oper.rmdir("/s") == 0);
+	journal_wait(journal_last);
+	struct statvfs st;
+	CHECK(dm510fs_oper.statfs("/", &st) == 0);
+	CHECK(st.f_bfree == empty.f_bfree && st.f_ffree == empty.f_ffree);
+	unmount_fs();
+	printf("stress: %d threads, %d files each, ok\n", THREADS, ITERATIONS);
+	return 0;
+}
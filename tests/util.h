@@ -0,0 +1,140 @@
+/*
+ * Helpers for the tests and benchmarks, which include filesystem.c and call its callbacks in their own process.
+ * Each program works in a scratch directory of its own, where the image and journal are made.
+*/
+#ifndef DM510FS_TEST_UTIL_H
+#define DM510FS_TEST_UTIL_H
+
+#include <limits.h>
+#include <sys/stat.h>
+
+// Like assert, but kept in optimised builds, so benchmarks check what they measure as well
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			abort(); \
+		} \
+	} while (0)
+
+static char scratch_dir[PATH_MAX];
+
+/*
+ * Removes the image and journal of the scratch directory, and the directory
+*/
+static inline void remove_scratch_dir(void) {
+	if (scratch_dir[0] != '\0' && chdir(scratch_dir) == 0) {
+		unlink(IMAGE_FILE);
+		unlink(JOURNAL_FILE);
+		unlink(JOURNAL_NEW_FILE);
+		unlink("snapshot.img");
+		if (chdir("/") == 0) {
+			rmdir(scratch_dir);
+		}
+	}
+}
+
+/*
+ * Makes a scratch directory under $TMPDIR and works in it until the program exits
+*/
+static inline void enter_scratch_dir(void) {
+	const char *tmp = getenv("TMPDIR");
+	snprintf(scratch_dir, sizeof(scratch_dir), "%s/dm510fs-XXXXXX", tmp != NULL ? tmp : "/tmp");
+	if (mkdtemp(scratch_dir) == NULL || chdir(scratch_dir) < 0) {
+		perror("scratch directory");
+		exit(1);
+	}
+	atexit(remove_scratch_dir);
+}
+
+/*
+ * Mounts the image of the scratch directory, making it on the first mount
+*/
+static inline void mount_fs(void) {
+	dm510fs_oper.init(NULL);
+}
+
+/*
+ * Unmounts cleanly
+*/
+static inline void unmount_fs(void) {
+	dm510fs_oper.destroy(NULL);
+}
+
+/*
+ * Stops as a crash would once everything committed is durable: the image is dropped without being saved,
+ * and the next mount replays the journal
+*/
+static inline void crash_fs(void) {
+	journal_wait(journal_last);
+	stop_cache();
+	stop_journal();
+	close_journal();
+	munmap(image, image_size);
+	close(image_fd);
+	munmap(inode_state, (size_t) MAX_INODES * sizeof(InodeState));
+	stop_tracing();
+}
+
+/*
+ * Copies a file, leaving holes where it has zero chunks, so copies of a sparse image stay small
+*/
+static inline void copy_file(const char *from, const char *to) {
+	int in = open(from, O_RDONLY);
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	struct stat st;
+	CHECK(in >= 0 && out >= 0 && fstat(in, &st) == 0 && ftruncate(out, st.st_size) == 0);
+	static char chunk[65536];
+	static const char zeros[65536];
+	off_t at = 0;
+	ssize_t got;
+	while ((got = pread(in, chunk, sizeof(chunk), at)) > 0) {
+		if (memcmp(chunk, zeros, got) != 0) {
+			CHECK(pwrite(out, chunk, got, at) == got);
+		}
+		at += got;
+	}
+	close(in);
+	close(out);
+}
+
+/*
+ * Nanoseconds on the monotonic clock
+*/
+static inline uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the p-th quantile of sorted samples
+*/
+static inline uint64_t quantile(const uint64_t *sorted, size_t count, double p) {
+	if (count == 0) {
+		return 0;
+	}
+	size_t k = (size_t) (p * count);
+	return sorted[k < count ? k : count - 1];
+}
+
+/*
+ * Prints one JSON result line: ops/s over the elapsed time, and the latency quantiles of the samples, which are sorted.
+ * params is a list of JSON members, without braces, describing the run.
+*/
+static inline void print_result(FILE *out, const char *name, const char *params, uint64_t ops, uint64_t elapsed_ns, uint64_t *samples, size_t count) {
+	qsort(samples, count, sizeof(uint64_t), compare_u64);
+	fprintf(out, "{\"name\": \"%s\"%s%s, \"ops\": %llu, \"seconds\": %.6f, \"ops_per_s\": %.1f, "
+		   "\"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}\n",
+		   name, params[0] != '\0' ? ", " : "", params, (unsigned long long) ops, elapsed_ns / 1e9,
+		   elapsed_ns > 0 ? ops * 1e9 / elapsed_ns : 0.0, quantile(samples, count, 0.5) / 1e3,
+		   quantile(samples, count, 0.99) / 1e3, quantile(samples, count, 0.999) / 1e3);
+	fflush(out);
+}
+
+#endif